@@ -0,0 +1,856 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "sm3.h"
+#include "sm4.h"
+#include "buffer.h"
+#include "buffer_ring.h"
+#include "cpu_p.h"
+
+namespace fs = std::filesystem;
+
+// Self-contained benchmark harness. Every case is run until one sample takes
+// at least --min-time, then sampled --repetitions times; the median time per
+// iteration is reported. Results can be written as JSON and compared against
+// an earlier run, with any case slower than --tolerance reported as a
+// regression (and a non-zero exit code). With --counters the Linux hardware
+// counters are read around the samples as well.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Case
+{
+    std::string           name;
+    int64_t               bytes;    // processed per iteration, 0 if not meaningful
+    std::function<void()> run;
+};
+
+struct Result
+{
+    std::string name;
+    int64_t     bytes = 0;
+    int64_t     iterations = 0;
+    double      ns = 0.0;           // median per iteration
+    double      minNs = 0.0;
+    double      maxNs = 0.0;
+
+    // hardware counters per iteration, negative when not available
+    double      cycles = -1.0;
+    double      instructions = -1.0;
+    double      cacheMisses = -1.0;
+    double      branchMisses = -1.0;
+
+    double mbPerSecond() const
+    {
+        return ns > 0 && bytes > 0 ? bytes / ns * 1e3 : 0.0;
+    }
+
+    double cyclesPerByte() const
+    {
+        return cycles >= 0 && bytes > 0 ? cycles / bytes : -1.0;
+    }
+
+    double ipc() const
+    {
+        return cycles > 0 && instructions >= 0 ? instructions / cycles : -1.0;
+    }
+};
+
+struct Options
+{
+    std::string filter;
+    std::string json;
+    std::string compare;
+    double      minTime = 0.05;     // seconds per sample
+    int         repetitions = 5;
+    double      tolerance = 5.0;    // percent
+    bool        list = false;
+    bool        counters = false;
+};
+
+enum Counter { Cycles, Instructions, CacheMisses, BranchMisses, CounterCount };
+
+// Hardware counters through perf_event_open(2), user space only so that the
+// default perf_event_paranoid setting allows them. Counters are inherited by
+// the worker threads of the parallel modes. Any counter that cannot be opened
+// (no permission, virtual machine, other OS) reads as -1.
+class PerfCounters
+{
+public:
+    PerfCounters()
+    {
+#ifdef __linux__
+        static const uint64_t configs[CounterCount] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+
+        for (int i = 0; i < CounterCount; ++i) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            m_fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool isValid() const
+    {
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop()
+    {
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // counted events since start(), scaled up when the kernel had to
+    // multiplex the counters; -1 if the counter is not available
+    double value(Counter counter) const
+    {
+#ifdef __linux__
+        uint64_t data[3];
+        int fd = m_fds[counter];
+        if (fd < 0 || read(fd, data, sizeof(data)) != (ssize_t)sizeof(data) || data[2] == 0) {
+            return -1.0;
+        }
+        return data[2] < data[1] ? (double)data[0] * data[1] / data[2] : (double)data[0];
+#else
+        (void)counter;
+        return -1.0;
+#endif
+    }
+
+private:
+    int m_fds[CounterCount] = { -1, -1, -1, -1 };
+};
+
+// keeps results alive so the work is not optimized away
+volatile char sink;
+
+void consume(const Buffer& buffer)
+{
+    if (!buffer.isEmpty()) {
+        sink = buffer.data()[0];
+    }
+}
+
+void consume(const std::string& str)
+{
+    if (!str.empty()) {
+        sink = str[0];
+    }
+}
+
+Buffer randomBuffer(int size)
+{
+    Buffer buffer{ size };
+    uint32_t x = 0x12345678u ^ (uint32_t)size;
+    for (int i = 0; i < size; ++i) {
+        x = x * 1664525u + 1013904223u;
+        buffer[i] = static_cast<char>(x >> 24);
+    }
+    return buffer;
+}
+
+std::string sizeName(int64_t size)
+{
+    if (size >= 1024 * 1024 && size % (1024 * 1024) == 0) {
+        return std::to_string(size / (1024 * 1024)) + "MiB";
+    }
+    if (size >= 1024 && size % 1024 == 0) {
+        return std::to_string(size / 1024) + "KiB";
+    }
+    return std::to_string(size) + "B";
+}
+
+// ---- cases ----
+
+void addBufferCases(std::vector<Case>& cases)
+{
+    cases.push_back({ "buffer/append/char/4KiB", 4096, [] {
+        Buffer buffer;
+        for (int i = 0; i < 4096; ++i) {
+            buffer.append('x');
+        }
+        consume(buffer);
+    } });
+
+    for (int chunk : { 16, 64, 4096 }) {
+        int total = chunk == 4096 ? 4 * 1024 * 1024 : 1024 * 1024;
+        auto data = std::make_shared<Buffer>(randomBuffer(chunk));
+        cases.push_back({ "buffer/append/" + sizeName(chunk) + "-to-" + sizeName(total), total, [data, chunk, total] {
+            Buffer buffer;
+            for (int n = 0; n < total; n += chunk) {
+                buffer.append(*data);
+            }
+            consume(buffer);
+        } });
+    }
+
+    auto head = std::make_shared<Buffer>(randomBuffer(16));
+    cases.push_back({ "buffer/insert-front/16B-x1000", 16 * 1000, [head] {
+        Buffer buffer;
+        for (int i = 0; i < 1000; ++i) {
+            buffer.insert(0, *head);
+        }
+        consume(buffer);
+    } });
+
+    // three protocol layers each put a 16-byte header in front of a body
+    auto body = std::make_shared<Buffer>(randomBuffer(1024 * 1024));
+    for (int headroom : { 0, 64 }) {
+        cases.push_back({ "buffer/layers/3x16B-on-1MiB-headroom-" + std::to_string(headroom), 1024 * 1024, [body, head, headroom] {
+            Buffer buffer;
+            buffer.reserveHeadroom(headroom);
+            buffer.append(*body);
+            for (int i = 0; i < 3; ++i) {
+                buffer.prepend(*head);
+            }
+            consume(buffer);
+        } });
+    }
+
+    // a received frame: allocate, fill, drop
+    cases.push_back({ "buffer/frame/64KiB-malloc", 64 * 1024, [] {
+        Buffer frame;
+        frame.resizeForOverwrite(64 * 1024);
+        memset(frame.data(), 0x5a, 1500);
+        consume(frame);
+    } });
+
+    auto pool = std::make_shared<BufferPool>();
+    cases.push_back({ "buffer/frame/64KiB-pool", 64 * 1024, [pool] {
+        auto frame = pool->acquire(64 * 1024);
+        memset(frame.data(), 0x5a, 1500);
+        consume(frame);
+    } });
+
+    cases.push_back({ "buffer/writer-reader/1000-records", 1000 * (1 + 2 + 4 + 8 + 4 + 16), [] {
+        Buffer buffer;
+        {
+            BufferWriter writer{ buffer };
+            for (int i = 0; i < 1000; ++i) {
+                writer << (uint8_t)i << (uint16_t)i << (uint32_t)i << (uint64_t)i << std::string{ "0123456789abcdef" };
+            }
+        }
+
+        BufferReader reader{ buffer };
+        uint8_t a;
+        uint16_t b;
+        uint32_t c;
+        uint64_t d;
+        std::string s;
+        uint64_t sum = 0;
+        for (int i = 0; i < 1000; ++i) {
+            reader >> a >> b >> c >> d >> s;
+            sum += a + b + c + d + s.size();
+        }
+        sink = static_cast<char>(sum);
+    } });
+}
+
+void addCodecCases(std::vector<Case>& cases)
+{
+    for (int size : { 64, 4096, 1024 * 1024 }) {
+        auto data = std::make_shared<Buffer>(randomBuffer(size));
+        auto hex = std::make_shared<std::string>(data->toHex());
+        auto base64 = std::make_shared<std::string>(data->toBase64());
+
+        cases.push_back({ "codec/hex/encode/" + sizeName(size), size, [data] { consume(data->toHex()); } });
+        cases.push_back({ "codec/hex/decode/" + sizeName(size), size, [hex] { consume(Buffer::fromHex(*hex)); } });
+        cases.push_back({ "codec/base64/encode/" + sizeName(size), size, [data] { consume(data->toBase64()); } });
+        cases.push_back({ "codec/base64/decode/" + sizeName(size), size, [base64] { consume(Buffer::fromBase64(*base64)); } });
+    }
+}
+
+void addSm3Cases(std::vector<Case>& cases, const fs::path& tempDir)
+{
+    for (int size : { 64, 4096, 1024 * 1024, 16 * 1024 * 1024 }) {
+        auto data = std::make_shared<Buffer>(randomBuffer(size));
+        cases.push_back({ "sm3/encode/" + sizeName(size), size, [data] { consume(sm3::encode(*data)); } });
+    }
+
+    auto stream = std::make_shared<Buffer>(randomBuffer(16 * 1024 * 1024));
+    cases.push_back({ "sm3/stream/16MiB-in-4KiB", stream->size(), [stream] {
+        Sm3Hash hash;
+        for (int pos = 0; pos < stream->size(); pos += 4096) {
+            hash.update(stream->data() + pos, std::min(4096, stream->size() - pos));
+        }
+        consume(hash.finish());
+    } });
+
+    // the file is written once and stays in the page cache
+    int size = 16 * 1024 * 1024;
+    auto path = tempDir / "sm3-file.bin";
+    {
+        auto data = randomBuffer(size);
+        std::ofstream ofs{ path, std::ios::binary };
+        ofs.write(data.data(), data.size());
+    }
+    cases.push_back({ "sm3/file/" + sizeName(size), size, [path] { consume(sm3::sum(path)); } });
+}
+
+void addSm4Cases(std::vector<Case>& cases)
+{
+    auto key = std::make_shared<Buffer>("0123456789abcdef", 16);
+
+    for (int size : { 16, 256, 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 }) {
+        auto data = std::make_shared<Buffer>(randomBuffer(size));
+        auto cipher = std::make_shared<Buffer>();
+        sm4::encrypt(*data, *key, *cipher);
+
+        cases.push_back({ "sm4/cbc/encrypt/" + sizeName(size), size, [data, key] {
+            Buffer output;
+            sm4::encrypt(*data, *key, output);
+            consume(output);
+        } });
+        cases.push_back({ "sm4/cbc/decrypt/" + sizeName(size), size, [cipher, key] {
+            Buffer output;
+            sm4::decrypt(*cipher, *key, output);
+            consume(output);
+        } });
+    }
+}
+
+// What the rings replace: a std::queue under a mutex, bounded the same way.
+class MutexQueue
+{
+public:
+    explicit MutexQueue(int capacity) : m_capacity{ static_cast<size_t>(capacity) } {}
+
+    bool push(Buffer& buffer)
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        m_notFull.wait(lock, [this] { return m_closed || m_queue.size() < m_capacity; });
+        if (m_closed) {
+            return false;
+        }
+        m_queue.push(std::move(buffer));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(Buffer& buffer)
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        m_notEmpty.wait(lock, [this] { return m_closed || !m_queue.empty(); });
+        if (m_queue.empty()) {
+            return false;
+        }
+        buffer = std::move(m_queue.front());
+        m_queue.pop();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+private:
+    size_t                  m_capacity;
+    std::mutex              m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::queue<Buffer>      m_queue;
+    bool                    m_closed = false;
+};
+
+constexpr int QueueMessages = 64 * 1024;
+constexpr int QueueMessageSize = 64;
+constexpr int QueueCapacity = 1024;
+constexpr int QueueBatch = 16;
+
+// Every producer sends its share of QueueMessages buffers, consumers drain
+// the queue until it is closed. With batch > 1 the ring batch calls are used,
+// falling back to the blocking ones when a batch call moves nothing.
+template<typename Queue>
+void transfer(Queue& queue, int producers, int consumers, int batch)
+{
+    std::atomic<uint64_t> received{ 0 };
+    std::vector<std::thread> senders;
+    std::vector<std::thread> receivers;
+
+    for (int p = 0; p < producers; ++p) {
+        senders.emplace_back([&queue, producers, batch] {
+            std::vector<Buffer> buffers(batch);
+            for (int sent = 0; sent < QueueMessages / producers;) {
+                int n = std::min(batch, QueueMessages / producers - sent);
+                for (int i = 0; i < n; ++i) {
+                    // after a swap the buffer is one a consumer let go of
+                    if (buffers[i].size() != QueueMessageSize) {
+                        buffers[i].resizeForOverwrite(QueueMessageSize);
+                    }
+                    buffers[i].data()[0] = static_cast<char>(sent + i);
+                }
+
+                if constexpr (std::is_same<Queue, MutexQueue>::value) {
+                    queue.push(buffers[0]);
+                    n = 1;
+                }
+                else {
+                    n = batch > 1 ? queue.tryPush(buffers.data(), n) : 0;
+                    if (n == 0) {
+                        queue.push(buffers[0]);
+                        n = 1;
+                    }
+                }
+                sent += n;
+            }
+        });
+    }
+
+    for (int c = 0; c < consumers; ++c) {
+        receivers.emplace_back([&queue, &received, batch] {
+            std::vector<Buffer> buffers(batch);
+            uint64_t sum = 0;
+            for (;;) {
+                int n = 0;
+                if constexpr (!std::is_same<Queue, MutexQueue>::value) {
+                    n = batch > 1 ? queue.tryPop(buffers.data(), batch) : 0;
+                }
+                if (n == 0) {
+                    if (!queue.pop(buffers[0])) {
+                        break;
+                    }
+                    n = 1;
+                }
+                for (int i = 0; i < n; ++i) {
+                    sum += static_cast<unsigned char>(buffers[i].data()[0]);
+                }
+            }
+            received += sum;
+        });
+    }
+
+    for (auto& thread : senders) {
+        thread.join();
+    }
+    queue.close();
+    for (auto& thread : receivers) {
+        thread.join();
+    }
+    sink = static_cast<char>(received.load());
+}
+
+void addQueueCases(std::vector<Case>& cases)
+{
+    int64_t bytes = static_cast<int64_t>(QueueMessages) * QueueMessageSize;
+    auto suffix = [](int threads) {
+        return "/" + std::to_string(threads) + "x" + std::to_string(threads) + "-64Ki-msgs";
+    };
+
+    // 1 to 16 producer/consumer pairs, 2 to 32 threads
+    for (int threads : { 1, 2, 4, 8, 16 }) {
+        cases.push_back({ "queue/mutex" + suffix(threads), bytes, [threads] {
+            MutexQueue queue{ QueueCapacity };
+            transfer(queue, threads, threads, 1);
+        } });
+
+        if (threads == 1) {
+            cases.push_back({ "queue/spsc-ring" + suffix(threads), bytes, [] {
+                BufferSpscRing ring{ QueueCapacity };
+                transfer(ring, 1, 1, 1);
+            } });
+            cases.push_back({ "queue/spsc-ring-batch" + suffix(threads), bytes, [] {
+                BufferSpscRing ring{ QueueCapacity };
+                transfer(ring, 1, 1, QueueBatch);
+            } });
+        }
+
+        cases.push_back({ "queue/mpmc-ring" + suffix(threads), bytes, [threads] {
+            BufferMpmcRing ring{ QueueCapacity };
+            transfer(ring, threads, threads, 1);
+        } });
+        cases.push_back({ "queue/mpmc-ring-batch" + suffix(threads), bytes, [threads] {
+            BufferMpmcRing ring{ QueueCapacity };
+            transfer(ring, threads, threads, QueueBatch);
+        } });
+    }
+}
+
+// ---- running ----
+
+double timeIterations(const Case& c, int64_t iterations)
+{
+    auto start = Clock::now();
+    for (int64_t i = 0; i < iterations; ++i) {
+        c.run();
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+Result measure(const Case& c, const Options& options, PerfCounters* counters)
+{
+    Result result;
+    result.name = c.name;
+    result.bytes = c.bytes;
+
+    // warm up caches and lazily selected kernels
+    c.run();
+
+    // grow the iteration count until one sample lasts long enough
+    int64_t iterations = 1;
+    for (;;) {
+        double t = timeIterations(c, iterations);
+        if (t >= options.minTime || iterations >= ((int64_t)1 << 30)) {
+            break;
+        }
+        double scale = t > 0 ? options.minTime / t * 1.2 : 10.0;
+        iterations = std::max(iterations * 2, (int64_t)(iterations * std::min(scale, 100.0)));
+    }
+
+    // the counters cover all samples, the overhead of toggling them is
+    // outside the timed loops
+    double values[CounterCount] = { 0, 0, 0, 0 };
+    std::vector<double> samples;
+    for (int r = 0; r < options.repetitions; ++r) {
+        if (counters) {
+            counters->start();
+        }
+        samples.push_back(timeIterations(c, iterations) / iterations * 1e9);
+        if (counters) {
+            counters->stop();
+            for (int i = 0; i < CounterCount; ++i) {
+                double value = counters->value((Counter)i);
+                values[i] = value < 0 || values[i] < 0 ? -1.0 : values[i] + value;
+            }
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+
+    if (counters) {
+        double total = (double)iterations * options.repetitions;
+        auto perIteration = [total](double value) { return value < 0 ? -1.0 : value / total; };
+        result.cycles = perIteration(values[Cycles]);
+        result.instructions = perIteration(values[Instructions]);
+        result.cacheMisses = perIteration(values[CacheMisses]);
+        result.branchMisses = perIteration(values[BranchMisses]);
+    }
+
+    result.iterations = iterations;
+    result.ns = samples[samples.size() / 2];
+    result.minNs = samples.front();
+    result.maxNs = samples.back();
+    return result;
+}
+
+std::string toJson(const std::vector<Result>& results)
+{
+    std::ostringstream out;
+    char line[512];
+
+    out << "{\n  \"context\": {\n";
+    out << "    \"compiler\": \"" << __VERSION__ << "\",\n";
+    out << "    \"threads\": " << std::thread::hardware_concurrency() << ",\n";
+    out << "    \"cpu\": \"" << cpu_report() << "\"\n";
+    out << "  },\n  \"benchmarks\": [\n";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& r = results[i];
+        snprintf(line, sizeof(line),
+                 "    { \"name\": \"%s\", \"bytes\": %lld, \"iterations\": %lld, \"ns_per_op\": %.3f, "
+                 "\"min_ns\": %.3f, \"max_ns\": %.3f, \"mb_per_s\": %.3f",
+                 r.name.c_str(), (long long)r.bytes, (long long)r.iterations, r.ns, r.minNs, r.maxNs,
+                 r.mbPerSecond());
+        out << line;
+
+        if (r.cycles >= 0) {
+            snprintf(line, sizeof(line),
+                     ", \"cycles\": %.1f, \"instructions\": %.1f, \"cache_misses\": %.1f, "
+                     "\"branch_misses\": %.1f, \"cycles_per_byte\": %.3f, \"ipc\": %.3f",
+                     r.cycles, r.instructions, r.cacheMisses, r.branchMisses, r.cyclesPerByte(), r.ipc());
+            out << line;
+        }
+        out << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+// Reads back what toJson() wrote: the name and ns_per_op of every entry.
+bool loadBaseline(const std::string& path, std::map<std::string, double>& baseline)
+{
+    std::ifstream ifs{ path };
+    if (!ifs) {
+        return false;
+    }
+
+    std::string text{ std::istreambuf_iterator<char>{ ifs }, std::istreambuf_iterator<char>{} };
+    const std::string nameKey = "\"name\": \"";
+    const std::string nsKey = "\"ns_per_op\": ";
+
+    size_t pos = 0;
+    while ((pos = text.find(nameKey, pos)) != std::string::npos) {
+        pos += nameKey.size();
+        auto end = text.find('"', pos);
+        auto ns = text.find(nsKey, end);
+        if (end == std::string::npos || ns == std::string::npos) {
+            break;
+        }
+
+        baseline[text.substr(pos, end - pos)] = atof(text.c_str() + ns + nsKey.size());
+        pos = ns;
+    }
+    return true;
+}
+
+int compare(const std::vector<Result>& results, const std::map<std::string, double>& baseline, double tolerance)
+{
+    int regressions = 0;
+    int improvements = 0;
+
+    printf("\n%-44s %14s %14s %9s\n", "comparison", "baseline ns", "current ns", "change");
+    for (auto& r : results) {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second <= 0) {
+            printf("%-44s %14s %14.1f %9s\n", r.name.c_str(), "-", r.ns, "new");
+            continue;
+        }
+
+        double change = (r.ns - it->second) / it->second * 100.0;
+        const char* status = "";
+        if (change > tolerance) {
+            status = "  REGRESSION";
+            ++regressions;
+        }
+        else if (change < -tolerance) {
+            status = "  improved";
+            ++improvements;
+        }
+        printf("%-44s %14.1f %14.1f %+8.1f%%%s\n", r.name.c_str(), it->second, r.ns, change, status);
+    }
+
+    printf("\n%d regression%s, %d improvement%s beyond %.1f%%\n",
+           regressions, regressions == 1 ? "" : "s", improvements, improvements == 1 ? "" : "s", tolerance);
+    return regressions;
+}
+
+void printCounter(double value, int width, int precision)
+{
+    if (value < 0) {
+        printf(" %*s", width, "-");
+    }
+    else {
+        printf(" %*.*f", width, precision, value);
+    }
+}
+
+void usage()
+{
+    fprintf(stderr,
+            "Usage: benchmark [OPTION]...\n"
+            "Benchmark Buffer, the hex/base64 codecs, SM3 and SM4.\n"
+            "\n"
+            "      --filter TEXT      run only cases whose name contains TEXT\n"
+            "      --list             list the cases and exit\n"
+            "      --min-time S       minimum seconds per sample (default 0.05)\n"
+            "      --repetitions N    samples per case, the median is reported (default 5)\n"
+            "      --json FILE        write the results as JSON\n"
+            "      --compare FILE     compare with a JSON file from an earlier run\n"
+            "      --tolerance PCT    change reported as a regression (default 5)\n"
+            "      --counters         read the hardware performance counters (Linux)\n"
+            "  -h, --help             display this help and exit\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string{ argv[i] };
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--filter" && hasValue) {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--list") {
+            options.list = true;
+        }
+        else if (arg == "--counters") {
+            options.counters = true;
+        }
+        else if (arg == "--min-time" && hasValue) {
+            options.minTime = std::max(0.001, atof(argv[++i]));
+        }
+        else if (arg == "--repetitions" && hasValue) {
+            options.repetitions = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--json" && hasValue) {
+            options.json = argv[++i];
+        }
+        else if (arg == "--compare" && hasValue) {
+            options.compare = argv[++i];
+        }
+        else if (arg == "--tolerance" && hasValue) {
+            options.tolerance = atof(argv[++i]);
+        }
+        else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (!options.compare.empty() && !loadBaseline(options.compare, baseline)) {
+        fprintf(stderr, "benchmark: %s: cannot read\n", options.compare.c_str());
+        return 1;
+    }
+
+    std::error_code ec;
+    auto tempDir = fs::temp_directory_path(ec) / ("buffer-benchmark-" + std::to_string(Clock::now().time_since_epoch().count()));
+    fs::create_directories(tempDir, ec);
+
+    std::vector<Case> cases;
+    addBufferCases(cases);
+    addCodecCases(cases);
+    addSm3Cases(cases, tempDir);
+    addSm4Cases(cases);
+    addQueueCases(cases);
+
+    std::unique_ptr<PerfCounters> counters;
+    if (options.counters && !options.list) {
+        counters.reset(new PerfCounters);
+        if (!counters->isValid()) {
+            fprintf(stderr, "benchmark: hardware counters not available (check perf_event_paranoid), timing only\n");
+            counters.reset();
+        }
+    }
+
+    std::vector<Result> results;
+    if (!options.list) {
+        printf("%-44s %12s %14s %12s", "case", "iterations", "ns/op", "MB/s");
+        if (counters) {
+            printf(" %10s %6s %12s %12s", "cycles/B", "IPC", "cache-miss", "branch-miss");
+        }
+        printf("\n");
+    }
+    for (auto& c : cases) {
+        if (!options.filter.empty() && c.name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        if (options.list) {
+            printf("%s\n", c.name.c_str());
+            continue;
+        }
+
+        auto result = measure(c, options, counters.get());
+        printf("%-44s %12lld %14.1f %12.1f", result.name.c_str(), (long long)result.iterations, result.ns, result.mbPerSecond());
+        if (counters) {
+            printCounter(result.cyclesPerByte(), 10, 2);
+            printCounter(result.ipc(), 6, 2);
+            printCounter(result.cacheMisses, 12, 1);
+            printCounter(result.branchMisses, 12, 1);
+        }
+        printf("\n");
+        fflush(stdout);
+        results.push_back(result);
+    }
+
+    fs::remove_all(tempDir, ec);
+
+    if (!options.list) {
+        printf("\n%s\n", cpu_report().c_str());
+    }
+
+    if (!options.json.empty()) {
+        std::ofstream ofs{ options.json };
+        ofs << toJson(results);
+        if (!ofs) {
+            fprintf(stderr, "benchmark: %s: cannot write\n", options.json.c_str());
+            return 1;
+        }
+    }
+
+    if (!options.compare.empty()) {
+        return compare(results, baseline, options.tolerance) > 0 ? 1 : 0;
+    }
+    return 0;
+}
@@ -1,5 +1,12 @@
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "buffer.h"
 #include "endian.h"
 
@@ -74,7 +81,7 @@ Buffer Hex::decode(const std::string& hex)
     std::string hexStr;
     char* data;
     char ch;
-    size_t i = 0;
+    int i = 0;
     int j = 0;
 
     auto size = static_cast<int>(hex.size());
@@ -195,24 +202,228 @@ Buffer Base64::decode(const std::string& base64)
     return Buffer{ ret };
 }
 
+#ifdef BUFFER_STATS
+
+enum BufferStatIndex
+{
+    StatAllocations,
+    StatAllocatedBytes,
+    StatReallocations,
+    StatCopiedBytes,
+    StatCopies,
+    StatMoves,
+    StatCount
+};
+
+// Counters of one thread. Only the owning thread writes them, so an update is
+// a relaxed load and store without a locked instruction; snapshots read them
+// from any thread.
+struct BufferStatsBlock
+{
+    BufferStatsBlock();
+    ~BufferStatsBlock();
+
+    std::atomic<uint64_t> values[StatCount];
+};
+
+struct BufferStatsRegistry
+{
+    std::mutex                     mutex;
+    std::vector<BufferStatsBlock*> blocks;
+    uint64_t                       retired[StatCount] = {};    // threads that have exited
+    uint64_t                       base[StatCount] = {};       // totals at the last reset()
+
+    void total(uint64_t values[StatCount])
+    {
+        for (int i = 0; i < StatCount; ++i) {
+            values[i] = retired[i];
+        }
+        for (auto block : blocks) {
+            for (int i = 0; i < StatCount; ++i) {
+                values[i] += block->values[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// never destroyed, threads may still exit after static destruction
+BufferStatsRegistry& statsRegistry()
+{
+    static auto registry = new BufferStatsRegistry;
+    return *registry;
+}
+
+BufferStatsBlock::BufferStatsBlock()
+{
+    for (auto& value : values) {
+        value.store(0, std::memory_order_relaxed);
+    }
+
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock{ registry.mutex };
+    registry.blocks.push_back(this);
+}
+
+BufferStatsBlock::~BufferStatsBlock()
+{
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock{ registry.mutex };
+    for (int i = 0; i < StatCount; ++i) {
+        registry.retired[i] += values[i].load(std::memory_order_relaxed);
+    }
+    registry.blocks.erase(std::find(registry.blocks.begin(), registry.blocks.end(), this));
+}
+
+inline void bufferStat(BufferStatIndex index, uint64_t n)
+{
+    thread_local BufferStatsBlock block;
+    auto& value = block.values[index];
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+#define BUFFER_STAT(index, n) bufferStat(Stat##index, static_cast<uint64_t>(n))
+
+#else
+
+#define BUFFER_STAT(index, n) ((void)0)
+
+#endif
+
+// An idle pooled block; the link is kept in the block itself.
+struct BufferPoolBlock
+{
+    BufferPoolBlock* next;
+};
+
+// One thread's free list in a pool. The owning thread pushes and pops
+// `local` without synchronization. Other threads push onto `remote`, which
+// the owner only ever takes whole, so there is no concurrent pop (and no ABA).
+struct BufferPoolCache
+{
+    explicit BufferPoolCache(BufferPoolPrivate* pool) : pool{ pool } {}
+
+    BufferPoolPrivate*       pool;
+    std::atomic<const void*> owner{ nullptr };     // thread token, null once orphaned
+    BufferPoolBlock*         local = nullptr;
+
+    // written by the owner only
+    std::atomic<uint64_t>    localBlocks{ 0 };
+    std::atomic<uint64_t>    hits{ 0 };
+    std::atomic<uint64_t>    misses{ 0 };
+    std::atomic<uint64_t>    returns{ 0 };
+    std::atomic<uint64_t>    drops{ 0 };
+
+    // written by other threads, kept off the owner's cache line
+    alignas(64) std::atomic<BufferPoolBlock*> remote{ nullptr };
+    std::atomic<uint64_t>    remoteBlocks{ 0 };
+    std::atomic<uint64_t>    remoteReturns{ 0 };
+    std::atomic<uint64_t>    remoteDrops{ 0 };
+};
+
+inline void increment(std::atomic<uint64_t>& value)
+{
+    value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// identifies the calling thread, valid for its whole lifetime
+const void* poolThreadToken()
+{
+    thread_local char token;
+    return &token;
+}
+
+// The caches the calling thread owns, one per pool it has used. Each holds a
+// reference on its pool; caches of destroyed pools are given up on the next
+// lookup, or when the thread exits.
+class BufferPoolThread
+{
+public:
+    ~BufferPoolThread();
+
+    BufferPoolCache* cache(BufferPoolPrivate* pool);
+    void detach(BufferPoolPrivate* pool);
+
+private:
+    std::vector<BufferPoolCache*> m_caches;
+};
+
+BufferPoolThread& poolThread()
+{
+    thread_local BufferPoolThread thread;
+    return thread;
+}
+
 template<typename T>
-BufferReader& read(BufferReader& reader, T& data)
+BufferReader& readBigEndian(BufferReader& reader, T& data)
 {
     if (reader.read((char*)&data, sizeof(T)) == sizeof(T)) {
-        data = crypto::fromBigEndian(data);
+        data = fromBigEndian(data);
     }
     return reader;
 }
 
 template<typename T>
-BufferWriter& write(BufferWriter& writer, T data)
+BufferWriter& writeBigEndian(BufferWriter& writer, T data)
 {
-    auto v = crypto::toBigEndian(data);
+    auto v = toBigEndian(data);
     return writer.write((const char*)&v, sizeof(T));
 }
 
+template<typename T>
+BufferWriter& writeBigEndianAt(BufferWriter& writer, int position, T data)
+{
+    auto v = toBigEndian(data);
+    return writer.writeAt(position, (const char*)&v, sizeof(T));
 }
 
+}
+
+class BufferPoolPrivate
+{
+public:
+    explicit BufferPoolPrivate(const BufferPoolOptions& options);
+    ~BufferPoolPrivate();
+
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref();
+
+    int bufferSize() const { return m_bufferSize; }
+    bool isClosed() const { return m_closed.load(std::memory_order_acquire); }
+
+    // a block from the calling thread's cache, or a new one
+    char* acquire(BufferPoolCache*& cache);
+    void release(BufferPoolCache* cache, char* data);
+    void miss();
+
+    // a new or orphaned cache for the calling thread, and giving it up
+    BufferPoolCache* attach();
+    void detach(BufferPoolCache* cache);
+
+    // the pool object is gone, only outstanding buffers keep this alive
+    void close();
+
+    BufferPoolStats stats();
+
+private:
+    uint64_t share() const;
+    void trim(BufferPoolCache* cache, uint64_t blocks);
+    uint64_t freeList(BufferPoolBlock* block);
+
+private:
+    int                                           m_bufferSize;
+    uint64_t                                      m_maxBlocks;
+    std::atomic<int>                              m_refs{ 1 };
+    std::atomic<bool>                             m_closed{ false };
+    std::atomic<int>                              m_owned{ 0 };       // caches with a live thread
+    std::mutex                                    m_mutex;
+    std::vector<std::unique_ptr<BufferPoolCache>> m_caches;
+};
+
+// The contents start m_offset bytes into the allocated block: removing from
+// the front only advances m_data, and inserting near the front can move the
+// front part back into that space instead of moving the rest. m_capacity
+// counts from m_data to the end of the block. Reallocations leave
+// m_headroom bytes free in front.
 class BufferPrivate
 {
 public:
@@ -223,31 +434,46 @@ public:
     bool isEmpty() const { return (m_size == 0); }
     int size() const { return m_size; }
     int capacity() const { return m_capacity; }
+    int headroom() const { return m_offset; }
 
     const char* data() const { return m_data; }
     char* data() { return m_data; }
 
-    void reserve(int size);
-    void resize(int size);
+    void reserve(int size, bool zero = true);
+    void reserveHeadroom(int size);
+    void resize(int size, bool zero = true);
     void truncate(int size);
 
     void insert(int pos, const char* data, int size);
     void remove(int pos, int len);
     void clear();
 
+    // takes over a block of a pool, which gets it back when freed
+    void adopt(char* data, int capacity, BufferPoolCache* pool);
+
     BufferPrivate& operator=(const BufferPrivate& other);
     BufferPrivate& operator=(BufferPrivate&& other);
 
 private:
-    int   m_size;
-    int   m_capacity;
-    char* m_data;
+    void reallocate(int size, bool zero);
+    void release(char* data);
+
+private:
+    int              m_size;
+    int              m_capacity;
+    int              m_offset;
+    int              m_headroom;
+    char*            m_data;
+    BufferPoolCache* m_pool;
 };
 
 BufferPrivate::BufferPrivate(int size)
     : m_size{ 0 }
     , m_capacity{ 0 }
+    , m_offset{ 0 }
+    , m_headroom{ 0 }
     , m_data{ nullptr }
+    , m_pool{ nullptr }
 {
     resize(size);
 }
@@ -255,7 +481,10 @@ BufferPrivate::BufferPrivate(int size)
 BufferPrivate::BufferPrivate(const char* data, int size)
     : m_size{ 0 }
     , m_capacity{ 0 }
+    , m_offset{ 0 }
+    , m_headroom{ 0 }
     , m_data{ nullptr }
+    , m_pool{ nullptr }
 {
     insert(0, data, size);
 }
@@ -265,29 +494,60 @@ BufferPrivate::~BufferPrivate()
     clear();
 }
 
-void BufferPrivate::reserve(int size)
+void BufferPrivate::reserve(int size, bool zero)
 {
     if (size <= m_capacity) {
         return;
     }
 
-    auto tmp = reinterpret_cast<char*>(malloc(size));
-    memset(tmp, 0, size);
-    if (m_size > 0) {
-        memcpy(tmp, m_data, m_size);
-        free(m_data);
+    reallocate(size, zero);
+}
+
+void BufferPrivate::reserveHeadroom(int size)
+{
+    m_headroom = std::max(0, size);
+    if (m_data && m_offset < m_headroom) {
+        reallocate(std::max(m_capacity, m_size), true);
     }
+}
 
-    m_data = tmp;
+// a new block with m_headroom bytes in front and room for size bytes
+void BufferPrivate::reallocate(int size, bool zero)
+{
+    auto total = m_headroom + size;
+    auto tmp = reinterpret_cast<char*>(malloc(total));
+    BUFFER_STAT(Allocations, 1);
+    BUFFER_STAT(AllocatedBytes, total);
+    if (zero) {
+        memset(tmp, 0, total);
+    }
+    if (m_data) {
+        if (m_size > 0) {
+            memcpy(tmp + m_headroom, m_data, m_size);
+            BUFFER_STAT(Reallocations, 1);
+            BUFFER_STAT(CopiedBytes, m_size);
+        }
+        release(m_data - m_offset);
+    }
+
+    m_data = tmp + m_headroom;
+    m_offset = m_headroom;
     m_capacity = size;
 }
 
-void BufferPrivate::resize(int size)
+void BufferPrivate::resize(int size, bool zero)
 {
-    reserve(size);
-    if (size >= 0) {
-        m_size = size;
+    if (size < 0) {
+        return;
+    }
+
+    // the bytes past m_size may be anything: left over from remove(), or
+    // from the previous owner of a pooled block
+    reserve(size, false);
+    if (zero && size > m_size) {
+        memset(m_data + m_size, 0, size - m_size);
     }
+    m_size = size;
 }
 
 void BufferPrivate::truncate(int size)
@@ -300,15 +560,8 @@ void BufferPrivate::truncate(int size)
         return;
     }
 
-    auto tmp = reinterpret_cast<char*>(malloc(size));
-    if (m_size > 0) {
-        memcpy(tmp, m_data, size);
-        free(m_data);
-    }
-
     m_size = size;
-    m_capacity = size;
-    m_data = tmp;
+    reallocate(size, false);
 }
 
 void BufferPrivate::insert(int pos, const char* data, int size)
@@ -322,6 +575,29 @@ void BufferPrivate::insert(int pos, const char* data, int size)
         len = static_cast<int>(strlen(data)) + 1;
     }
 
+    auto front = pos < m_size && pos <= m_size - pos;
+    if (front && len > m_offset && len <= m_headroom) {
+        // the headroom is used up; the data has to move anyway, so make room
+        // in front again
+        reallocate(std::max(m_capacity, m_size), false);
+    }
+
+    // in the headroom, moving the part in front of pos back
+    if (front && len <= m_offset) {
+        if (pos > 0) {
+            memmove(m_data - len, m_data, pos);
+            BUFFER_STAT(CopiedBytes, pos);
+        }
+        m_data -= len;
+        m_offset -= len;
+        m_capacity += len;
+        m_size += len;
+
+        memcpy(m_data + pos, data, len);
+        BUFFER_STAT(CopiedBytes, len);
+        return;
+    }
+
     auto left = m_capacity - m_size;
     if (len > left) {
         left += (((len + 64) / 64 + 1) * 64);
@@ -337,15 +613,31 @@ void BufferPrivate::insert(int pos, const char* data, int size)
     else {
         if (m_size > 0) {
             memmove(m_data + pos + len, m_data + pos, m_size - pos);
+            BUFFER_STAT(CopiedBytes, m_size - pos);
         }
         memcpy(m_data + pos, data, len);
     }
+    BUFFER_STAT(CopiedBytes, len);
     m_size += len;
 }
 
 void BufferPrivate::remove(int pos, int len)
 {
-    memmove(m_data + pos, m_data + pos + len, m_size - pos - len);
+    // whichever side of the removed range is shorter moves
+    auto after = m_size - pos - len;
+    if (pos < after) {
+        if (pos > 0) {
+            memmove(m_data + len, m_data, pos);
+            BUFFER_STAT(CopiedBytes, pos);
+        }
+        m_data += len;
+        m_offset += len;
+        m_capacity -= len;
+    }
+    else if (after > 0) {
+        memmove(m_data + pos, m_data + pos + len, after);
+        BUFFER_STAT(CopiedBytes, after);
+    }
     m_size -= len;
 }
 
@@ -355,9 +647,30 @@ void BufferPrivate::clear()
     m_capacity = 0;
 
     if (m_data) {
-        free(m_data);
+        release(m_data - m_offset);
         m_data = nullptr;
     }
+    m_offset = 0;
+}
+
+void BufferPrivate::adopt(char* data, int capacity, BufferPoolCache* pool)
+{
+    clear();
+
+    m_data = data;
+    m_capacity = capacity;
+    m_pool = pool;
+}
+
+void BufferPrivate::release(char* data)
+{
+    if (m_pool) {
+        m_pool->pool->release(m_pool, data);
+        m_pool = nullptr;
+    }
+    else {
+        free(data);
+    }
 }
 
 BufferPrivate& BufferPrivate::operator=(const BufferPrivate& other)
@@ -366,6 +679,7 @@ BufferPrivate& BufferPrivate::operator=(const BufferPrivate& other)
         return *this;
     }
 
+    BUFFER_STAT(Copies, 1);
     if (m_capacity != other.m_capacity) {
         clear();
         if (other.m_size > 0) {
@@ -375,7 +689,10 @@ BufferPrivate& BufferPrivate::operator=(const BufferPrivate& other)
 
     if (other.m_size > 0 && m_data) {
         memcpy(m_data, other.m_data, other.m_size);
+        BUFFER_STAT(CopiedBytes, other.m_size);
     }
+    // with the same capacity the block is reused, as pooled buffers often are
+    m_size = other.m_size;
     return *this;
 }
 
@@ -385,15 +702,21 @@ BufferPrivate& BufferPrivate::operator=(BufferPrivate&& other)
         return *this;
     }
 
+    BUFFER_STAT(Moves, 1);
     clear();
 
     m_size = other.m_size;
     m_capacity = other.m_capacity;
+    m_offset = other.m_offset;
+    m_headroom = other.m_headroom;
     m_data = other.m_data;
+    m_pool = other.m_pool;
 
     other.m_size = 0;
     other.m_capacity = 0;
+    other.m_offset = 0;
     other.m_data = nullptr;
+    other.m_pool = nullptr;
 
     return *this;
 }
@@ -500,12 +823,29 @@ Buffer& Buffer::resize(int size)
     return *this;
 }
 
+Buffer& Buffer::resizeForOverwrite(int size)
+{
+    m_ptr->resize(size, false);
+    return *this;
+}
+
 Buffer& Buffer::truncate(int size)
 {
     m_ptr->truncate(size);
     return *this;
 }
 
+Buffer& Buffer::reserveHeadroom(int size)
+{
+    m_ptr->reserveHeadroom(size);
+    return *this;
+}
+
+int Buffer::headroom() const
+{
+    return m_ptr->headroom();
+}
+
 Buffer& Buffer::append(const Buffer& buffer)
 {
     append(buffer.data(), buffer.size());
@@ -555,6 +895,30 @@ Buffer& Buffer::insert(int pos, const std::string& data)
     return *this;
 }
 
+Buffer& Buffer::prepend(const Buffer& data)
+{
+    insert(0, data.data(), data.size());
+    return *this;
+}
+
+Buffer& Buffer::prepend(char ch)
+{
+    insert(0, &ch, 1);
+    return *this;
+}
+
+Buffer& Buffer::prepend(const char* data, int size)
+{
+    insert(0, data, size);
+    return *this;
+}
+
+Buffer& Buffer::prepend(const std::string& data)
+{
+    insert(0, data.c_str(), static_cast<int>(data.size()));
+    return *this;
+}
+
 void Buffer::remove(int pos, int len)
 {
     m_ptr->remove(pos, len);
@@ -588,6 +952,7 @@ std::string Buffer::toString(int len) const
 
     std::string ret;
     ret.assign(m_ptr->data(), size);
+    BUFFER_STAT(CopiedBytes, size);
     return ret;
 }
 
@@ -611,6 +976,345 @@ Buffer Buffer::fromBase64(const std::string& base64)
     return Base64::decode(base64);
 }
 
+bool BufferStats::isEnabled()
+{
+#ifdef BUFFER_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+BufferStats BufferStats::snapshot()
+{
+    BufferStats stats;
+#ifdef BUFFER_STATS
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock{ registry.mutex };
+
+    uint64_t values[StatCount];
+    registry.total(values);
+    for (int i = 0; i < StatCount; ++i) {
+        values[i] -= registry.base[i];
+    }
+
+    stats.allocations = values[StatAllocations];
+    stats.allocatedBytes = values[StatAllocatedBytes];
+    stats.reallocations = values[StatReallocations];
+    stats.copiedBytes = values[StatCopiedBytes];
+    stats.copies = values[StatCopies];
+    stats.moves = values[StatMoves];
+#endif
+    return stats;
+}
+
+void BufferStats::reset()
+{
+#ifdef BUFFER_STATS
+    // counters only grow, so a reset records the current totals rather than
+    // writing to counters owned by other threads
+    auto& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock{ registry.mutex };
+    registry.total(registry.base);
+#endif
+}
+
+BufferPoolThread::~BufferPoolThread()
+{
+    for (auto cache : m_caches) {
+        cache->pool->detach(cache);
+    }
+}
+
+BufferPoolCache* BufferPoolThread::cache(BufferPoolPrivate* pool)
+{
+    BufferPoolCache* found = nullptr;
+    for (size_t i = 0; i < m_caches.size();) {
+        auto cache = m_caches[i];
+        if (cache->pool == pool) {
+            found = cache;
+        }
+        else if (cache->pool->isClosed()) {
+            m_caches[i] = m_caches.back();
+            m_caches.pop_back();
+            cache->pool->detach(cache);
+            continue;
+        }
+        ++i;
+    }
+
+    if (!found) {
+        found = pool->attach();
+        m_caches.push_back(found);
+    }
+    return found;
+}
+
+void BufferPoolThread::detach(BufferPoolPrivate* pool)
+{
+    for (size_t i = 0; i < m_caches.size(); ++i) {
+        auto cache = m_caches[i];
+        if (cache->pool == pool) {
+            m_caches[i] = m_caches.back();
+            m_caches.pop_back();
+            pool->detach(cache);
+            return;
+        }
+    }
+}
+
+BufferPoolPrivate::BufferPoolPrivate(const BufferPoolOptions& options)
+    : m_bufferSize{ std::max(static_cast<int>(sizeof(BufferPoolBlock)), options.bufferSize) }
+    , m_maxBlocks{ options.maxRetainedBytes / m_bufferSize }
+{
+
+}
+
+BufferPoolPrivate::~BufferPoolPrivate()
+{
+    for (auto& cache : m_caches) {
+        freeList(cache->local);
+        freeList(cache->remote.load(std::memory_order_acquire));
+    }
+}
+
+void BufferPoolPrivate::unref()
+{
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+char* BufferPoolPrivate::acquire(BufferPoolCache*& cache)
+{
+    cache = poolThread().cache(this);
+
+    if (!cache->local) {
+        // take over what other threads have returned
+        auto block = cache->remote.exchange(nullptr, std::memory_order_acquire);
+        uint64_t count = 0;
+        for (auto it = block; it; it = it->next) {
+            ++count;
+        }
+        cache->remoteBlocks.fetch_sub(count, std::memory_order_relaxed);
+        cache->local = block;
+        cache->localBlocks.store(count, std::memory_order_relaxed);
+    }
+
+    auto block = cache->local;
+    if (block) {
+        cache->local = block->next;
+        cache->localBlocks.store(cache->localBlocks.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        increment(cache->hits);
+    }
+    else {
+        block = reinterpret_cast<BufferPoolBlock*>(malloc(m_bufferSize));
+        BUFFER_STAT(Allocations, 1);
+        BUFFER_STAT(AllocatedBytes, m_bufferSize);
+        increment(cache->misses);
+    }
+
+    // every outstanding block keeps the pool alive
+    ref();
+    return reinterpret_cast<char*>(block);
+}
+
+void BufferPoolPrivate::release(BufferPoolCache* cache, char* data)
+{
+    auto block = reinterpret_cast<BufferPoolBlock*>(data);
+    bool owner = cache->owner.load(std::memory_order_relaxed) == poolThreadToken();
+
+    if (owner) {
+        auto limit = isClosed() ? 0 : share();
+        if (cache->localBlocks.load(std::memory_order_relaxed) + cache->remoteBlocks.load(std::memory_order_relaxed) < limit) {
+            block->next = cache->local;
+            cache->local = block;
+            cache->localBlocks.store(cache->localBlocks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            increment(cache->returns);
+        }
+        else {
+            // over its share, e.g. since more threads use the pool: give back
+            // the excess too
+            free(data);
+            increment(cache->drops);
+            trim(cache, limit);
+        }
+    }
+    else {
+        // counted first, so that concurrent releases cannot overshoot
+        // the blocks of an exited thread's cache are not counted in any share
+        bool keep = !isClosed() && cache->owner.load(std::memory_order_relaxed);
+        if (keep && cache->localBlocks.load(std::memory_order_relaxed)
+                    + cache->remoteBlocks.fetch_add(1, std::memory_order_relaxed) >= share()) {
+            cache->remoteBlocks.fetch_sub(1, std::memory_order_relaxed);
+            keep = false;
+        }
+
+        if (keep) {
+            auto head = cache->remote.load(std::memory_order_relaxed);
+            do {
+                block->next = head;
+            } while (!cache->remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+            cache->remoteReturns.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            free(data);
+            cache->remoteDrops.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    unref();
+}
+
+void BufferPoolPrivate::miss()
+{
+    increment(poolThread().cache(this)->misses);
+}
+
+BufferPoolCache* BufferPoolPrivate::attach()
+{
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    ref();
+
+    m_owned.fetch_add(1, std::memory_order_relaxed);
+
+    // reuse the (empty) cache of an exited thread
+    for (auto& cache : m_caches) {
+        if (!cache->owner.load(std::memory_order_relaxed)) {
+            cache->owner.store(poolThreadToken(), std::memory_order_relaxed);
+            return cache.get();
+        }
+    }
+
+    m_caches.emplace_back(new BufferPoolCache{ this });
+    m_caches.back()->owner.store(poolThreadToken(), std::memory_order_relaxed);
+    return m_caches.back().get();
+}
+
+void BufferPoolPrivate::detach(BufferPoolCache* cache)
+{
+    {
+        // the shares of the remaining threads grow instead
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        freeList(cache->local);
+        cache->local = nullptr;
+        cache->localBlocks.store(0, std::memory_order_relaxed);
+        cache->owner.store(nullptr, std::memory_order_relaxed);
+        auto freed = freeList(cache->remote.exchange(nullptr, std::memory_order_acquire));
+        cache->remoteBlocks.fetch_sub(freed, std::memory_order_relaxed);
+        m_owned.fetch_sub(1, std::memory_order_relaxed);
+    }
+    unref();
+}
+
+void BufferPoolPrivate::close()
+{
+    m_closed.store(true, std::memory_order_release);
+    poolThread().detach(this);
+
+    // free lists of other threads are left to them (or to the last
+    // reference), only what is not owned can be freed here
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    for (auto& cache : m_caches) {
+        auto freed = freeList(cache->remote.exchange(nullptr, std::memory_order_acquire));
+        cache->remoteBlocks.fetch_sub(freed, std::memory_order_relaxed);
+        if (!cache->owner.load(std::memory_order_relaxed)) {
+            freeList(cache->local);
+            cache->local = nullptr;
+            cache->localBlocks.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+BufferPoolStats BufferPoolPrivate::stats()
+{
+    BufferPoolStats stats;
+    uint64_t blocks = 0;
+    std::lock_guard<std::mutex> lock{ m_mutex };
+    for (auto& cache : m_caches) {
+        blocks += cache->localBlocks.load(std::memory_order_relaxed) + cache->remoteBlocks.load(std::memory_order_relaxed);
+        stats.hits += cache->hits.load(std::memory_order_relaxed);
+        stats.misses += cache->misses.load(std::memory_order_relaxed);
+        stats.returns += cache->returns.load(std::memory_order_relaxed) + cache->remoteReturns.load(std::memory_order_relaxed);
+        stats.drops += cache->drops.load(std::memory_order_relaxed) + cache->remoteDrops.load(std::memory_order_relaxed);
+    }
+    stats.retainedBytes = blocks * m_bufferSize;
+    return stats;
+}
+
+// idle blocks one cache may hold: the cap split between the threads using
+// the pool
+uint64_t BufferPoolPrivate::share() const
+{
+    return m_maxBlocks / static_cast<uint64_t>(std::max(1, m_owned.load(std::memory_order_relaxed)));
+}
+
+// owner only: frees local blocks until the cache holds at most `blocks`
+void BufferPoolPrivate::trim(BufferPoolCache* cache, uint64_t blocks)
+{
+    auto count = cache->localBlocks.load(std::memory_order_relaxed);
+    auto held = count + cache->remoteBlocks.load(std::memory_order_relaxed);
+    while (held > blocks && cache->local) {
+        auto block = cache->local;
+        cache->local = block->next;
+        free(block);
+        --count;
+        --held;
+        increment(cache->drops);
+    }
+    cache->localBlocks.store(count, std::memory_order_relaxed);
+}
+
+uint64_t BufferPoolPrivate::freeList(BufferPoolBlock* block)
+{
+    uint64_t count = 0;
+    while (block) {
+        auto next = block->next;
+        free(block);
+        block = next;
+        ++count;
+    }
+    return count;
+}
+
+BufferPool::BufferPool(const BufferPoolOptions& options)
+    : m_ptr{ new BufferPoolPrivate{ options } }
+{
+
+}
+
+BufferPool::~BufferPool()
+{
+    m_ptr->close();
+    m_ptr->unref();
+}
+
+Buffer BufferPool::acquire(int size)
+{
+    Buffer buffer;
+    if (size > m_ptr->bufferSize()) {
+        m_ptr->miss();
+        buffer.resizeForOverwrite(size);
+        return buffer;
+    }
+
+    BufferPoolCache* cache;
+    auto data = m_ptr->acquire(cache);
+    buffer.m_ptr->adopt(data, m_ptr->bufferSize(), cache);
+    buffer.m_ptr->resize(std::max(0, size), false);
+    return buffer;
+}
+
+int BufferPool::bufferSize() const
+{
+    return m_ptr->bufferSize();
+}
+
+BufferPoolStats BufferPool::stats() const
+{
+    return m_ptr->stats();
+}
+
 BufferWriter::BufferWriter(Buffer& buffer)
     : m_buffer{ buffer }
 {
@@ -628,44 +1332,84 @@ BufferWriter& BufferWriter::write(const char* data, int len)
     return *this;
 }
 
+int BufferWriter::reserve(int len)
+{
+    auto position = m_buffer.size();
+    m_buffer.resize(position + len);
+    return position;
+}
+
+int BufferWriter::position() const
+{
+    return m_buffer.size();
+}
+
+BufferWriter& BufferWriter::writeAt(int position, const char* data, int len)
+{
+    if (position >= 0 && len >= 0 && position + len <= m_buffer.size()) {
+        memcpy(m_buffer.data() + position, data, len);
+    }
+    return *this;
+}
+
+BufferWriter& BufferWriter::writeAt(int position, uint8_t value)
+{
+    return writeBigEndianAt(*this, position, value);
+}
+
+BufferWriter& BufferWriter::writeAt(int position, uint16_t value)
+{
+    return writeBigEndianAt(*this, position, value);
+}
+
+BufferWriter& BufferWriter::writeAt(int position, uint32_t value)
+{
+    return writeBigEndianAt(*this, position, value);
+}
+
+BufferWriter& BufferWriter::writeAt(int position, uint64_t value)
+{
+    return writeBigEndianAt(*this, position, value);
+}
+
 BufferWriter& BufferWriter::operator<<(uint8_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(uint16_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(uint32_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(uint64_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(int8_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(int16_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(int32_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(int64_t value)
 {
-    return crypto::write(*this, value);
+    return writeBigEndian(*this, value);
 }
 
 BufferWriter& BufferWriter::operator<<(const char* value)
@@ -751,42 +1495,42 @@ BufferReader::operator bool() const
 
 BufferReader& BufferReader::operator>>(uint8_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(uint16_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(uint32_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(uint64_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(int8_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(int16_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(int32_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(int64_t& value)
 {
-    return crypto::read(*this, value);
+    return readBigEndian(*this, value);
 }
 
 BufferReader& BufferReader::operator>>(std::string& value)
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
 
 class BufferPrivate;
+class BufferPool;
 
 class Buffer
 {
@@ -32,9 +35,18 @@ public:
 
     void swap(Buffer& other);
 
+    // new bytes are zero
     Buffer& resize(int size);
+    // like resize(), but new bytes are left uninitialized for the caller to overwrite
+    Buffer& resizeForOverwrite(int size);
     Buffer& truncate(int size);
 
+    // keeps size bytes free in front of the data, now and whenever the data
+    // is reallocated, so that prepend() (and insert() in the front half)
+    // moves the bytes in front of the insertion point rather than the rest
+    Buffer& reserveHeadroom(int size);
+    int headroom() const;
+
     Buffer& append(const Buffer& buffer);
     Buffer& append(char ch);
     Buffer& append(const char* data, int size = -1);
@@ -45,6 +57,13 @@ public:
     Buffer& insert(int pos, const char* data, int size = -1);
     Buffer& insert(int pos, const std::string& data);
 
+    Buffer& prepend(const Buffer& data);
+    Buffer& prepend(char ch);
+    Buffer& prepend(const char* data, int size = -1);
+    Buffer& prepend(const std::string& data);
+
+    // moves whichever side of the range is shorter, removing from the front
+    // moves nothing
     void remove(int pos, int len);
     void removeAt(int pos);
 
@@ -61,9 +80,77 @@ public:
     static Buffer fromBase64(const std::string& base64);
 
 private:
+    friend class BufferPool;
+
     BufferPrivate* m_ptr;
 };
 
+// Allocation and copy counters of all Buffer objects, summed over threads.
+// They are collected only when buffer.cpp is built with BUFFER_STATS defined;
+// otherwise the counting compiles out and snapshot() returns zeros.
+struct BufferStats
+{
+    uint64_t allocations = 0;       // heap blocks allocated for buffer data
+    uint64_t allocatedBytes = 0;
+    uint64_t reallocations = 0;     // allocations that moved existing data
+    uint64_t copiedBytes = 0;       // bytes copied or moved by memcpy/memmove
+    uint64_t copies = 0;            // copy constructions and assignments
+    uint64_t moves = 0;             // move constructions and assignments
+
+    static bool isEnabled();
+
+    // totals since the last reset()
+    static BufferStats snapshot();
+    static void reset();
+};
+
+struct BufferPoolOptions
+{
+    int      bufferSize = 64 * 1024;            // capacity of every pooled buffer
+    // idle memory kept, split evenly between the threads using the pool;
+    // returns beyond a thread's share are freed
+    uint64_t maxRetainedBytes = 16 << 20;
+};
+
+struct BufferPoolStats
+{
+    uint64_t hits = 0;              // acquisitions served from the pool
+    uint64_t misses = 0;            // acquisitions that allocated
+    uint64_t returns = 0;           // buffers taken back
+    uint64_t drops = 0;             // buffers freed because the pool was full
+    uint64_t retainedBytes = 0;     // idle memory held by the pool
+};
+
+class BufferPoolPrivate;
+
+// Recycles the data blocks of Buffers, e.g. for frames read from a socket.
+// A buffer from acquire() gives its block back to the pool when it is
+// destroyed or cleared (or outgrows it), from any thread. Each thread takes
+// and returns blocks through its own free list; blocks freed on another
+// thread reach the owner through a lock-free list it drains when its own
+// list runs dry.
+//
+// Buffers may outlive the pool; their blocks are then simply freed.
+class BufferPool
+{
+public:
+    explicit BufferPool(const BufferPoolOptions& options = BufferPoolOptions{});
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // a buffer of size bytes (left uninitialized) with room for bufferSize;
+    // larger sizes get an ordinary allocation
+    Buffer acquire(int size = 0);
+
+    int bufferSize() const;
+    BufferPoolStats stats() const;
+
+private:
+    BufferPoolPrivate* m_ptr;
+};
+
 class BufferWriter
 {
 public:
@@ -72,6 +159,18 @@ public:
 
     BufferWriter& write(const char* data, int len);
 
+    // appends len zero bytes to fill in later, e.g. a length prefix once the
+    // body after it is written; returns their position
+    int reserve(int len);
+    int position() const;
+
+    // overwrites bytes already written, big endian like operator<<
+    BufferWriter& writeAt(int position, const char* data, int len);
+    BufferWriter& writeAt(int position, uint8_t value);
+    BufferWriter& writeAt(int position, uint16_t value);
+    BufferWriter& writeAt(int position, uint32_t value);
+    BufferWriter& writeAt(int position, uint64_t value);
+
     BufferWriter& operator<<(uint8_t value);
     BufferWriter& operator<<(uint16_t value);
     BufferWriter& operator<<(uint32_t value);
@@ -0,0 +1,329 @@
+#include <limits.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
+#include "buffer_ring.h"
+
+namespace
+{
+
+// spins before sleeping: a hand-off between running threads is quicker than
+// a futex round trip
+constexpr int SpinCount = 128;
+
+size_t ringSize(int capacity)
+{
+    size_t size = 2;
+    while (size < static_cast<size_t>(capacity)) {
+        size <<= 1;
+    }
+    return size;
+}
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+template<typename Ring>
+bool waitPush(Ring& ring, Buffer& buffer, BufferRingEvent& notFull)
+{
+    for (int i = 0; i < SpinCount; ++i) {
+        if (ring.isClosed()) {
+            return false;
+        }
+        if (ring.tryPush(buffer)) {
+            return true;
+        }
+        cpuRelax();
+    }
+
+    for (;;) {
+        auto key = notFull.prepare();
+        if (ring.isClosed()) {
+            return false;
+        }
+        if (ring.tryPush(buffer)) {
+            return true;
+        }
+        notFull.wait(key);
+    }
+}
+
+template<typename Ring>
+bool waitPop(Ring& ring, Buffer& buffer, BufferRingEvent& notEmpty)
+{
+    for (int i = 0; i < SpinCount; ++i) {
+        if (ring.tryPop(buffer)) {
+            return true;
+        }
+        if (ring.isClosed()) {
+            // pushed before the close, but after the failed pop
+            return ring.tryPop(buffer);
+        }
+        cpuRelax();
+    }
+
+    for (;;) {
+        auto key = notEmpty.prepare();
+        if (ring.tryPop(buffer)) {
+            return true;
+        }
+        if (ring.isClosed()) {
+            return ring.tryPop(buffer);
+        }
+        notEmpty.wait(key);
+    }
+}
+
+}
+
+uint32_t BufferRingEvent::prepare()
+{
+    return m_state.fetch_or(1, std::memory_order_seq_cst) | 1;
+}
+
+void BufferRingEvent::wait(uint32_t key)
+{
+#ifdef __linux__
+    // returns at once if a notify() has changed the state since prepare()
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_state), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+    while (m_state.load(std::memory_order_seq_cst) == key) {
+        std::this_thread::yield();
+    }
+#endif
+}
+
+void BufferRingEvent::notify()
+{
+    // pairs with prepare(): either the waiter's re-check sees the change made
+    // before this call, or this call sees the waiter's bit
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto state = m_state.load(std::memory_order_relaxed);
+    if (!(state & 1)) {
+        return;
+    }
+
+    // a failed exchange means another notify() took the sleepers
+    if (m_state.compare_exchange_strong(state, (state + 2) & ~1u, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_state), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+}
+
+BufferSpscRing::BufferSpscRing(int capacity)
+    : m_slots{ new Buffer[ringSize(capacity)] }
+    , m_mask{ ringSize(capacity) - 1 }
+{
+
+}
+
+bool BufferSpscRing::tryPush(Buffer& buffer)
+{
+    return tryPush(&buffer, 1) == 1;
+}
+
+bool BufferSpscRing::tryPop(Buffer& buffer)
+{
+    return tryPop(&buffer, 1) == 1;
+}
+
+int BufferSpscRing::tryPush(Buffer* buffers, int count)
+{
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    auto room = m_mask + 1 - (tail - m_cachedHead);
+    if (room < static_cast<size_t>(count)) {
+        m_cachedHead = m_head.load(std::memory_order_acquire);
+        room = m_mask + 1 - (tail - m_cachedHead);
+    }
+
+    auto n = static_cast<int>(std::min(room, static_cast<size_t>(std::max(0, count))));
+    if (n == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        m_slots[(tail + i) & m_mask].swap(buffers[i]);
+    }
+    m_tail.store(tail + n, std::memory_order_release);
+    m_notEmpty.notify();
+    return n;
+}
+
+int BufferSpscRing::tryPop(Buffer* buffers, int count)
+{
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto ready = m_cachedTail - head;
+    if (ready < static_cast<size_t>(count)) {
+        m_cachedTail = m_tail.load(std::memory_order_acquire);
+        ready = m_cachedTail - head;
+    }
+
+    auto n = static_cast<int>(std::min(ready, static_cast<size_t>(std::max(0, count))));
+    if (n == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        buffers[i].swap(m_slots[(head + i) & m_mask]);
+    }
+    m_head.store(head + n, std::memory_order_release);
+    m_notFull.notify();
+    return n;
+}
+
+bool BufferSpscRing::push(Buffer& buffer)
+{
+    return waitPush(*this, buffer, m_notFull);
+}
+
+bool BufferSpscRing::pop(Buffer& buffer)
+{
+    return waitPop(*this, buffer, m_notEmpty);
+}
+
+void BufferSpscRing::close()
+{
+    m_closed.store(true, std::memory_order_seq_cst);
+    m_notEmpty.notify();
+    m_notFull.notify();
+}
+
+bool BufferSpscRing::isClosed() const
+{
+    return m_closed.load(std::memory_order_acquire);
+}
+
+int BufferSpscRing::capacity() const
+{
+    return static_cast<int>(m_mask + 1);
+}
+
+BufferMpmcRing::BufferMpmcRing(int capacity)
+    : m_slots{ new Slot[ringSize(capacity)] }
+    , m_mask{ ringSize(capacity) - 1 }
+{
+    for (size_t i = 0; i <= m_mask; ++i) {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool BufferMpmcRing::tryPush(Buffer& buffer)
+{
+    return tryPush(&buffer, 1) == 1;
+}
+
+bool BufferMpmcRing::tryPop(Buffer& buffer)
+{
+    return tryPop(&buffer, 1) == 1;
+}
+
+// A slot is free for the producer at position pos when its sequence is pos,
+// and holds a buffer for the consumer at pos when it is pos + 1. Nobody else
+// can write a slot in a run that was seen free (or full) before the CAS on
+// tail (head) claims the whole run.
+int BufferMpmcRing::tryPush(Buffer* buffers, int count)
+{
+    if (count <= 0) {
+        return 0;
+    }
+
+    auto pos = m_tail.load(std::memory_order_relaxed);
+    for (;;) {
+        int n = 0;
+        while (n < count && m_slots[(pos + n) & m_mask].sequence.load(std::memory_order_acquire) == pos + n) {
+            ++n;
+        }
+
+        if (n == 0) {
+            auto sequence = m_slots[pos & m_mask].sequence.load(std::memory_order_acquire);
+            if (static_cast<intptr_t>(sequence - pos) < 0) {
+                return 0;   // full
+            }
+            pos = m_tail.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (m_tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed, std::memory_order_relaxed)) {
+            for (int i = 0; i < n; ++i) {
+                auto& slot = m_slots[(pos + i) & m_mask];
+                slot.buffer.swap(buffers[i]);
+                slot.sequence.store(pos + i + 1, std::memory_order_release);
+            }
+            m_notEmpty.notify();
+            return n;
+        }
+    }
+}
+
+int BufferMpmcRing::tryPop(Buffer* buffers, int count)
+{
+    if (count <= 0) {
+        return 0;
+    }
+
+    auto pos = m_head.load(std::memory_order_relaxed);
+    for (;;) {
+        int n = 0;
+        while (n < count && m_slots[(pos + n) & m_mask].sequence.load(std::memory_order_acquire) == pos + n + 1) {
+            ++n;
+        }
+
+        if (n == 0) {
+            auto sequence = m_slots[pos & m_mask].sequence.load(std::memory_order_acquire);
+            if (static_cast<intptr_t>(sequence - (pos + 1)) < 0) {
+                return 0;   // empty, or the producer has not finished
+            }
+            pos = m_head.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (m_head.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed, std::memory_order_relaxed)) {
+            for (int i = 0; i < n; ++i) {
+                auto& slot = m_slots[(pos + i) & m_mask];
+                buffers[i].swap(slot.buffer);
+                slot.sequence.store(pos + i + m_mask + 1, std::memory_order_release);
+            }
+            m_notFull.notify();
+            return n;
+        }
+    }
+}
+
+bool BufferMpmcRing::push(Buffer& buffer)
+{
+    return waitPush(*this, buffer, m_notFull);
+}
+
+bool BufferMpmcRing::pop(Buffer& buffer)
+{
+    return waitPop(*this, buffer, m_notEmpty);
+}
+
+void BufferMpmcRing::close()
+{
+    m_closed.store(true, std::memory_order_seq_cst);
+    m_notEmpty.notify();
+    m_notFull.notify();
+}
+
+bool BufferMpmcRing::isClosed() const
+{
+    return m_closed.load(std::memory_order_acquire);
+}
+
+int BufferMpmcRing::capacity() const
+{
+    return static_cast<int>(m_mask + 1);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+#include "buffer.h"
+
+// Lets threads sleep until a ring changes. While nobody sleeps notify() is
+// a fence and a load; a sleeper sets the low bit of the futex word and only
+// the notify() that clears it makes the wake-up call. Without futexes
+// (other than Linux) sleeping is a yield loop.
+class BufferRingEvent
+{
+public:
+    // a waiter takes a key, re-checks its condition, then waits on the key
+    uint32_t prepare();
+    void wait(uint32_t key);
+
+    void notify();
+
+private:
+    std::atomic<uint32_t> m_state{ 0 };     // change count << 1 | sleepers
+};
+
+// Bounded lock-free ring of Buffers, one producer and one consumer thread.
+// Buffers are swapped in and out of preallocated slots, so a transfer neither
+// copies data nor allocates: push leaves the caller holding an empty Buffer
+// (whatever the slot held before) and pop hands over the slot's Buffer.
+//
+// The try* calls never block. push() and pop() spin briefly and then sleep
+// until there is room or data; after close() they fail, pop() once the ring
+// is drained.
+class BufferSpscRing
+{
+public:
+    // capacity is rounded up to a power of two
+    explicit BufferSpscRing(int capacity);
+
+    BufferSpscRing(const BufferSpscRing&) = delete;
+    BufferSpscRing& operator=(const BufferSpscRing&) = delete;
+
+    bool tryPush(Buffer& buffer);
+    bool tryPop(Buffer& buffer);
+
+    // as many as fit / are there, returns the count
+    int tryPush(Buffer* buffers, int count);
+    int tryPop(Buffer* buffers, int count);
+
+    bool push(Buffer& buffer);
+    bool pop(Buffer& buffer);
+
+    // wakes every waiter, blocking calls fail from then on
+    void close();
+    bool isClosed() const;
+
+    int capacity() const;
+
+private:
+    std::unique_ptr<Buffer[]> m_slots;
+    size_t                    m_mask;
+
+    // consumer side
+    alignas(64) std::atomic<size_t> m_head{ 0 };
+    size_t                          m_cachedTail = 0;
+
+    // producer side
+    alignas(64) std::atomic<size_t> m_tail{ 0 };
+    size_t                          m_cachedHead = 0;
+
+    // the consumer waits on m_notEmpty and the producer on m_notFull, and
+    // both are written on every transfer, so each gets its own cache line
+    alignas(64) BufferRingEvent     m_notEmpty;
+    alignas(64) BufferRingEvent     m_notFull;
+    alignas(64) std::atomic<bool>   m_closed{ false };
+};
+
+// Bounded lock-free ring of Buffers for any number of producers and
+// consumers (Vyukov's bounded MPMC queue: every slot carries a sequence
+// number telling whose turn it is). Same interface and swap semantics as
+// BufferSpscRing; a batch claims a run of slots with a single CAS.
+class BufferMpmcRing
+{
+public:
+    // capacity is rounded up to a power of two
+    explicit BufferMpmcRing(int capacity);
+
+    BufferMpmcRing(const BufferMpmcRing&) = delete;
+    BufferMpmcRing& operator=(const BufferMpmcRing&) = delete;
+
+    bool tryPush(Buffer& buffer);
+    bool tryPop(Buffer& buffer);
+
+    int tryPush(Buffer* buffers, int count);
+    int tryPop(Buffer* buffers, int count);
+
+    bool push(Buffer& buffer);
+    bool pop(Buffer& buffer);
+
+    void close();
+    bool isClosed() const;
+
+    int capacity() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        Buffer              buffer;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t                  m_mask;
+
+    alignas(64) std::atomic<size_t> m_head{ 0 };
+    alignas(64) std::atomic<size_t> m_tail{ 0 };
+
+    alignas(64) BufferRingEvent     m_notEmpty;
+    alignas(64) BufferRingEvent     m_notFull;
+    alignas(64) std::atomic<bool>   m_closed{ false };
+};
@@ -0,0 +1,172 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+
+#include "cpu_p.h"
+
+namespace
+{
+
+struct cpu_feature_name
+{
+    const char* name;
+    uint32_t    feature;
+};
+
+const cpu_feature_name cpu_feature_names[] = {
+    { "ssse3",      CPU_SSSE3 },
+    { "sse4.1",     CPU_SSE41 },
+    { "avx2",       CPU_AVX2 },
+    { "avx512f",    CPU_AVX512F },
+    { "avx512bw",   CPU_AVX512BW },
+    { "avx512vl",   CPU_AVX512VL },
+    { "aes",        CPU_AES },
+    { "pclmul",     CPU_PCLMUL },
+    { "vaes",       CPU_VAES },
+    { "vpclmulqdq", CPU_VPCLMUL },
+    { "gfni",       CPU_GFNI },
+};
+
+// features named in a comma separated list
+uint32_t cpu_parse_features(const char* list)
+{
+    uint32_t features = 0;
+
+    while (*list) {
+        auto end = strchr(list, ',');
+        auto len = end ? (size_t)(end - list) : strlen(list);
+
+        if (len == 3 && strncmp(list, "all", 3) == 0) {
+            features = ~0u;
+        }
+        for (auto& f : cpu_feature_names) {
+            if (strlen(f.name) == len && strncmp(list, f.name, len) == 0) {
+                features |= f.feature;
+            }
+        }
+
+        list += len;
+        if (*list == ',') {
+            ++list;
+        }
+    }
+    return features;
+}
+
+uint32_t cpu_detect()
+{
+    uint32_t features = 0;
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    // __builtin_cpu_supports() also checks that the OS saves the AVX and
+    // AVX-512 register state
+#define CPU_DETECT(name, feature) if (__builtin_cpu_supports(name)) { features |= feature; }
+    __builtin_cpu_init();
+    CPU_DETECT("ssse3", CPU_SSSE3)
+    CPU_DETECT("sse4.1", CPU_SSE41)
+    CPU_DETECT("avx2", CPU_AVX2)
+    CPU_DETECT("avx512f", CPU_AVX512F)
+    CPU_DETECT("avx512bw", CPU_AVX512BW)
+    CPU_DETECT("avx512vl", CPU_AVX512VL)
+    CPU_DETECT("aes", CPU_AES)
+    CPU_DETECT("pclmul", CPU_PCLMUL)
+    CPU_DETECT("vaes", CPU_VAES)
+    CPU_DETECT("vpclmulqdq", CPU_VPCLMUL)
+    CPU_DETECT("gfni", CPU_GFNI)
+#undef CPU_DETECT
+#endif
+
+    if (auto disable = getenv("BUFFER_CPU_DISABLE")) {
+        features &= ~cpu_parse_features(disable);
+    }
+    return features;
+}
+
+struct cpu_selection
+{
+    const char* kernel;
+    const char* backend;
+};
+
+// kernels are selected once each, a handful of slots is plenty
+constexpr int cpu_max_selections = 16;
+
+std::mutex     cpu_selection_mutex;
+cpu_selection  cpu_selections[cpu_max_selections];
+int            cpu_selection_count = 0;
+
+void cpu_record(const char* kernel, const char* backend)
+{
+    std::lock_guard<std::mutex> lock{ cpu_selection_mutex };
+    for (int i = 0; i < cpu_selection_count; ++i) {
+        if (strcmp(cpu_selections[i].kernel, kernel) == 0) {
+            cpu_selections[i].backend = backend;
+            return;
+        }
+    }
+    if (cpu_selection_count < cpu_max_selections) {
+        cpu_selections[cpu_selection_count++] = { kernel, backend };
+    }
+}
+
+}
+
+uint32_t cpu_features()
+{
+    static const uint32_t features = cpu_detect();
+    return features;
+}
+
+int cpu_select_index(const char* kernel, const char* const names[], const uint32_t features[], int count)
+{
+    int index = count - 1;
+
+    for (int i = 0; i < count; ++i) {
+        if (cpu_has(features[i])) {
+            index = i;
+            break;
+        }
+    }
+
+    std::string variable = "BUFFER_BACKEND_";
+    for (auto p = kernel; *p; ++p) {
+        variable += static_cast<char>(toupper(static_cast<unsigned char>(*p)));
+    }
+    if (auto forced = getenv(variable.c_str())) {
+        for (int i = 0; i < count; ++i) {
+            if (strcmp(forced, names[i]) == 0 && cpu_has(features[i])) {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    cpu_record(kernel, names[index]);
+    return index;
+}
+
+std::string cpu_report()
+{
+    std::string report = "features:";
+    auto features = cpu_features();
+    for (auto& f : cpu_feature_names) {
+        if (features & f.feature) {
+            report += ' ';
+            report += f.name;
+        }
+    }
+    if (!features) {
+        report += " none";
+    }
+
+    std::lock_guard<std::mutex> lock{ cpu_selection_mutex };
+    for (int i = 0; i < cpu_selection_count; ++i) {
+        report += "; ";
+        report += cpu_selections[i].kernel;
+        report += ": ";
+        report += cpu_selections[i].backend;
+    }
+    return report;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+// Instruction set extensions the SIMD kernels are written for. They are
+// detected once per process; on other architectures none are reported.
+enum cpu_feature : uint32_t
+{
+    CPU_SSSE3     = 1u << 0,
+    CPU_SSE41     = 1u << 1,
+    CPU_AVX2      = 1u << 2,
+    CPU_AVX512F   = 1u << 3,
+    CPU_AVX512BW  = 1u << 4,
+    CPU_AVX512VL  = 1u << 5,
+    CPU_AES       = 1u << 6,
+    CPU_PCLMUL    = 1u << 7,
+    CPU_VAES      = 1u << 8,
+    CPU_VPCLMUL   = 1u << 9,
+    CPU_GFNI      = 1u << 10,
+};
+
+// Detected features, minus those listed in BUFFER_CPU_DISABLE (a comma
+// separated list of the names printed by cpu_report(), or "all").
+uint32_t cpu_features();
+
+// true if every feature in the mask is available
+inline bool cpu_has(uint32_t features)
+{
+    return (cpu_features() & features) == features;
+}
+
+// One implementation of a kernel and the features it needs.
+template<typename F>
+struct cpu_kernel
+{
+    const char* name;
+    uint32_t    features;
+    F           func;
+};
+
+// Index of the kernel to use: the one named by BUFFER_BACKEND_<KERNEL> (for
+// example BUFFER_BACKEND_SM4=aesni) if the CPU supports it, otherwise the
+// first one whose features are available. The last entry must be portable.
+// The choice is recorded for cpu_report().
+int cpu_select_index(const char* kernel, const char* const names[], const uint32_t features[], int count);
+
+// Picks an implementation from a table ordered best first. Call it once and
+// keep the result, e.g. in a function-local static.
+template<typename F, int N>
+F cpu_select(const char* kernel, const cpu_kernel<F> (&kernels)[N])
+{
+    const char* names[N];
+    uint32_t features[N];
+
+    for (int i = 0; i < N; ++i) {
+        names[i] = kernels[i].name;
+        features[i] = kernels[i].features;
+    }
+    return kernels[cpu_select_index(kernel, names, features, N)].func;
+}
+
+// The available features and the backend selected for every kernel used so
+// far, e.g. "features: ssse3 avx2 aes; sm4: aesni; ghash: clmul".
+std::string cpu_report();
@@ -0,0 +1,904 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define FILE_ENGINE_HAVE_URING 1
+#endif
+
+#include "file_engine.h"
+#include "sm3.h"
+#include "sm4.h"
+
+namespace
+{
+
+// offset of a read from the current file position (pipes, procfs files)
+constexpr uint64_t StreamOffset = ~(uint64_t)0;
+
+// A read into one chunk buffer; the chunk index doubles as the request tag,
+// since a chunk has at most one read in flight.
+struct ReadRequest
+{
+    int      fd;
+    uint64_t offset;
+    int      chunk;
+    char*    data;
+    int      len;
+};
+
+struct ReadCompletion
+{
+    int chunk;
+    int result;     // bytes read, or -errno
+};
+
+// Where the reads go: io_uring or a pool of pread() threads.
+class Reader
+{
+public:
+    virtual ~Reader() = default;
+
+    virtual const char* name() const = 0;
+
+    virtual void submit(const ReadRequest& request) = 0;
+
+    // Sends the submitted requests and blocks until at least one has
+    // completed or wake() is called.
+    virtual void wait(std::vector<ReadCompletion>& completions) = 0;
+
+    // callable from any thread
+    virtual void wake() = 0;
+};
+
+#ifdef FILE_ENGINE_HAVE_URING
+
+// io_uring through the raw system calls. The chunk buffers are registered
+// once so that reads use IORING_OP_READ_FIXED; if the kernel refuses (e.g.
+// RLIMIT_MEMLOCK) plain IORING_OP_READV into the same buffers is used.
+// An eventfd poll stays armed in the ring so that wake() can interrupt wait().
+class UringReader : public Reader
+{
+public:
+    UringReader(std::vector<Buffer>& chunks)
+        : m_iovecs(chunks.size())
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        // every chunk read plus the eventfd poll fit in the ring at once
+        m_fd = (int)syscall(__NR_io_uring_setup, (unsigned)chunks.size() + 1, &params);
+        if (m_fd < 0) {
+            return;
+        }
+
+        m_sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+        }
+
+        m_sqRing = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) {
+            m_sqRing = nullptr;
+            return;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            m_cqRing = m_sqRing;
+        }
+        else {
+            m_cqRing = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cqRing == MAP_FAILED) {
+                m_cqRing = nullptr;
+                return;
+            }
+        }
+
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        auto sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return;
+        }
+        m_sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+        auto sq = reinterpret_cast<char*>(m_sqRing);
+        auto cq = reinterpret_cast<char*>(m_cqRing);
+        m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            m_iovecs[i].iov_base = chunks[i].data();
+            m_iovecs[i].iov_len = chunks[i].size();
+        }
+        m_fixed = syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, m_iovecs.data(), (unsigned)m_iovecs.size()) == 0;
+
+        m_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_event < 0) {
+            return;
+        }
+        armWake();
+        m_valid = true;
+    }
+
+    ~UringReader() override
+    {
+        if (m_sqes) {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqRing && m_cqRing != m_sqRing) {
+            munmap(m_cqRing, m_cqSize);
+        }
+        if (m_sqRing) {
+            munmap(m_sqRing, m_sqSize);
+        }
+        if (m_event >= 0) {
+            close(m_event);
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    bool isValid() const { return m_valid; }
+
+    const char* name() const override { return "io_uring"; }
+
+    void submit(const ReadRequest& request) override
+    {
+        auto sqe = nextSqe();
+        if (m_fixed) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = reinterpret_cast<uint64_t>(request.data);
+            sqe->len = (unsigned)request.len;
+            sqe->buf_index = (uint16_t)request.chunk;
+        }
+        else {
+            auto& iov = m_iovecs[request.chunk];
+            iov.iov_base = request.data;
+            iov.iov_len = (size_t)request.len;
+            sqe->opcode = IORING_OP_READV;
+            sqe->addr = reinterpret_cast<uint64_t>(&iov);
+            sqe->len = 1;
+        }
+        sqe->fd = request.fd;
+        sqe->off = request.offset;       // StreamOffset is -1: the file position
+        sqe->user_data = (uint64_t)request.chunk;
+        pushSqe();
+    }
+
+    void wait(std::vector<ReadCompletion>& completions) override
+    {
+        for (;;) {
+            auto ret = syscall(__NR_io_uring_enter, m_fd, m_pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret >= 0) {
+                m_pending -= std::min(m_pending, (unsigned)ret);
+                break;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                break;
+            }
+        }
+
+        auto head = *m_cqHead;
+        auto tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            auto& cqe = m_cqes[head & m_cqMask];
+            if (cqe.user_data == wake_tag) {
+                uint64_t value;
+                while (read(m_event, &value, sizeof(value)) > 0) {
+                }
+                armWake();
+                continue;
+            }
+            completions.push_back({ (int)cqe.user_data, cqe.res });
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    void wake() override
+    {
+        uint64_t one = 1;
+        while (write(m_event, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+
+private:
+    static constexpr uint64_t wake_tag = ~(uint64_t)0;
+
+    io_uring_sqe* nextSqe()
+    {
+        auto tail = *m_sqTail;
+        auto sqe = &m_sqes[tail & m_sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    void pushSqe()
+    {
+        auto tail = *m_sqTail;
+        m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++m_pending;
+    }
+
+    void armWake()
+    {
+        auto sqe = nextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = m_event;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = wake_tag;
+        pushSqe();
+    }
+
+private:
+    int                 m_fd = -1;
+    int                 m_event = -1;
+    bool                m_valid = false;
+    bool                m_fixed = false;
+    unsigned            m_pending = 0;      // pushed but not yet entered
+
+    void*               m_sqRing = nullptr;
+    void*               m_cqRing = nullptr;
+    size_t              m_sqSize = 0;
+    size_t              m_cqSize = 0;
+    size_t              m_sqesSize = 0;
+
+    io_uring_sqe*       m_sqes = nullptr;
+    unsigned*           m_sqTail = nullptr;
+    unsigned            m_sqMask = 0;
+    unsigned*           m_sqArray = nullptr;
+    unsigned*           m_cqHead = nullptr;
+    unsigned*           m_cqTail = nullptr;
+    unsigned            m_cqMask = 0;
+    io_uring_cqe*       m_cqes = nullptr;
+
+    std::vector<iovec>  m_iovecs;
+};
+
+#endif
+
+// Blocking pread() on a few threads, for systems without io_uring.
+class ThreadReader : public Reader
+{
+public:
+    explicit ThreadReader(int threads)
+    {
+        for (int i = 0; i < std::max(1, threads); ++i) {
+            m_threads.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadReader() override
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_stop = true;
+        }
+        m_requestReady.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    const char* name() const override { return "threads"; }
+
+    void submit(const ReadRequest& request) override
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_requests.push_back(request);
+        }
+        m_requestReady.notify_one();
+    }
+
+    void wait(std::vector<ReadCompletion>& completions) override
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        m_completionReady.wait(lock, [this] { return !m_completions.empty() || m_woken; });
+        completions.insert(completions.end(), m_completions.begin(), m_completions.end());
+        m_completions.clear();
+        m_woken = false;
+    }
+
+    void wake() override
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_woken = true;
+        }
+        m_completionReady.notify_one();
+    }
+
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        for (;;) {
+            m_requestReady.wait(lock, [this] { return !m_requests.empty() || m_stop; });
+            if (m_requests.empty()) {
+                return;
+            }
+
+            auto request = m_requests.front();
+            m_requests.pop_front();
+            lock.unlock();
+
+            auto n = readAt(request);
+            while (n < 0 && errno == EINTR) {
+                n = readAt(request);
+            }
+
+            lock.lock();
+            m_completions.push_back({ request.chunk, n < 0 ? -errno : (int)n });
+            m_completionReady.notify_one();
+        }
+    }
+
+    static ssize_t readAt(const ReadRequest& request)
+    {
+        if (request.offset == StreamOffset) {
+            return read(request.fd, request.data, (size_t)request.len);
+        }
+        return pread(request.fd, request.data, (size_t)request.len, (off_t)request.offset);
+    }
+
+private:
+    std::mutex                  m_mutex;
+    std::condition_variable     m_requestReady;
+    std::condition_variable     m_completionReady;
+    std::deque<ReadRequest>     m_requests;
+    std::vector<ReadCompletion> m_completions;
+    std::vector<std::thread>    m_threads;
+    bool                        m_woken = false;
+    bool                        m_stop = false;
+};
+
+// Plain FIFO task queue for the hashing threads.
+class WorkerPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkerPool(int threads)
+    {
+        for (int i = 0; i < std::max(1, threads); ++i) {
+            m_threads.emplace_back([this] { work(); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_stop = true;
+        }
+        m_ready.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    void post(Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_tasks.push_back(std::move(task));
+        }
+        m_ready.notify_one();
+    }
+
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        for (;;) {
+            m_ready.wait(lock, [this] { return !m_tasks.empty() || m_stop; });
+            if (m_tasks.empty()) {
+                return;
+            }
+
+            auto task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+private:
+    std::mutex               m_mutex;
+    std::condition_variable  m_ready;
+    std::deque<Task>         m_tasks;
+    std::vector<std::thread> m_threads;
+    bool                     m_stop = false;
+};
+
+struct FileState
+{
+    FileJob                       job;
+    FileEngine::Callback          callback;
+
+    int                           fd = -1;
+    FILE*                         output = nullptr;
+    uint64_t                      size = 0;
+    uint64_t                      chunkCount = 0;
+    bool                          stream = false;   // size unknown, read to EOF
+
+    // guarded by the engine mutex
+    uint64_t                      nextRead = 0;     // next chunk to read
+    uint64_t                      nextHash = 0;     // next chunk to hash
+    std::map<uint64_t, int>       ready;            // read chunk number -> buffer
+    int                           inflight = 0;
+    bool                          busy = false;     // a worker owns the file
+    bool                          finishing = false;
+    bool                          done = false;
+    std::string                   error;
+
+    // only touched by the worker that owns the file
+    Sm3Hash                       hash;
+    std::unique_ptr<Sm4Encryptor> encryptor;
+    Buffer                        cipher;
+};
+
+// what each chunk buffer is currently used for
+struct ChunkState
+{
+    FileState* file = nullptr;
+    uint64_t   number = 0;      // chunk number within the file
+    int        len = 0;         // bytes wanted
+    int        done = 0;        // bytes read so far
+};
+
+}
+
+class FileEnginePrivate
+{
+public:
+    explicit FileEnginePrivate(const FileEngineOptions& options);
+    ~FileEnginePrivate();
+
+    void submit(const FileJob& job, FileEngine::Callback callback);
+    void wait();
+
+    const char* backend() const { return m_reader->name(); }
+
+private:
+    void run();
+    void open(std::unique_ptr<FileState>& file);
+    void issueReads();
+    void complete(const ReadCompletion& completion);
+    void fail(FileState* file, const std::string& error);
+    void schedule(FileState* file);
+    void hashChunks(FileState* file);
+    void finish(FileState* file);
+    void releaseChunk(int chunk);
+
+private:
+    FileEngineOptions                       m_options;
+    std::vector<Buffer>                     m_chunks;
+    std::vector<ChunkState>                 m_chunkStates;
+    std::unique_ptr<Reader>                 m_reader;
+    std::unique_ptr<WorkerPool>             m_workers;
+
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_idle;
+    std::deque<std::unique_ptr<FileState>>  m_queued;       // submitted, not opened yet
+    std::vector<std::unique_ptr<FileState>> m_open;         // I/O thread only
+    std::vector<int>                        m_freeChunks;
+    uint64_t                                m_submitted = 0;
+    uint64_t                                m_delivered = 0;
+    bool                                    m_stop = false;
+
+    std::thread                             m_thread;
+};
+
+FileEnginePrivate::FileEnginePrivate(const FileEngineOptions& options)
+    : m_options{ options }
+{
+    m_options.chunkSize = std::max(16, m_options.chunkSize / 16 * 16);
+    m_options.chunks = std::max(1, m_options.chunks);
+    m_options.chunksPerFile = std::max(1, m_options.chunksPerFile);
+    m_options.openFiles = std::max(1, m_options.openFiles);
+    if (m_options.workers <= 0) {
+        m_options.workers = (int)std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    m_chunks.resize(m_options.chunks);
+    m_chunkStates.resize(m_options.chunks);
+    for (int i = 0; i < m_options.chunks; ++i) {
+        m_chunks[i].resizeForOverwrite(m_options.chunkSize);
+        m_freeChunks.push_back(m_options.chunks - 1 - i);
+    }
+
+#ifdef FILE_ENGINE_HAVE_URING
+    if (m_options.useIoUring) {
+        std::unique_ptr<UringReader> uring{ new UringReader{ m_chunks } };
+        if (uring->isValid()) {
+            m_reader = std::move(uring);
+        }
+    }
+#endif
+    if (!m_reader) {
+        m_reader.reset(new ThreadReader{ m_options.readers });
+    }
+
+    m_workers.reset(new WorkerPool{ m_options.workers });
+    m_thread = std::thread{ [this] { run(); } };
+}
+
+FileEnginePrivate::~FileEnginePrivate()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_stop = true;
+    }
+    m_reader->wake();
+    m_thread.join();
+    m_workers.reset();
+}
+
+void FileEnginePrivate::submit(const FileJob& job, FileEngine::Callback callback)
+{
+    std::unique_ptr<FileState> file{ new FileState };
+    file->job = job;
+    file->callback = std::move(callback);
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_queued.push_back(std::move(file));
+        ++m_submitted;
+    }
+    m_reader->wake();
+}
+
+void FileEnginePrivate::wait()
+{
+    std::unique_lock<std::mutex> lock{ m_mutex };
+    m_idle.wait(lock, [this] { return m_delivered == m_submitted; });
+}
+
+// The I/O thread: opens files, keeps reads in flight and routes completions.
+void FileEnginePrivate::run()
+{
+    std::vector<ReadCompletion> completions;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock{ m_mutex };
+
+            m_open.erase(std::remove_if(m_open.begin(), m_open.end(),
+                                        [](const std::unique_ptr<FileState>& file) { return file->done; }),
+                         m_open.end());
+
+            if (m_stop && m_queued.empty() && m_open.empty()) {
+                return;
+            }
+
+            while (!m_queued.empty() && (int)m_open.size() < m_options.openFiles) {
+                auto file = std::move(m_queued.front());
+                m_queued.pop_front();
+
+                lock.unlock();
+                open(file);
+                lock.lock();
+                m_open.push_back(std::move(file));
+                schedule(m_open.back().get());
+            }
+
+            issueReads();
+        }
+
+        completions.clear();
+        m_reader->wait(completions);
+
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        for (auto& completion : completions) {
+            complete(completion);
+        }
+    }
+}
+
+void FileEnginePrivate::open(std::unique_ptr<FileState>& file)
+{
+    file->fd = ::open(file->job.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+        file->error = strerror(errno);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
+        file->error = strerror(errno);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        file->error = strerror(EISDIR);
+        return;
+    }
+    // Pipes, FIFOs and procfs/sysfs files report no (or a wrong) size, so
+    // they are read one chunk at a time until a read returns 0. size then
+    // counts the bytes read and chunkCount is set at EOF.
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        file->stream = true;
+        file->chunkCount = UINT64_MAX;
+    }
+    else {
+        file->size = (uint64_t)st.st_size;
+        file->chunkCount = (file->size + m_options.chunkSize - 1) / m_options.chunkSize;
+    }
+
+    if (file->job.key) {
+        file->output = fopen(file->job.output.string().c_str(), "wb");
+        if (!file->output) {
+            file->error = file->job.output.string() + ": " + strerror(errno);
+            return;
+        }
+        file->encryptor.reset(new Sm4Encryptor{ *file->job.key });
+        file->cipher.resizeForOverwrite(m_options.chunkSize + 16);
+    }
+}
+
+// Hands out free chunks round-robin over the open files so that one large
+// file does not starve the others.
+void FileEnginePrivate::issueReads()
+{
+    bool issued = true;
+    while (issued && !m_freeChunks.empty()) {
+        issued = false;
+        for (auto& file : m_open) {
+            if (m_freeChunks.empty()) {
+                break;
+            }
+            if (!file->error.empty() || file->nextRead >= file->chunkCount || file->inflight >= m_options.chunksPerFile) {
+                continue;
+            }
+            if (file->stream && file->inflight > 0) {
+                continue;
+            }
+
+            int chunk = m_freeChunks.back();
+            m_freeChunks.pop_back();
+
+            auto offset = file->stream ? StreamOffset : file->nextRead * m_options.chunkSize;
+            auto& state = m_chunkStates[chunk];
+            state.file = file.get();
+            state.number = file->nextRead++;
+            state.len = file->stream ? m_options.chunkSize : (int)std::min<uint64_t>(m_options.chunkSize, file->size - offset);
+            state.done = 0;
+            ++file->inflight;
+
+            m_reader->submit({ file->fd, offset, chunk, m_chunks[chunk].data(), state.len });
+            issued = true;
+        }
+    }
+}
+
+void FileEnginePrivate::complete(const ReadCompletion& completion)
+{
+    auto& state = m_chunkStates[completion.chunk];
+    auto file = state.file;
+
+    if (file->stream && completion.result >= 0) {
+        --file->inflight;
+        if (completion.result == 0) {
+            // EOF: the chunk numbered here is one past the last
+            file->chunkCount = state.number;
+            file->nextRead = state.number;
+            releaseChunk(completion.chunk);
+        }
+        else if (file->error.empty()) {
+            // a short read is just a smaller chunk
+            state.len = completion.result;
+            file->size += (uint64_t)completion.result;
+            file->ready[state.number] = completion.chunk;
+        }
+        else {
+            releaseChunk(completion.chunk);
+        }
+        schedule(file);
+        return;
+    }
+
+    if (completion.result < 0 || (completion.result == 0 && state.done < state.len)) {
+        --file->inflight;
+        releaseChunk(completion.chunk);
+        fail(file, completion.result < 0 ? strerror(-completion.result) : "file shrank while reading");
+        return;
+    }
+
+    state.done += completion.result;
+    if (state.done < state.len && file->error.empty()) {
+        // short read, ask for the rest
+        auto offset = state.number * m_options.chunkSize + state.done;
+        m_reader->submit({ file->fd, offset, completion.chunk, m_chunks[completion.chunk].data() + state.done, state.len - state.done });
+        return;
+    }
+
+    --file->inflight;
+    if (!file->error.empty()) {
+        releaseChunk(completion.chunk);
+        schedule(file);
+        return;
+    }
+
+    file->ready[state.number] = completion.chunk;
+    schedule(file);
+}
+
+void FileEnginePrivate::fail(FileState* file, const std::string& error)
+{
+    if (file->error.empty()) {
+        file->error = error;
+    }
+    for (auto& entry : file->ready) {
+        releaseChunk(entry.second);
+    }
+    file->ready.clear();
+    schedule(file);
+}
+
+// Called with the mutex held: gives the file to a worker if it has the next
+// chunk ready, or if it is complete and only needs its result delivered.
+void FileEnginePrivate::schedule(FileState* file)
+{
+    if (file->busy || file->finishing) {
+        return;
+    }
+
+    bool failed = !file->error.empty();
+    bool complete = failed ? file->inflight == 0 : file->nextHash == file->chunkCount;
+    if (complete) {
+        file->finishing = true;
+        m_workers->post([this, file] { finish(file); });
+        return;
+    }
+
+    if (!failed && file->ready.count(file->nextHash)) {
+        file->busy = true;
+        m_workers->post([this, file] { hashChunks(file); });
+    }
+}
+
+// Hashes (and encrypts) the chunks that are ready in order, straight from the
+// read buffers, and returns the buffers to the I/O thread.
+void FileEnginePrivate::hashChunks(FileState* file)
+{
+    std::unique_lock<std::mutex> lock{ m_mutex };
+
+    for (;;) {
+        auto it = file->ready.find(file->nextHash);
+        if (it == file->ready.end() || !file->error.empty()) {
+            break;
+        }
+        int chunk = it->second;
+        file->ready.erase(it);
+        lock.unlock();
+
+        auto data = m_chunks[chunk].data();
+        auto len = m_chunkStates[chunk].len;
+        std::string error;
+
+        file->hash.update(data, len);
+        if (file->encryptor) {
+            int n = file->encryptor->update(data, len, file->cipher.data());
+            if (n < 0 || fwrite(file->cipher.data(), 1, (size_t)n, file->output) != (size_t)n) {
+                error = file->job.output.string() + ": write failed";
+            }
+        }
+
+        lock.lock();
+        ++file->nextHash;
+        releaseChunk(chunk);
+        if (!error.empty()) {
+            fail(file, error);
+        }
+    }
+
+    file->busy = false;
+    schedule(file);
+    m_reader->wake();
+}
+
+void FileEnginePrivate::finish(FileState* file)
+{
+    FileResult result;
+    result.path = file->job.path;
+    result.size = file->size;
+    result.error = file->error;
+
+    if (result.error.empty() && file->encryptor) {
+        char last[16];
+        int n = file->encryptor->finish(last);
+        if (n < 0 || fwrite(last, 1, (size_t)n, file->output) != (size_t)n || fflush(file->output) != 0) {
+            result.error = file->job.output.string() + ": write failed";
+        }
+    }
+    if (file->output && fclose(file->output) != 0 && result.error.empty()) {
+        result.error = file->job.output.string() + ": write failed";
+    }
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+
+    result.ok = result.error.empty();
+    if (result.ok) {
+        result.digest = file->hash.finish();
+    }
+
+    if (file->callback) {
+        file->callback(std::move(result));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        file->done = true;
+        ++m_delivered;
+    }
+    m_idle.notify_all();
+    m_reader->wake();
+}
+
+void FileEnginePrivate::releaseChunk(int chunk)
+{
+    m_chunkStates[chunk].file = nullptr;
+    m_freeChunks.push_back(chunk);
+}
+
+FileEngine::FileEngine(const FileEngineOptions& options)
+    : m_ptr{ new FileEnginePrivate{ options } }
+{
+
+}
+
+FileEngine::~FileEngine()
+{
+    delete m_ptr;
+}
+
+void FileEngine::submit(const FileJob& job, Callback callback)
+{
+    m_ptr->submit(job, std::move(callback));
+}
+
+std::future<FileResult> FileEngine::submit(const FileJob& job)
+{
+    auto promise = std::make_shared<std::promise<FileResult>>();
+    auto future = promise->get_future();
+    m_ptr->submit(job, [promise](FileResult&& result) { promise->set_value(std::move(result)); });
+    return future;
+}
+
+void FileEngine::wait()
+{
+    m_ptr->wait();
+}
+
+const char* FileEngine::backend() const
+{
+    return m_ptr->backend();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <string>
+
+#include "buffer.h"
+
+class Sm4Key;
+class FileEnginePrivate;
+
+// One file to process. Every file is hashed with SM3; with a key the contents
+// are also encrypted into output, in the same format as sm4::encrypt (CBC
+// with PKCS#7 padding).
+struct FileJob
+{
+    std::filesystem::path path;
+    const Sm4Key*         key = nullptr;    // must outlive the job
+    std::filesystem::path output;
+};
+
+struct FileResult
+{
+    std::filesystem::path path;
+    bool                  ok = false;
+    std::string           error;
+    uint64_t              size = 0;
+    Buffer                digest;           // SM3 of the file contents
+};
+
+struct FileEngineOptions
+{
+    int  workers = 0;           // hashing threads, 0 for one per core
+    int  chunkSize = 256 * 1024;
+    int  chunks = 64;           // read buffers, bounds memory and reads in flight
+    int  chunksPerFile = 4;     // reads in flight for one file
+    int  openFiles = 64;        // files read at the same time
+    int  readers = 4;           // reading threads when io_uring is not used
+    bool useIoUring = true;
+};
+
+// Hashes (and optionally encrypts) many files concurrently. A single thread
+// keeps reads for many files in flight through io_uring, straight into a
+// fixed set of chunk buffers registered with the kernel, and hands completed
+// chunks to worker threads, which hash them in place and in file order.
+// Without io_uring (old kernel, seccomp, useIoUring off) a small pool of
+// threads reads with pread() instead.
+//
+// Callbacks run on a worker thread and must not throw.
+class FileEngine
+{
+public:
+    using Callback = std::function<void(FileResult&&)>;
+
+    explicit FileEngine(const FileEngineOptions& options = FileEngineOptions{});
+    // waits for all submitted jobs
+    ~FileEngine();
+
+    FileEngine(const FileEngine&) = delete;
+    FileEngine& operator=(const FileEngine&) = delete;
+
+    void submit(const FileJob& job, Callback callback);
+    std::future<FileResult> submit(const FileJob& job);
+
+    // blocks until every job submitted so far has been delivered
+    void wait();
+
+    // "io_uring" or "threads"
+    const char* backend() const;
+
+private:
+    FileEnginePrivate* m_ptr;
+};
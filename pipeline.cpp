@@ -0,0 +1,476 @@
+#include "pipeline.h"
+
+#ifdef BUFFER_HAVE_PIPELINE
+
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "sm3.h"
+#include "sm4.h"
+
+void Task::promise_type::unhandled_exception()
+{
+    // stages report errors through StageIo::fail(), anything thrown is a bug
+    std::terminate();
+}
+
+Task::~Task()
+{
+    if (m_handle) {
+        m_handle.destroy();
+    }
+}
+
+Task::Task(Task&& other) noexcept
+    : m_handle{ other.m_handle }
+{
+    other.m_handle = nullptr;
+}
+
+Task& Task::operator=(Task&& other) noexcept
+{
+    if (this != &other) {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+        m_handle = other.m_handle;
+        other.m_handle = nullptr;
+    }
+    return *this;
+}
+
+EventLoop::~EventLoop()
+{
+    m_tasks.clear();
+}
+
+void EventLoop::spawn(Task task)
+{
+    schedule(task.m_handle);
+    m_tasks.push_back(std::move(task));
+}
+
+void EventLoop::schedule(std::coroutine_handle<> handle)
+{
+    m_ready.push_back(handle);
+}
+
+EventLoop::FdAwaiter EventLoop::readable(int fd)
+{
+    return FdAwaiter{ *this, fd, POLLIN };
+}
+
+EventLoop::FdAwaiter EventLoop::writable(int fd)
+{
+    return FdAwaiter{ *this, fd, POLLOUT };
+}
+
+void EventLoop::run()
+{
+    for (;;) {
+        while (!m_ready.empty()) {
+            auto handle = m_ready.front();
+            m_ready.pop_front();
+            handle.resume();
+        }
+
+        m_tasks.erase(std::remove_if(m_tasks.begin(), m_tasks.end(), [](const Task& task) { return task.isDone(); }),
+                      m_tasks.end());
+
+        // with nothing ready and no descriptor to wait for, the remaining
+        // tasks (if any) wait on each other and can never finish
+        if (m_waiters.empty()) {
+            return;
+        }
+        pollWaiters();
+    }
+}
+
+void EventLoop::pollWaiters()
+{
+    std::vector<pollfd> fds(m_waiters.size());
+    for (size_t i = 0; i < m_waiters.size(); ++i) {
+        fds[i].fd = m_waiters[i].fd;
+        fds[i].events = m_waiters[i].events;
+        fds[i].revents = 0;
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+        return;
+    }
+
+    // errors and hang-ups also resume the waiter, whose next read or write
+    // reports them
+    std::vector<Waiter> waiting;
+    for (size_t i = 0; i < m_waiters.size(); ++i) {
+        if (fds[i].revents) {
+            schedule(m_waiters[i].handle);
+        }
+        else {
+            waiting.push_back(m_waiters[i]);
+        }
+    }
+    m_waiters.swap(waiting);
+}
+
+Channel::Channel(EventLoop& loop, int capacity)
+    : m_loop{ loop }
+    , m_capacity{ std::max(1, capacity) }
+{
+
+}
+
+bool Channel::PushAwaiter::await_resume()
+{
+    if (channel.m_cancelled) {
+        return false;
+    }
+    channel.m_chunks.push_back(std::move(chunk));
+    channel.wake(channel.m_consumer);
+    return true;
+}
+
+bool Channel::PopAwaiter::await_resume()
+{
+    if (channel.m_chunks.empty()) {
+        return false;
+    }
+    chunk = std::move(channel.m_chunks.front());
+    channel.m_chunks.pop_front();
+    channel.wake(channel.m_producer);
+    return true;
+}
+
+Channel::PushAwaiter Channel::push(Buffer chunk)
+{
+    return PushAwaiter{ *this, std::move(chunk) };
+}
+
+Channel::PopAwaiter Channel::pop(Buffer& chunk)
+{
+    return PopAwaiter{ *this, chunk };
+}
+
+void Channel::close()
+{
+    m_closed = true;
+    wake(m_consumer);
+}
+
+void Channel::cancel()
+{
+    m_cancelled = true;
+    m_chunks.clear();
+    wake(m_producer);
+}
+
+void Channel::wake(std::coroutine_handle<>& handle)
+{
+    if (handle) {
+        m_loop.schedule(handle);
+        handle = nullptr;
+    }
+}
+
+void StageIo::fail(const std::string& message)
+{
+    if (error->empty()) {
+        *error = message;
+    }
+}
+
+bool StageIo::failed() const
+{
+    return !error->empty();
+}
+
+Pipeline::Pipeline(EventLoop& loop, int chunkSize, int depth)
+    : m_loop{ loop }
+    , m_chunkSize{ std::max(16, chunkSize) }
+    , m_depth{ std::max(1, depth) }
+    , m_error{ std::make_shared<std::string>() }
+{
+
+}
+
+Pipeline& Pipeline::add(Stage stage)
+{
+    m_stages.push_back(std::move(stage));
+    return *this;
+}
+
+bool Pipeline::start()
+{
+    if (m_stages.empty() || !m_channels.empty()) {
+        return false;
+    }
+
+    for (size_t i = 1; i < m_stages.size(); ++i) {
+        m_channels.push_back(std::make_shared<Channel>(m_loop, m_depth));
+    }
+
+    for (size_t i = 0; i < m_stages.size(); ++i) {
+        StageIo io{ m_loop, i > 0 ? m_channels[i - 1] : nullptr,
+                    i + 1 < m_stages.size() ? m_channels[i] : nullptr, m_error, m_chunkSize };
+        m_loop.spawn(m_stages[i](io));
+    }
+    return true;
+}
+
+namespace
+{
+
+// Whatever way a stage ends, downstream sees the end of its input and
+// upstream stops producing.
+struct StageGuard
+{
+    StageIo& io;
+
+    ~StageGuard()
+    {
+        if (io.out) {
+            io.out->close();
+        }
+        if (io.in) {
+            io.in->cancel();
+        }
+    }
+};
+
+// Fills chunks of io.chunkSize (less at the end, or from pipes and sockets).
+Task readFdTask(StageIo io, int fd, bool closeAtEnd, std::filesystem::path path)
+{
+    StageGuard guard{ io };
+
+    if (fd < 0) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            io.fail(path.string() + ": " + strerror(errno));
+            co_return;
+        }
+    }
+
+    for (;;) {
+        if (io.failed()) {
+            break;
+        }
+
+        Buffer chunk;
+        chunk.resizeForOverwrite(io.chunkSize);
+        auto n = read(fd, chunk.data(), (size_t)io.chunkSize);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await io.loop.readable(fd);
+                continue;
+            }
+            io.fail(std::string{ "read: " } + strerror(errno));
+            break;
+        }
+        if (n == 0 || !io.out) {
+            break;
+        }
+
+        chunk.resize((int)n);
+        if (!co_await io.out->push(std::move(chunk))) {
+            break;
+        }
+    }
+
+    if (closeAtEnd || !path.empty()) {
+        close(fd);
+    }
+}
+
+// A file is only created once the first chunk (or the end of the input) has
+// arrived without an error, so a pipeline that fails early leaves an existing
+// file alone; one that fails later removes what it wrote.
+Task writeFdTask(StageIo io, int fd, bool closeAtEnd, std::filesystem::path path)
+{
+    StageGuard guard{ io };
+
+    Buffer chunk;
+    bool more = co_await io.in->pop(chunk);
+    if (io.failed()) {
+        co_return;
+    }
+
+    if (fd < 0) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            io.fail(path.string() + ": " + strerror(errno));
+            co_return;
+        }
+    }
+
+    for (; more && !io.failed(); more = co_await io.in->pop(chunk)) {
+        int written = 0;
+        while (written < chunk.size()) {
+            auto n = write(fd, chunk.data() + written, (size_t)(chunk.size() - written));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await io.loop.writable(fd);
+                    continue;
+                }
+                io.fail(std::string{ "write: " } + strerror(errno));
+                break;
+            }
+            written += (int)n;
+        }
+    }
+
+    if ((closeAtEnd || !path.empty()) && close(fd) != 0) {
+        io.fail(path.string() + ": " + strerror(errno));
+    }
+    if (io.failed() && !path.empty()) {
+        unlink(path.c_str());
+    }
+}
+
+template<typename Cipher>
+Task sm4Task(StageIo io, Sm4Key key)
+{
+    StageGuard guard{ io };
+    Cipher cipher{ key };
+
+    Buffer chunk;
+    while (co_await io.in->pop(chunk)) {
+        Buffer output;
+        output.resizeForOverwrite(chunk.size() + 15);
+        int n = cipher.update(chunk.data(), chunk.size(), output.data());
+        if (n < 0) {
+            io.fail("sm4: invalid key");
+            co_return;
+        }
+
+        output.resize(n);
+        if (n > 0 && io.out && !co_await io.out->push(std::move(output))) {
+            co_return;
+        }
+    }
+
+    // an upstream failure also ends the input, but must not look like a
+    // complete message
+    if (io.failed()) {
+        co_return;
+    }
+
+    Buffer last;
+    last.resizeForOverwrite(16);
+    int n = cipher.finish(last.data());
+    if (n < 0) {
+        io.fail("sm4: bad length or padding");
+        co_return;
+    }
+
+    last.resize(n);
+    if (n > 0 && io.out) {
+        co_await io.out->push(std::move(last));
+    }
+}
+
+// Encodes whole 3-byte groups as they arrive and carries the rest over.
+Task base64Task(StageIo io)
+{
+    StageGuard guard{ io };
+    Buffer carry;
+
+    Buffer chunk;
+    while (co_await io.in->pop(chunk)) {
+        if (!carry.isEmpty()) {
+            chunk.insert(0, carry);
+            carry.clear();
+        }
+
+        int whole = chunk.size() / 3 * 3;
+        if (whole < chunk.size()) {
+            carry = chunk.mid(whole);
+            chunk.resize(whole);
+        }
+        if (whole == 0) {
+            continue;
+        }
+
+        if (io.out && !co_await io.out->push(Buffer{ chunk.toBase64() })) {
+            co_return;
+        }
+    }
+
+    if (!io.failed() && !carry.isEmpty() && io.out) {
+        co_await io.out->push(Buffer{ carry.toBase64() });
+    }
+}
+
+Task sm3Task(StageIo io, Buffer* digest)
+{
+    StageGuard guard{ io };
+    Sm3Hash hash;
+
+    Buffer chunk;
+    while (co_await io.in->pop(chunk)) {
+        hash.update(chunk);
+        if (io.out && !co_await io.out->push(std::move(chunk))) {
+            co_return;
+        }
+    }
+
+    if (!io.failed() && digest) {
+        *digest = hash.finish();
+    }
+}
+
+}
+
+Stage readFile(const std::filesystem::path& path)
+{
+    return [path](StageIo io) { return readFdTask(io, -1, true, path); };
+}
+
+Stage readFd(int fd, bool closeAtEnd)
+{
+    return [fd, closeAtEnd](StageIo io) { return readFdTask(io, fd, closeAtEnd, std::filesystem::path{}); };
+}
+
+Stage sm4Encrypt(const Sm4Key& key)
+{
+    return [key](StageIo io) { return sm4Task<Sm4Encryptor>(io, key); };
+}
+
+Stage sm4Decrypt(const Sm4Key& key)
+{
+    return [key](StageIo io) { return sm4Task<Sm4Decryptor>(io, key); };
+}
+
+Stage base64Encode()
+{
+    return [](StageIo io) { return base64Task(io); };
+}
+
+Stage sm3Digest(Buffer* digest)
+{
+    return [digest](StageIo io) { return sm3Task(io, digest); };
+}
+
+Stage writeFile(const std::filesystem::path& path)
+{
+    return [path](StageIo io) { return writeFdTask(io, -1, true, path); };
+}
+
+Stage writeFd(int fd, bool closeAtEnd)
+{
+    return [fd, closeAtEnd](StageIo io) { return writeFdTask(io, fd, closeAtEnd, std::filesystem::path{}); };
+}
+
+#endif
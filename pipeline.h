@@ -0,0 +1,226 @@
+#pragma once
+
+// Coroutine pipelines need C++20; in older language modes this header (and
+// pipeline.cpp) is empty.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+
+#define BUFFER_HAVE_PIPELINE 1
+
+class EventLoop;
+class Sm4Key;
+
+// Coroutine run by an EventLoop. It starts when spawned and is destroyed by
+// the loop once it has finished.
+class Task
+{
+public:
+    struct promise_type
+    {
+        Task get_return_object() { return Task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception();
+    };
+
+    Task() = default;
+    explicit Task(std::coroutine_handle<promise_type> handle) : m_handle{ handle } {}
+    ~Task();
+
+    Task(Task&& other) noexcept;
+    Task& operator=(Task&& other) noexcept;
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool isDone() const { return !m_handle || m_handle.done(); }
+
+private:
+    friend class EventLoop;
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+// Single-threaded scheduler: resumes ready coroutines in FIFO order and waits
+// in poll(2) when every task is blocked on a file descriptor.
+class EventLoop
+{
+public:
+    EventLoop() = default;
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void spawn(Task task);
+
+    // runs until every task has finished, or none can make progress
+    void run();
+
+    void schedule(std::coroutine_handle<> handle);
+
+    struct FdAwaiter
+    {
+        EventLoop& loop;
+        int        fd;
+        short      events;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop.m_waiters.push_back({ fd, events, handle }); }
+        void await_resume() const noexcept {}
+    };
+
+    // suspend until fd is readable / writable (or in error)
+    FdAwaiter readable(int fd);
+    FdAwaiter writable(int fd);
+
+private:
+    struct Waiter
+    {
+        int                     fd;
+        short                   events;
+        std::coroutine_handle<> handle;
+    };
+
+    void pollWaiters();
+
+private:
+    std::deque<std::coroutine_handle<>> m_ready;
+    std::vector<Waiter>                 m_waiters;
+    std::vector<Task>                   m_tasks;
+};
+
+// Bounded queue of chunks between two stages of one loop: one producer, one
+// consumer. push() suspends while the queue is full, which is what keeps the
+// memory of a pipeline bounded.
+class Channel
+{
+public:
+    Channel(EventLoop& loop, int capacity);
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    struct PushAwaiter
+    {
+        Channel& channel;
+        Buffer   chunk;
+
+        bool await_ready() const noexcept { return channel.m_cancelled || (int)channel.m_chunks.size() < channel.m_capacity; }
+        void await_suspend(std::coroutine_handle<> handle) { channel.m_producer = handle; }
+        bool await_resume();
+    };
+
+    struct PopAwaiter
+    {
+        Channel& channel;
+        Buffer&  chunk;
+
+        bool await_ready() const noexcept { return channel.m_closed || !channel.m_chunks.empty(); }
+        void await_suspend(std::coroutine_handle<> handle) { channel.m_consumer = handle; }
+        bool await_resume();
+    };
+
+    // co_await yields false if the consumer has gone away
+    PushAwaiter push(Buffer chunk);
+
+    // co_await yields false once the channel is closed and drained
+    PopAwaiter pop(Buffer& chunk);
+
+    // producer: no more chunks
+    void close();
+
+    // consumer: stop accepting chunks, pending and later pushes fail
+    void cancel();
+
+private:
+    void wake(std::coroutine_handle<>& handle);
+
+private:
+    EventLoop&              m_loop;
+    int                     m_capacity;
+    std::deque<Buffer>      m_chunks;
+    bool                    m_closed = false;
+    bool                    m_cancelled = false;
+    std::coroutine_handle<> m_producer;
+    std::coroutine_handle<> m_consumer;
+};
+
+// What a stage works with. in is null for a source, out for a sink. The
+// channels and the error are shared with the pipeline, so that stages still
+// suspended when the loop is destroyed can wind down after the pipeline.
+struct StageIo
+{
+    EventLoop&                   loop;
+    std::shared_ptr<Channel>     in;
+    std::shared_ptr<Channel>     out;
+    std::shared_ptr<std::string> error;
+    int                          chunkSize;
+
+    // records the first error of the pipeline
+    void fail(const std::string& message);
+    bool failed() const;
+};
+
+using Stage = std::function<Task(StageIo io)>;
+
+// A chain of stages connected by channels, e.g.
+//
+//     Pipeline p{ loop };
+//     p.add(readFile(in)).add(sm4Encrypt(key)).add(base64Encode()).add(writeFile(out));
+//     p.start();
+//     loop.run();
+//
+// A stage that stops early (error or done) closes its output and cancels its
+// input, so the stages around it wind down too. The pipeline may be destroyed
+// before the loop; ok() and error() are only meaningful once run() returns.
+class Pipeline
+{
+public:
+    explicit Pipeline(EventLoop& loop, int chunkSize = 64 * 1024, int depth = 4);
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    Pipeline& add(Stage stage);
+
+    // spawns the stages on the loop
+    bool start();
+
+    bool ok() const { return m_error->empty(); }
+    const std::string& error() const { return *m_error; }
+
+private:
+    EventLoop&                            m_loop;
+    int                                   m_chunkSize;
+    int                                   m_depth;
+    std::vector<Stage>                    m_stages;
+    std::vector<std::shared_ptr<Channel>> m_channels;
+    std::shared_ptr<std::string>          m_error;
+};
+
+// sources
+Stage readFile(const std::filesystem::path& path);
+Stage readFd(int fd, bool closeAtEnd = false);     // non-blocking descriptors are awaited in the loop
+
+// transforms
+Stage sm4Encrypt(const Sm4Key& key);               // CBC with PKCS#7, as Sm4Key::encrypt
+Stage sm4Decrypt(const Sm4Key& key);
+Stage base64Encode();
+Stage sm3Digest(Buffer* digest);                   // passes data through; a sink when last
+
+// sinks
+Stage writeFile(const std::filesystem::path& path);
+Stage writeFd(int fd, bool closeAtEnd = false);    // e.g. so that a socket peer sees the end
+
+#endif
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+
+#include "buffer.h"
+#include "pipeline.h"
+#include "sm4.h"
+
+// Runs the coroutine pipeline stages against the one-shot calls they stand
+// for: readFile -> sm4Encrypt -> base64Encode -> writeFile must give the same
+// text as Sm4Key::encrypt followed by toBase64, for sizes around the chunk
+// and block boundaries. Also checks an encrypt/decrypt round trip, that errors
+// reach Pipeline::error() without touching the output file, and that a
+// pipeline may be destroyed before the loop that ran it.
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+const int chunk_size = 1000;
+
+Buffer randomBuffer(std::mt19937& rng, int len)
+{
+    Buffer data;
+    data.resizeForOverwrite(len);
+    for (int i = 0; i < len; ++i) {
+        data.data()[i] = static_cast<char>(rng());
+    }
+    return data;
+}
+
+bool writeAll(const fs::path& path, const char* data, int len)
+{
+    std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+    file.write(data, len);
+    return static_cast<bool>(file);
+}
+
+std::string readAll(const fs::path& path)
+{
+    std::ifstream file{ path, std::ios::binary };
+    return std::string{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+}
+
+// runs the stages to the end; false if the pipeline did not start
+bool run(std::initializer_list<Stage> stages, std::string& error)
+{
+    EventLoop loop;
+    Pipeline pipeline{ loop, chunk_size, 2 };
+    for (auto& stage : stages) {
+        pipeline.add(stage);
+    }
+    if (!pipeline.start()) {
+        return false;
+    }
+    loop.run();
+    error = pipeline.error();
+    return true;
+}
+
+bool encode(const fs::path& dir, const Sm4Key& key, const Buffer& data)
+{
+    auto input = dir / "plain";
+    auto output = dir / "encoded";
+    if (!writeAll(input, data.data(), data.size())) {
+        return false;
+    }
+
+    std::string error;
+    if (!run({ readFile(input), sm4Encrypt(key), base64Encode(), writeFile(output) }, error) || !error.empty()) {
+        fprintf(stderr, "pipeline_test: %d bytes: %s\n", data.size(), error.c_str());
+        return false;
+    }
+
+    // an empty Buffer has no data pointer, which the one-shot call rejects
+    Buffer cipher;
+    if (!key.encrypt(data.isEmpty() ? "" : data.data(), data.size(), cipher)) {
+        return false;
+    }
+    if (readAll(output) != cipher.toBase64()) {
+        fprintf(stderr, "pipeline_test: base64 of %d bytes differs from toBase64\n", data.size());
+        return false;
+    }
+    return true;
+}
+
+bool roundTrip(const fs::path& dir, const Sm4Key& key, const Buffer& data)
+{
+    auto input = dir / "plain";
+    auto output = dir / "decrypted";
+    if (!writeAll(input, data.data(), data.size())) {
+        return false;
+    }
+
+    std::string error;
+    Buffer before, after;
+    if (!run({ readFile(input), sm3Digest(&before), sm4Encrypt(key), sm4Decrypt(key), sm3Digest(&after), writeFile(output) },
+             error)
+        || !error.empty()) {
+        fprintf(stderr, "pipeline_test: round trip of %d bytes: %s\n", data.size(), error.c_str());
+        return false;
+    }
+
+    auto text = readAll(output);
+    if (before != after || text.size() != (size_t)data.size() || text.compare(0, text.size(), data.data(), data.size()) != 0) {
+        fprintf(stderr, "pipeline_test: round trip of %d bytes differs\n", data.size());
+        return false;
+    }
+    return true;
+}
+
+bool errors(const fs::path& dir, const Sm4Key& key)
+{
+    auto missing = dir / "missing";
+    auto output = dir / "kept";
+    if (!writeAll(output, "old", 3)) {
+        return false;
+    }
+
+    // the source fails before anything is written: the old file stays
+    std::string error;
+    if (!run({ readFile(missing), sm4Encrypt(key), writeFile(output) }, error)
+        || error.find(missing.string()) == std::string::npos || readAll(output) != "old") {
+        fprintf(stderr, "pipeline_test: missing input not reported (%s)\n", error.c_str());
+        return false;
+    }
+
+    // ciphertext that is not a whole number of blocks fails in the last
+    // chunk, after some output was written: the partial file is removed
+    auto cipher = dir / "cipher";
+    std::mt19937 rng{ 3 };
+    auto data = randomBuffer(rng, 5 * chunk_size + 5);
+    if (!writeAll(cipher, data.data(), data.size())) {
+        return false;
+    }
+    if (!run({ readFile(cipher), sm4Decrypt(key), writeFile(output) }, error) || error != "sm4: bad length or padding"
+        || fs::exists(output)) {
+        fprintf(stderr, "pipeline_test: bad ciphertext not reported (%s)\n", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+// a stage that never finishes, so the source stays blocked on a full channel
+Task stuckTask([[maybe_unused]] StageIo io)
+{
+    co_await std::suspend_always{};
+}
+
+// the loop destroys the unfinished stages after the pipeline is gone; their
+// channels must still be there (the address sanitizer catches it otherwise)
+bool lifetime(const fs::path& dir)
+{
+    auto input = dir / "plain";
+    std::mt19937 rng{ 5 };
+    auto data = randomBuffer(rng, 20 * chunk_size);
+    if (!writeAll(input, data.data(), data.size())) {
+        return false;
+    }
+
+    EventLoop loop;
+    {
+        Pipeline pipeline{ loop, chunk_size, 2 };
+        pipeline.add(readFile(input)).add(stuckTask);
+        if (!pipeline.start()) {
+            return false;
+        }
+        loop.run();
+    }
+    return true;
+}
+
+}
+
+int main()
+{
+    auto dir = fs::temp_directory_path() / ("pipeline_test." + std::to_string(getpid()));
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        fprintf(stderr, "pipeline_test: %s: %s\n", dir.c_str(), ec.message().c_str());
+        return 1;
+    }
+
+    std::mt19937 rng{ 2024 };
+    Sm4Key key{ randomBuffer(rng, 16) };
+
+    int failures = 0;
+    const int sizes[] = { 0, 1, 15, 16, 17, chunk_size - 1, chunk_size, chunk_size + 1, 3 * chunk_size + 7, 1 << 20 };
+    for (int size : sizes) {
+        auto data = randomBuffer(rng, size);
+        failures += !encode(dir, key, data);
+        failures += !roundTrip(dir, key, data);
+    }
+    failures += !errors(dir, key);
+    failures += !lifetime(dir);
+
+    fs::remove_all(dir, ec);
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
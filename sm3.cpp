@@ -223,6 +223,203 @@ static void sm3_finish(sm3_context* ctx, uint8_t output[32])
     SM3_PUT_ULONG_BE(ctx->state[7], output, 28);
 }
 
+// SM3 HMAC context setup
+static void sm3_hmac_starts(sm3_context* ctx, const uint8_t* key, int keylen)
+{
+    int i;
+    uint8_t sum[32];
+
+    if (keylen > 64) {
+        sm3_init(ctx);
+        sm3_update(ctx, key, keylen);
+        sm3_finish(ctx, sum);
+        keylen = 32;
+        key = sum;
+    }
+
+    memset(ctx->ipad, 0x36, 64);
+    memset(ctx->opad, 0x5C, 64);
+
+    for (i = 0; i < keylen; ++i) {
+        ctx->ipad[i] = (uint8_t)(ctx->ipad[i] ^ key[i]);
+        ctx->opad[i] = (uint8_t)(ctx->opad[i] ^ key[i]);
+    }
+
+    sm3_init(ctx);
+    sm3_update(ctx, ctx->ipad, 64);
+
+    memset(sum, 0, sizeof(sum));
+}
+
+static void sm3_hmac_update(sm3_context* ctx, const uint8_t* input, int ilen)
+{
+    sm3_update(ctx, input, ilen);
+}
+
+static void sm3_hmac_finish(sm3_context* ctx, uint8_t output[32])
+{
+    uint8_t tmpbuf[32];
+
+    sm3_finish(ctx, tmpbuf);
+    sm3_init(ctx);
+    sm3_update(ctx, ctx->opad, 64);
+    sm3_update(ctx, tmpbuf, 32);
+    sm3_finish(ctx, output);
+
+    memset(tmpbuf, 0, sizeof(tmpbuf));
+}
+
+// Compression of N independent message blocks given as big endian words.
+// Every step is a short loop over the lanes, so the lanes are interleaved
+// and the compiler is free to keep them in vector registers.
+template<int N>
+static void sm3_process_lanes(uint32_t state[8][N], const uint32_t block[16][N])
+{
+    // T(j) <<< (j mod 32)
+    static const uint32_t T[64] = {
+        0x79CC4519, 0xF3988A32, 0xE7311465, 0xCE6228CB, 0x9CC45197, 0x3988A32F, 0x7311465E, 0xE6228CBC,
+        0xCC451979, 0x988A32F3, 0x311465E7, 0x6228CBCE, 0xC451979C, 0x88A32F39, 0x11465E73, 0x228CBCE6,
+        0x9D8A7A87, 0x3B14F50F, 0x7629EA1E, 0xEC53D43C, 0xD8A7A879, 0xB14F50F3, 0x629EA1E7, 0xC53D43CE,
+        0x8A7A879D, 0x14F50F3B, 0x29EA1E76, 0x53D43CEC, 0xA7A879D8, 0x4F50F3B1, 0x9EA1E762, 0x3D43CEC5,
+        0x7A879D8A, 0xF50F3B14, 0xEA1E7629, 0xD43CEC53, 0xA879D8A7, 0x50F3B14F, 0xA1E7629E, 0x43CEC53D,
+        0x879D8A7A, 0x0F3B14F5, 0x1E7629EA, 0x3CEC53D4, 0x79D8A7A8, 0xF3B14F50, 0xE7629EA1, 0xCEC53D43,
+        0x9D8A7A87, 0x3B14F50F, 0x7629EA1E, 0xEC53D43C, 0xD8A7A879, 0xB14F50F3, 0x629EA1E7, 0xC53D43CE,
+        0x8A7A879D, 0x14F50F3B, 0x29EA1E76, 0x53D43CEC, 0xA7A879D8, 0x4F50F3B1, 0x9EA1E762, 0x3D43CEC5
+    };
+
+    uint32_t W[68][N];
+    uint32_t A[N], B[N], C[N], D[N], E[N], F[N], G[N], H[N];
+    uint32_t SS1, SS2, TT1, TT2;
+    int j, l;
+
+    memcpy(W, block, sizeof(uint32_t) * 16 * N);
+
+    for (j = 16; j < 68; ++j) {
+        for (l = 0; l < N; ++l) {
+            uint32_t x = W[j - 16][l] ^ W[j - 9][l] ^ ROTL(W[j - 3][l], 15);
+            W[j][l] = P1(x) ^ ROTL(W[j - 13][l], 7) ^ W[j - 6][l];
+        }
+    }
+
+    for (l = 0; l < N; ++l) {
+        A[l] = state[0][l];
+        B[l] = state[1][l];
+        C[l] = state[2][l];
+        D[l] = state[3][l];
+        E[l] = state[4][l];
+        F[l] = state[5][l];
+        G[l] = state[6][l];
+        H[l] = state[7][l];
+    }
+
+    for (j = 0; j < 64; ++j) {
+        for (l = 0; l < N; ++l) {
+            SS1 = ROTL((ROTL(A[l], 12) + E[l] + T[j]), 7);
+            SS2 = SS1 ^ ROTL(A[l], 12);
+            if (j < 16) {
+                TT1 = FF0(A[l], B[l], C[l]) + D[l] + SS2 + (W[j][l] ^ W[j + 4][l]);
+                TT2 = GG0(E[l], F[l], G[l]) + H[l] + SS1 + W[j][l];
+            }
+            else {
+                TT1 = FF1(A[l], B[l], C[l]) + D[l] + SS2 + (W[j][l] ^ W[j + 4][l]);
+                TT2 = GG1(E[l], F[l], G[l]) + H[l] + SS1 + W[j][l];
+            }
+            D[l] = C[l];
+            C[l] = ROTL(B[l], 9);
+            B[l] = A[l];
+            A[l] = TT1;
+            H[l] = G[l];
+            G[l] = ROTL(F[l], 19);
+            F[l] = E[l];
+            E[l] = P0(TT2);
+        }
+    }
+
+    for (l = 0; l < N; ++l) {
+        state[0][l] ^= A[l];
+        state[1][l] ^= B[l];
+        state[2][l] ^= C[l];
+        state[3][l] ^= D[l];
+        state[4][l] ^= E[l];
+        state[5][l] ^= F[l];
+        state[6][l] ^= G[l];
+        state[7][l] ^= H[l];
+    }
+}
+
+// PBKDF2-HMAC-SM3 for N output blocks at once.
+//
+// The key is absorbed once into the inner/outer states, so each iteration
+// only compresses the single padded block holding the previous 32-byte U
+// (64 + 32 bytes in total, hence the fixed 768-bit length).
+template<int N>
+static void sm3_pbkdf2_lanes(const sm3_context* inner, const sm3_context* outer,
+                             const uint8_t* salt, int saltlen, uint32_t index, int iterations, uint8_t* output)
+{
+    uint32_t block[16][N];
+    uint32_t state[8][N];
+    uint32_t result[8][N];
+    uint8_t  counter[4];
+    uint8_t  u[32];
+    int i, j, l;
+
+    // U1 = PRF(P, S || INT(i))
+    for (l = 0; l < N; ++l) {
+        sm3_context ctx = *inner;
+        SM3_PUT_ULONG_BE(index + l, counter, 0);
+        sm3_update(&ctx, salt, saltlen);
+        sm3_update(&ctx, counter, 4);
+        sm3_finish(&ctx, u);
+
+        ctx = *outer;
+        sm3_update(&ctx, u, 32);
+        sm3_finish(&ctx, u);
+
+        for (j = 0; j < 8; ++j) {
+            SM3_GET_ULONG_BE(block[j][l], u, j * 4);
+            result[j][l] = block[j][l];
+        }
+    }
+
+    for (l = 0; l < N; ++l) {
+        block[8][l] = 0x80000000;
+        for (j = 9; j < 15; ++j) {
+            block[j][l] = 0;
+        }
+        block[15][l] = (64 + 32) * 8;
+    }
+
+    for (i = 1; i < iterations; ++i) {
+        for (j = 0; j < 8; ++j) {
+            for (l = 0; l < N; ++l) {
+                state[j][l] = inner->state[j];
+            }
+        }
+        sm3_process_lanes<N>(state, block);
+
+        for (j = 0; j < 8; ++j) {
+            for (l = 0; l < N; ++l) {
+                block[j][l] = state[j][l];
+                state[j][l] = outer->state[j];
+            }
+        }
+        sm3_process_lanes<N>(state, block);
+
+        for (j = 0; j < 8; ++j) {
+            for (l = 0; l < N; ++l) {
+                block[j][l] = state[j][l];
+                result[j][l] ^= state[j][l];
+            }
+        }
+    }
+
+    for (l = 0; l < N; ++l) {
+        for (j = 0; j < 8; ++j) {
+            SM3_PUT_ULONG_BE(result[j][l], output, l * 32 + j * 4);
+        }
+    }
+}
+
 }
 
 static constexpr int size = 32;
@@ -267,3 +464,117 @@ Buffer sm3::sum(const std::filesystem::path& filePath)
 
     return buffer;
 }
+
+class Sm3HashPrivate
+{
+public:
+    sm3_context ctx;
+};
+
+Sm3Hash::Sm3Hash()
+    : m_ptr{ new Sm3HashPrivate }
+{
+    sm3_init(&m_ptr->ctx);
+}
+
+Sm3Hash::~Sm3Hash()
+{
+    delete m_ptr;
+}
+
+void Sm3Hash::update(const char* data, int len)
+{
+    sm3_update(&m_ptr->ctx, (const uint8_t*)data, len);
+}
+
+void Sm3Hash::update(const Buffer& data)
+{
+    update(data.data(), data.size());
+}
+
+Buffer Sm3Hash::finish()
+{
+    Buffer buffer{ size };
+    sm3_finish(&m_ptr->ctx, (uint8_t*)buffer.data());
+    sm3_init(&m_ptr->ctx);
+    return buffer;
+}
+
+void Sm3Hash::reset()
+{
+    sm3_init(&m_ptr->ctx);
+}
+
+Buffer sm3::hmac(const Buffer& key, const Buffer& data)
+{
+    Buffer buffer{ size };
+
+    sm3_context ctx;
+    sm3_hmac_starts(&ctx, (const uint8_t*)key.data(), key.size());
+    sm3_hmac_update(&ctx, (const uint8_t*)data.data(), data.size());
+    sm3_hmac_finish(&ctx, (uint8_t*)buffer.data());
+
+    return buffer;
+}
+
+Buffer sm3::kdf(const Buffer& z, int klen)
+{
+    if (klen <= 0) {
+        return Buffer{};
+    }
+
+    Buffer buffer{ (klen + size - 1) / size * size };
+    auto output = (uint8_t*)buffer.data();
+
+    // Z is shared by every block, absorb it only once
+    sm3_context prefix;
+    sm3_init(&prefix);
+    sm3_update(&prefix, (const uint8_t*)z.data(), z.size());
+
+    uint8_t counter[4];
+    for (uint32_t ct = 1; ct <= (uint32_t)(buffer.size() / size); ++ct) {
+        sm3_context ctx = prefix;
+        SM3_PUT_ULONG_BE(ct, counter, 0);
+        sm3_update(&ctx, counter, 4);
+        sm3_finish(&ctx, output);
+        output += size;
+    }
+
+    buffer.truncate(klen);
+    return buffer;
+}
+
+Buffer sm3::pbkdf2(const Buffer& password, const Buffer& salt, int iterations, int keyLen)
+{
+    if (iterations <= 0 || keyLen <= 0) {
+        return Buffer{};
+    }
+
+    sm3_context inner;
+    sm3_hmac_starts(&inner, (const uint8_t*)password.data(), password.size());
+
+    sm3_context outer;
+    sm3_init(&outer);
+    sm3_update(&outer, inner.opad, 64);
+
+    Buffer buffer{ (keyLen + size - 1) / size * size };
+    auto output = (uint8_t*)buffer.data();
+    auto saltData = (const uint8_t*)salt.data();
+    auto blocks = buffer.size() / size;
+
+    uint32_t index = 1;
+    for (; blocks - (int)index + 1 >= 4; index += 4) {
+        sm3_pbkdf2_lanes<4>(&inner, &outer, saltData, salt.size(), index, iterations, output);
+        output += 4 * size;
+    }
+    for (; (int)index <= blocks; ++index) {
+        sm3_pbkdf2_lanes<1>(&inner, &outer, saltData, salt.size(), index, iterations, output);
+        output += size;
+    }
+
+    memset(&inner, 0, sizeof(inner));
+    memset(&outer, 0, sizeof(outer));
+
+    buffer.truncate(keyLen);
+    return buffer;
+}
@@ -1,16 +1,45 @@
 #pragma once
 
+#include <filesystem>
+
 class Buffer;
+class Sm3HashPrivate;
 
-class sm4
+class sm3
 {
 public:
-    sm4() = delete;
-    ~sm4() = delete;
+    sm3() = delete;
+    ~sm3() = delete;
+
+    static Buffer encode(const Buffer& data);
+    static Buffer sum(const std::filesystem::path& filePath);
+
+    static Buffer hmac(const Buffer& key, const Buffer& data);
+
+    // GM/T 0003 key derivation function, klen in bytes
+    static Buffer kdf(const Buffer& z, int klen);
+
+    // PBKDF2 (RFC 8018) with HMAC-SM3 as the PRF, keyLen in bytes
+    static Buffer pbkdf2(const Buffer& password, const Buffer& salt, int iterations, int keyLen);
+};
+
+// Incremental SM3 for data that arrives in pieces. finish() returns the
+// 32-byte digest and resets the object for the next message.
+class Sm3Hash
+{
+public:
+    Sm3Hash();
+    ~Sm3Hash();
+
+    Sm3Hash(const Sm3Hash&) = delete;
+    Sm3Hash& operator=(const Sm3Hash&) = delete;
+
+    void update(const char* data, int len);
+    void update(const Buffer& data);
 
-    static bool encrypt(const char* data, int len, const Buffer& key, Buffer& output);
-    static bool encrypt(const Buffer& data, const Buffer& key, Buffer& output);
+    Buffer finish();
+    void reset();
 
-    static bool decrypt(const char* data, int len, const Buffer& key, Buffer& output);
-    static bool decrypt(const Buffer& data, const Buffer& key, Buffer& output);
+private:
+    Sm3HashPrivate* m_ptr;
 };
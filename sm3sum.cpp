@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sm3.h"
+#include "buffer.h"
+#include "file_engine.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// files below this size are grouped into one task, larger files get a task of their own
+constexpr uintmax_t small_file_size = 256 * 1024;
+constexpr uintmax_t batch_bytes = 4 * 1024 * 1024;
+constexpr size_t batch_files = 64;
+
+struct Entry
+{
+    Entry() = default;
+    Entry(const fs::path& path, uintmax_t size) : path{ path }, size{ size } {}
+
+    fs::path    path;
+    uintmax_t   size = 0;
+    std::string expected; // --check only
+    std::string digest;
+    bool        ok = false;
+    double      latency = 0.0; // seconds
+};
+
+// Each worker owns a deque: it pops its own tasks from the back and steals from
+// the front of the others once it runs dry.
+class WorkStealingPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(int threads)
+        : m_queues(threads > 0 ? threads : 1)
+    {
+    }
+
+    void submit(Task task)
+    {
+        auto& queue = m_queues[m_next++ % m_queues.size()];
+        std::lock_guard<std::mutex> lock{ queue.mutex };
+        queue.tasks.push_back(std::move(task));
+    }
+
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            threads.emplace_back([this, i] { work(i); });
+        }
+        work(0);
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex       mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(size_t self, Task& task)
+    {
+        auto& own = m_queues[self];
+        {
+            std::lock_guard<std::mutex> lock{ own.mutex };
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            auto& victim = m_queues[(self + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock{ victim.mutex };
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void work(size_t self)
+    {
+        // all tasks are queued before run(), so an empty sweep means we are done
+        Task task;
+        while (pop(self, task)) {
+            task();
+        }
+    }
+
+private:
+    std::vector<Queue> m_queues;
+    size_t             m_next = 0;
+};
+
+std::string toLower(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char ch) { return static_cast<char>(tolower(ch)); });
+    return str;
+}
+
+void hash(Entry& entry)
+{
+    auto start = Clock::now();
+    auto digest = sm3::sum(entry.path);
+    entry.latency = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (digest.isEmpty()) {
+        entry.ok = false;
+        return;
+    }
+
+    entry.digest = toLower(digest.toHex());
+    entry.ok = true;
+}
+
+void collect(const fs::path& path, std::vector<Entry>& entries)
+{
+    std::error_code ec;
+    if (fs::is_directory(path, ec)) {
+        auto options = fs::directory_options::skip_permission_denied;
+        for (fs::recursive_directory_iterator it{ path, options, ec }, end; it != end; it.increment(ec)) {
+            if (ec) {
+                fprintf(stderr, "sm3sum: %s: %s\n", path.string().c_str(), ec.message().c_str());
+                break;
+            }
+            if (it->is_regular_file(ec)) {
+                auto size = it->file_size(ec);
+                entries.push_back(Entry{ it->path(), ec ? 0 : size });
+            }
+        }
+        return;
+    }
+
+    auto size = fs::file_size(path, ec);
+    entries.push_back(Entry{ path, ec ? 0 : size });
+}
+
+bool parseCheckFile(const fs::path& path, std::vector<Entry>& entries)
+{
+    std::ifstream ifs{ path };
+    if (!ifs) {
+        fprintf(stderr, "sm3sum: %s: cannot open\n", path.string().c_str());
+        return false;
+    }
+
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(ifs, line)) {
+        ++lineNo;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+
+        // "<64 hex digits>  <path>", or " *<path>" for binary mode
+        if (line.size() < 67 || line[64] != ' ' || (line[65] != ' ' && line[65] != '*')) {
+            fprintf(stderr, "sm3sum: %s:%d: improperly formatted line\n", path.string().c_str(), lineNo);
+            continue;
+        }
+
+        Entry entry;
+        entry.expected = toLower(line.substr(0, 64));
+        entry.path = line.substr(66);
+
+        std::error_code ec;
+        auto size = fs::file_size(entry.path, ec);
+        entry.size = ec ? 0 : size;
+        entries.push_back(std::move(entry));
+    }
+
+    return true;
+}
+
+void schedule(WorkStealingPool& pool, std::vector<Entry>& entries)
+{
+    std::vector<Entry*> batch;
+    uintmax_t bytes = 0;
+
+    auto flush = [&] {
+        if (batch.empty()) {
+            return;
+        }
+        pool.submit([batch] {
+            for (auto entry : batch) {
+                hash(*entry);
+            }
+        });
+        batch.clear();
+        bytes = 0;
+    };
+
+    for (auto& entry : entries) {
+        if (entry.size >= small_file_size) {
+            pool.submit([&entry] { hash(entry); });
+            continue;
+        }
+
+        batch.push_back(&entry);
+        bytes += entry.size;
+        if (bytes >= batch_bytes || batch.size() >= batch_files) {
+            flush();
+        }
+    }
+    flush();
+}
+
+// All files through FileEngine: reads stay in flight across files and the
+// workers only hash. Latency is measured from submission to the result.
+void hashAsync(std::vector<Entry>& entries, int jobs)
+{
+    FileEngineOptions options;
+    options.workers = jobs;
+    FileEngine engine{ options };
+
+    for (auto& entry : entries) {
+        auto start = Clock::now();
+        FileJob job;
+        job.path = entry.path;
+        engine.submit(job, [&entry, start](FileResult&& result) {
+            entry.latency = std::chrono::duration<double>(Clock::now() - start).count();
+            entry.ok = result.ok;
+            if (result.ok) {
+                entry.size = result.size;
+                entry.digest = toLower(result.digest.toHex());
+            }
+        });
+    }
+    engine.wait();
+}
+
+void report(const std::vector<Entry>& entries, double elapsed)
+{
+    std::vector<double> latencies;
+    uintmax_t bytes = 0;
+
+    for (auto& entry : entries) {
+        if (entry.ok) {
+            latencies.push_back(entry.latency);
+            bytes += entry.size;
+        }
+    }
+
+    if (latencies.empty()) {
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[static_cast<size_t>(p * (latencies.size() - 1))] * 1e3;
+    };
+
+    double total = 0.0;
+    for (auto latency : latencies) {
+        total += latency;
+    }
+
+    fprintf(stderr, "sm3sum: %zu files, %.1f MiB in %.3f s, %.1f MiB/s\n",
+            latencies.size(), bytes / 1048576.0, elapsed, elapsed > 0 ? bytes / 1048576.0 / elapsed : 0.0);
+    fprintf(stderr, "sm3sum: latency ms min %.3f  mean %.3f  p50 %.3f  p99 %.3f  max %.3f\n",
+            latencies.front() * 1e3, total / latencies.size() * 1e3, percentile(0.50), percentile(0.99), latencies.back() * 1e3);
+}
+
+void usage()
+{
+    fprintf(stderr,
+            "Usage: sm3sum [OPTION]... [FILE|DIR]...\n"
+            "Print or check SM3 (256-bit) checksums, recursing into directories.\n"
+            "\n"
+            "  -c, --check       read checksums from the FILEs and check them\n"
+            "  -j, --jobs N      number of hashing threads (default: hardware concurrency)\n"
+            "      --async       read with io_uring (or reader threads), many files in flight\n"
+            "      --quiet       don't print OK for each successfully verified file\n"
+            "      --no-stats    don't report throughput and latency statistics\n"
+            "  -h, --help        display this help and exit\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    bool check = false;
+    bool quiet = false;
+    bool stats = true;
+    bool async = false;
+    int jobs = static_cast<int>(std::thread::hardware_concurrency());
+    std::vector<fs::path> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string{ argv[i] };
+        if (arg == "-c" || arg == "--check") {
+            check = true;
+        }
+        else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--quiet") {
+            quiet = true;
+        }
+        else if (arg == "--no-stats") {
+            stats = false;
+        }
+        else if (arg == "--async") {
+            async = true;
+        }
+        else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        }
+        else if (arg.size() > 1 && arg[0] == '-') {
+            usage();
+            return 1;
+        }
+        else {
+            paths.emplace_back(arg);
+        }
+    }
+
+    if (paths.empty()) {
+        usage();
+        return 1;
+    }
+
+    std::vector<Entry> entries;
+    for (auto& path : paths) {
+        if (check) {
+            parseCheckFile(path, entries);
+        }
+        else {
+            collect(path, entries);
+        }
+    }
+
+    auto start = Clock::now();
+
+    if (async) {
+        hashAsync(entries, jobs);
+    }
+    else {
+        WorkStealingPool pool{ jobs };
+        schedule(pool, entries);
+        pool.run();
+    }
+
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    int failed = 0;
+    int unreadable = 0;
+    for (auto& entry : entries) {
+        auto name = entry.path.string();
+        if (!entry.ok) {
+            ++unreadable;
+            fprintf(stderr, "sm3sum: %s: No such file or unreadable\n", name.c_str());
+            if (check) {
+                printf("%s: FAILED open or read\n", name.c_str());
+            }
+            continue;
+        }
+
+        if (!check) {
+            printf("%s  %s\n", entry.digest.c_str(), name.c_str());
+        }
+        else if (entry.digest == entry.expected) {
+            if (!quiet) {
+                printf("%s: OK\n", name.c_str());
+            }
+        }
+        else {
+            ++failed;
+            printf("%s: FAILED\n", name.c_str());
+        }
+    }
+
+    if (check && unreadable > 0) {
+        fprintf(stderr, "sm3sum: WARNING: %d listed file%s could not be read\n", unreadable, unreadable == 1 ? "" : "s");
+    }
+    if (check && failed > 0) {
+        fprintf(stderr, "sm3sum: WARNING: %d computed checksum%s did NOT match\n", failed, failed == 1 ? "" : "s");
+    }
+
+    if (stats) {
+        report(entries, elapsed);
+    }
+
+    return (failed > 0 || unreadable > 0) ? 1 : 0;
+}
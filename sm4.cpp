@@ -1,24 +1,34 @@
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
 #include "sm4.h"
+#include "sm4_p.h"
+#include "cpu_p.h"
 #include "sm3.h"
 #include "buffer.h"
 
 namespace
 {
 
-struct sm4_context
-{
-    int           mode;   //crypted mode
-    unsigned long sk[32]; //sub keys
-};
-
 // 32-bit integer manipulation macros (big endian)
-#define GET_ULONG_BE(n, b, i) {                   \
-(n) = ((unsigned long)(b)[(i)    ] << 24 )    \
-      | ((unsigned long)(b)[(i) + 1] << 16 )    \
-      | ((unsigned long)(b)[(i) + 2] <<  8 )    \
-      | ((unsigned long)(b)[(i) + 3]       );   \
+#define GET_ULONG_BE(n, b, i) {              \
+(n) = ((uint32_t)(b)[(i)    ] << 24 )    \
+      | ((uint32_t)(b)[(i) + 1] << 16 )    \
+      | ((uint32_t)(b)[(i) + 2] <<  8 )    \
+      | ((uint32_t)(b)[(i) + 3]       );   \
 }
 
 #define PUT_ULONG_BE(n, b, i) {                   \
@@ -28,61 +38,77 @@ struct sm4_context
     (b)[(i) + 3] = (unsigned char)( (n)       );  \
 }
 
+#define PUT_ULONG_LE(n, b, i) {                   \
+    (b)[(i)    ] = (unsigned char)( (n)       );  \
+    (b)[(i) + 1] = (unsigned char)( (n) >>  8 );  \
+    (b)[(i) + 2] = (unsigned char)( (n) >> 16 );  \
+    (b)[(i) + 3] = (unsigned char)( (n) >> 24 );  \
+}
+
 // rotate shift left marco definition
 #define SHL(x, n) (((x) & 0xFFFFFFFF) << n)
 #define ROTL(x, n) (SHL((x),n) | ((x) >> (32 - n)))
 
-#define SWAP(a, b) { unsigned long t = a; a = b; b = t; t = 0; }
+constexpr unsigned char sm4_sbox_table[256] = {
+    0xd6, 0x90, 0xe9, 0xfe, 0xcc, 0xe1, 0x3d, 0xb7, 0x16, 0xb6, 0x14, 0xc2, 0x28, 0xfb, 0x2c, 0x05,
+    0x2b, 0x67, 0x9a, 0x76, 0x2a, 0xbe, 0x04, 0xc3, 0xaa, 0x44, 0x13, 0x26, 0x49, 0x86, 0x06, 0x99,
+    0x9c, 0x42, 0x50, 0xf4, 0x91, 0xef, 0x98, 0x7a, 0x33, 0x54, 0x0b, 0x43, 0xed, 0xcf, 0xac, 0x62,
+    0xe4, 0xb3, 0x1c, 0xa9, 0xc9, 0x08, 0xe8, 0x95, 0x80, 0xdf, 0x94, 0xfa, 0x75, 0x8f, 0x3f, 0xa6,
+    0x47, 0x07, 0xa7, 0xfc, 0xf3, 0x73, 0x17, 0xba, 0x83, 0x59, 0x3c, 0x19, 0xe6, 0x85, 0x4f, 0xa8,
+    0x68, 0x6b, 0x81, 0xb2, 0x71, 0x64, 0xda, 0x8b, 0xf8, 0xeb, 0x0f, 0x4b, 0x70, 0x56, 0x9d, 0x35,
+    0x1e, 0x24, 0x0e, 0x5e, 0x63, 0x58, 0xd1, 0xa2, 0x25, 0x22, 0x7c, 0x3b, 0x01, 0x21, 0x78, 0x87,
+    0xd4, 0x00, 0x46, 0x57, 0x9f, 0xd3, 0x27, 0x52, 0x4c, 0x36, 0x02, 0xe7, 0xa0, 0xc4, 0xc8, 0x9e,
+    0xea, 0xbf, 0x8a, 0xd2, 0x40, 0xc7, 0x38, 0xb5, 0xa3, 0xf7, 0xf2, 0xce, 0xf9, 0x61, 0x15, 0xa1,
+    0xe0, 0xae, 0x5d, 0xa4, 0x9b, 0x34, 0x1a, 0x55, 0xad, 0x93, 0x32, 0x30, 0xf5, 0x8c, 0xb1, 0xe3,
+    0x1d, 0xf6, 0xe2, 0x2e, 0x82, 0x66, 0xca, 0x60, 0xc0, 0x29, 0x23, 0xab, 0x0d, 0x53, 0x4e, 0x6f,
+    0xd5, 0xdb, 0x37, 0x45, 0xde, 0xfd, 0x8e, 0x2f, 0x03, 0xff, 0x6a, 0x72, 0x6d, 0x6c, 0x5b, 0x51,
+    0x8d, 0x1b, 0xaf, 0x92, 0xbb, 0xdd, 0xbc, 0x7f, 0x11, 0xd9, 0x5c, 0x41, 0x1f, 0x10, 0x5a, 0xd8,
+    0x0a, 0xc1, 0x31, 0x88, 0xa5, 0xcd, 0x7b, 0xbd, 0x2d, 0x74, 0xd0, 0x12, 0xb8, 0xe5, 0xb4, 0xb0,
+    0x89, 0x69, 0x97, 0x4a, 0x0c, 0x96, 0x77, 0x7e, 0x65, 0xb9, 0xf1, 0x09, 0xc5, 0x6e, 0xc6, 0x84,
+    0x18, 0xf0, 0x7d, 0xec, 0x3a, 0xdc, 0x4d, 0x20, 0x79, 0xee, 0x5f, 0x3e, 0xd7, 0xcb, 0x39, 0x48
+};
 
-static unsigned char sm4_sbox(unsigned char inch)
+// Round function tables: sm4_t[i][x] = L(S(x) << (24 - 8 * i)), so that
+// T(a) = sm4_t[0][a0] ^ sm4_t[1][a1] ^ sm4_t[2][a2] ^ sm4_t[3][a3].
+struct sm4_tables
 {
-    static const unsigned char sbox[16][16] = {
-        {0xd6, 0x90, 0xe9, 0xfe, 0xcc, 0xe1, 0x3d, 0xb7, 0x16, 0xb6, 0x14, 0xc2, 0x28, 0xfb, 0x2c, 0x05},
-        {0x2b, 0x67, 0x9a, 0x76, 0x2a, 0xbe, 0x04, 0xc3, 0xaa, 0x44, 0x13, 0x26, 0x49, 0x86, 0x06, 0x99},
-        {0x9c, 0x42, 0x50, 0xf4, 0x91, 0xef, 0x98, 0x7a, 0x33, 0x54, 0x0b, 0x43, 0xed, 0xcf, 0xac, 0x62},
-        {0xe4, 0xb3, 0x1c, 0xa9, 0xc9, 0x08, 0xe8, 0x95, 0x80, 0xdf, 0x94, 0xfa, 0x75, 0x8f, 0x3f, 0xa6},
-        {0x47, 0x07, 0xa7, 0xfc, 0xf3, 0x73, 0x17, 0xba, 0x83, 0x59, 0x3c, 0x19, 0xe6, 0x85, 0x4f, 0xa8},
-        {0x68, 0x6b, 0x81, 0xb2, 0x71, 0x64, 0xda, 0x8b, 0xf8, 0xeb, 0x0f, 0x4b, 0x70, 0x56, 0x9d, 0x35},
-        {0x1e, 0x24, 0x0e, 0x5e, 0x63, 0x58, 0xd1, 0xa2, 0x25, 0x22, 0x7c, 0x3b, 0x01, 0x21, 0x78, 0x87},
-        {0xd4, 0x00, 0x46, 0x57, 0x9f, 0xd3, 0x27, 0x52, 0x4c, 0x36, 0x02, 0xe7, 0xa0, 0xc4, 0xc8, 0x9e},
-        {0xea, 0xbf, 0x8a, 0xd2, 0x40, 0xc7, 0x38, 0xb5, 0xa3, 0xf7, 0xf2, 0xce, 0xf9, 0x61, 0x15, 0xa1},
-        {0xe0, 0xae, 0x5d, 0xa4, 0x9b, 0x34, 0x1a, 0x55, 0xad, 0x93, 0x32, 0x30, 0xf5, 0x8c, 0xb1, 0xe3},
-        {0x1d, 0xf6, 0xe2, 0x2e, 0x82, 0x66, 0xca, 0x60, 0xc0, 0x29, 0x23, 0xab, 0x0d, 0x53, 0x4e, 0x6f},
-        {0xd5, 0xdb, 0x37, 0x45, 0xde, 0xfd, 0x8e, 0x2f, 0x03, 0xff, 0x6a, 0x72, 0x6d, 0x6c, 0x5b, 0x51},
-        {0x8d, 0x1b, 0xaf, 0x92, 0xbb, 0xdd, 0xbc, 0x7f, 0x11, 0xd9, 0x5c, 0x41, 0x1f, 0x10, 0x5a, 0xd8},
-        {0x0a, 0xc1, 0x31, 0x88, 0xa5, 0xcd, 0x7b, 0xbd, 0x2d, 0x74, 0xd0, 0x12, 0xb8, 0xe5, 0xb4, 0xb0},
-        {0x89, 0x69, 0x97, 0x4a, 0x0c, 0x96, 0x77, 0x7e, 0x65, 0xb9, 0xf1, 0x09, 0xc5, 0x6e, 0xc6, 0x84},
-        {0x18, 0xf0, 0x7d, 0xec, 0x3a, 0xdc, 0x4d, 0x20, 0x79, 0xee, 0x5f, 0x3e, 0xd7, 0xcb, 0x39, 0x48}
-    };
+    uint32_t t[4][256];
+};
 
-    auto table = (unsigned char*)sbox;
-    return (unsigned char)(table[inch]);
+constexpr uint32_t sm4_l(uint32_t b)
+{
+    return (b ^ (ROTL(b, 2)) ^ (ROTL(b, 10)) ^ (ROTL(b, 18)) ^ (ROTL(b, 24)));
 }
 
-static unsigned long sm4_lt(unsigned long ka)
+constexpr sm4_tables sm4_make_tables()
 {
-    unsigned long bb = 0;
-    unsigned char a[4];
-    unsigned char b[4];
+    sm4_tables tables{};
+    for (int i = 0; i < 4; ++i) {
+        for (int x = 0; x < 256; ++x) {
+            tables.t[i][x] = sm4_l((uint32_t)sm4_sbox_table[x] << (24 - 8 * i));
+        }
+    }
+    return tables;
+}
 
-    PUT_ULONG_BE(ka, a, 0)
-    b[0] = sm4_sbox(a[0]);
-    b[1] = sm4_sbox(a[1]);
-    b[2] = sm4_sbox(a[2]);
-    b[3] = sm4_sbox(a[3]);
-    GET_ULONG_BE(bb, b, 0)
+constexpr sm4_tables sm4_t = sm4_make_tables();
 
-    return (bb ^ (ROTL(bb, 2)) ^ (ROTL(bb, 10)) ^ (ROTL(bb, 18)) ^ (ROTL(bb, 24)));
+static unsigned char sm4_sbox(unsigned char inch)
+{
+    return sm4_sbox_table[inch];
 }
 
-inline unsigned long sm4_f(unsigned long x0, unsigned long x1, unsigned long x2, unsigned long x3, unsigned long rk)
+static inline uint32_t sm4_lt(uint32_t ka)
 {
-    return (x0 ^ sm4_lt(x1 ^ x2 ^ x3 ^ rk));
+    return sm4_t.t[0][ka >> 24]
+           ^ sm4_t.t[1][(ka >> 16) & 0xFF]
+           ^ sm4_t.t[2][(ka >> 8) & 0xFF]
+           ^ sm4_t.t[3][ka & 0xFF];
 }
 
-static unsigned long sm4_rk(unsigned long ka)
+static uint32_t sm4_rk(uint32_t ka)
 {
-    unsigned long bb = 0;
+    uint32_t bb = 0;
     unsigned char a[4];
     unsigned char b[4];
 
@@ -96,35 +122,150 @@ static unsigned long sm4_rk(unsigned long ka)
     return (bb ^ (ROTL(bb, 13)) ^ (ROTL(bb, 23)));
 }
 
-static void sm4_one_round(unsigned long sk[32], const unsigned char input[16], unsigned char output[16])
+// four rounds, the state words stay in registers
+#define SM4_ROUNDS(k)                                     \
+{                                                         \
+    x0 ^= sm4_lt(x1 ^ x2 ^ x3 ^ sk[(k)    ]);             \
+    x1 ^= sm4_lt(x2 ^ x3 ^ x0 ^ sk[(k) + 1]);             \
+    x2 ^= sm4_lt(x3 ^ x0 ^ x1 ^ sk[(k) + 2]);             \
+    x3 ^= sm4_lt(x0 ^ x1 ^ x2 ^ sk[(k) + 3]);             \
+}
+
+static void sm4_one_round(const uint32_t sk[32], const unsigned char input[16], unsigned char output[16])
+{
+    uint32_t x0, x1, x2, x3;
+
+    GET_ULONG_BE(x0, input, 0)
+    GET_ULONG_BE(x1, input, 4)
+    GET_ULONG_BE(x2, input, 8)
+    GET_ULONG_BE(x3, input, 12)
+
+    SM4_ROUNDS(0)
+    SM4_ROUNDS(4)
+    SM4_ROUNDS(8)
+    SM4_ROUNDS(12)
+    SM4_ROUNDS(16)
+    SM4_ROUNDS(20)
+    SM4_ROUNDS(24)
+    SM4_ROUNDS(28)
+
+    PUT_ULONG_BE(x3, output, 0);
+    PUT_ULONG_BE(x2, output, 4);
+    PUT_ULONG_BE(x1, output, 8);
+    PUT_ULONG_BE(x0, output, 12);
+}
+
+// four blocks interleaved, their rounds are independent and overlap in the pipeline
+static void sm4_crypt_x4(const uint32_t sk[32], const unsigned char input[64], unsigned char output[64])
+{
+    uint32_t x0[4], x1[4], x2[4], x3[4];
+    int i, j;
+
+    for (j = 0; j < 4; ++j) {
+        GET_ULONG_BE(x0[j], input, j * 16)
+        GET_ULONG_BE(x1[j], input, j * 16 + 4)
+        GET_ULONG_BE(x2[j], input, j * 16 + 8)
+        GET_ULONG_BE(x3[j], input, j * 16 + 12)
+    }
+
+    for (i = 0; i < 32; i += 4) {
+        for (j = 0; j < 4; ++j) {
+            x0[j] ^= sm4_lt(x1[j] ^ x2[j] ^ x3[j] ^ sk[i]);
+        }
+        for (j = 0; j < 4; ++j) {
+            x1[j] ^= sm4_lt(x2[j] ^ x3[j] ^ x0[j] ^ sk[i + 1]);
+        }
+        for (j = 0; j < 4; ++j) {
+            x2[j] ^= sm4_lt(x3[j] ^ x0[j] ^ x1[j] ^ sk[i + 2]);
+        }
+        for (j = 0; j < 4; ++j) {
+            x3[j] ^= sm4_lt(x0[j] ^ x1[j] ^ x2[j] ^ sk[i + 3]);
+        }
+    }
+
+    for (j = 0; j < 4; ++j) {
+        PUT_ULONG_BE(x3[j], output, j * 16);
+        PUT_ULONG_BE(x2[j], output, j * 16 + 4);
+        PUT_ULONG_BE(x1[j], output, j * 16 + 8);
+        PUT_ULONG_BE(x0[j], output, j * 16 + 12);
+    }
+}
+
+static void sm4_crypt_blocks_scalar(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
 {
-    unsigned long i = 0;
-    unsigned long ulbuf[36];
+    for (; blocks >= 4; blocks -= 4) {
+        sm4_crypt_x4(sk, input, output);
+        input += 64;
+        output += 64;
+    }
+
+    for (; blocks > 0; --blocks) {
+        sm4_one_round(sk, input, output);
+        input += 16;
+        output += 16;
+    }
+}
 
-    memset(ulbuf, 0, sizeof(ulbuf));
+// Below this many blocks the bitsliced kernels spend most of their time on
+// padding, so the bs backends use the table kernel instead: short calls are
+// not constant time.
+constexpr int sm4_bs_min_blocks = 32;
 
-    GET_ULONG_BE(ulbuf[0], input, 0)
-    GET_ULONG_BE(ulbuf[1], input, 4)
-    GET_ULONG_BE(ulbuf[2], input, 8)
-    GET_ULONG_BE(ulbuf[3], input, 12)
+static void sm4_crypt_blocks_bs(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    if (blocks < sm4_bs_min_blocks) {
+        sm4_crypt_blocks_scalar(sk, input, output, blocks);
+        return;
+    }
+    sm4_crypt_blocks_bs64(sk, input, output, blocks);
+}
 
-    while (i < 32) {
-        ulbuf[i + 4] = sm4_f(ulbuf[i], ulbuf[i + 1], ulbuf[i + 2], ulbuf[i + 3], sk[i]);
-        ++i;
+#ifdef SM4_HAVE_X86
+static void sm4_crypt_blocks_bs_wide(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    if (blocks < sm4_bs_min_blocks) {
+        sm4_crypt_blocks_scalar(sk, input, output, blocks);
+        return;
     }
+    sm4_crypt_blocks_bs_avx2(sk, input, output, blocks);
+}
+#endif
+
+// Which paths avoid the S-box table (secret dependent memory accesses):
+// - the GFNI and AES-NI/VAES kernels, for any block count (partial batches
+//   are padded or masked);
+// - the bitsliced kernels, only from sm4_bs_min_blocks blocks up; shorter
+//   calls go to the table;
+// - the scalar kernel never.
+// Whatever the kernel, CBC encryption (Sm4Key::encrypt, Sm4Encryptor) and the
+// partial head and tail blocks of Sm4Ctr::crypt always use sm4_one_round and
+// so the table. CBC decryption, full CTR blocks, XTS, GCM and the batch calls
+// go through the selected kernel.
+static const cpu_kernel<sm4_blocks_func> sm4_kernels[] = {
+#ifdef SM4_HAVE_X86
+    { "gfni-avx512", CPU_GFNI | CPU_AVX512F | CPU_AVX512BW, sm4_crypt_blocks_gfni_avx512 },
+    { "vaes-avx512", CPU_VAES | CPU_AVX512F | CPU_AVX512BW, sm4_crypt_blocks_vaes_avx512 },
+    { "vaes-avx2", CPU_VAES | CPU_AVX2, sm4_crypt_blocks_vaes_avx2 },
+    { "aesni", CPU_AES | CPU_SSSE3, sm4_crypt_blocks_aesni },
+    { "bs-avx2", CPU_AVX2, sm4_crypt_blocks_bs_wide },
+#endif
+    { "bs64", 0, sm4_crypt_blocks_bs },
+    { "scalar", 0, sm4_crypt_blocks_scalar },
+};
 
-    PUT_ULONG_BE(ulbuf[35], output, 0);
-    PUT_ULONG_BE(ulbuf[34], output, 4);
-    PUT_ULONG_BE(ulbuf[33], output, 8);
-    PUT_ULONG_BE(ulbuf[32], output, 12);
+// independent blocks through the best kernel this CPU supports
+static void sm4_crypt_blocks(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    static const sm4_blocks_func func = cpu_select("sm4", sm4_kernels);
+    func(sk, input, output, blocks);
 }
 
-static void sm4_setkey(unsigned long SK[32], unsigned char key[16])
+static void sm4_setkey(uint32_t SK[32], const unsigned char key[16])
 {
-    static const unsigned long fk[4] = {
+    static const uint32_t fk[4] = {
         0xa3b1bac6, 0x56aa3350, 0x677d9197, 0xb27022dc
     };
-    static const unsigned long ck[32] = {
+    static const uint32_t ck[32] = {
         0x00070e15, 0x1c232a31, 0x383f464d, 0x545b6269,
         0x70777e85, 0x8c939aa1, 0xa8afb6bd, 0xc4cbd2d9,
         0xe0e7eef5, 0xfc030a11, 0x181f262d, 0x343b4249,
@@ -135,9 +276,9 @@ static void sm4_setkey(unsigned long SK[32], unsigned char key[16])
         0x10171e25, 0x2c333a41, 0x484f565d, 0x646b7279
     };
 
-    unsigned long i = 0;
-    unsigned long MK[4];
-    unsigned long k[36];
+    int i = 0;
+    uint32_t MK[4];
+    uint32_t k[36];
 
     GET_ULONG_BE(MK[0], key, 0);
     GET_ULONG_BE(MK[1], key, 4);
@@ -155,28 +296,232 @@ static void sm4_setkey(unsigned long SK[32], unsigned char key[16])
     }
 }
 
-static void sm4_setkey_enc(sm4_context* ctx, unsigned char key[16])
+// decryption uses the encryption subkeys in reverse order
+static void sm4_setkey_dec(uint32_t dk[32], const uint32_t ek[32])
 {
-    ctx->mode = 1;
-    sm4_setkey(ctx->sk, key);
+    int i;
+
+    for (i = 0; i < 32; ++i) {
+        dk[i] = ek[31 - i];
+    }
 }
 
-static void sm4_setkey_dec(sm4_context* ctx, unsigned char key[16])
+// inputs below this size per thread are not worth splitting
+constexpr int sm4_parallel_min_bytes = 256 * 1024;
+
+// Helper threads for the large CBC decryption, CTR and XTS calls, shared by
+// every caller. They are started on first use, never more than the thread
+// limit minus one (the caller is the other one), and wait for work between
+// calls. A caller queues its parts and takes them too, so it finishes even
+// when the helpers are busy with other calls or none could be started.
+class Sm4ThreadPool
 {
-    int i;
+public:
+    static Sm4ThreadPool& instance()
+    {
+        static Sm4ThreadPool pool;
+        return pool;
+    }
 
-    ctx->mode = 1;
-    sm4_setkey(ctx->sk, key);
+    ~Sm4ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_stop = true;
+        }
+        m_ready.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
 
-    for (i = 0; i < 16; ++i) {
-        SWAP(ctx->sk[i], ctx->sk[31 - i]);
+    int limit() const
+    {
+        return m_limit.load(std::memory_order_relaxed);
+    }
+
+    void setLimit(int threads)
+    {
+        m_limit.store(threads > 0 ? threads : defaultLimit(), std::memory_order_relaxed);
+    }
+
+    // func(0) .. func(count - 1), on the caller's thread and the helpers
+    void run(int count, const std::function<void(int)>& func)
+    {
+        Job job{ &func, count };
+
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        start(std::min(count, limit()) - 1);
+        m_jobs.push_back(&job);
+        m_ready.notify_all();
+
+        while (job.next < count) {
+            work(lock, &job);
+        }
+        m_finished.wait(lock, [&] { return job.done == count; });
+    }
+
+private:
+    struct Job
+    {
+        const std::function<void(int)>* func;
+        int                             count;
+        int                             next = 0;
+        int                             done = 0;
+    };
+
+    Sm4ThreadPool()
+        : m_limit{ defaultLimit() }
+    {
+    }
+
+    // one per core, or BUFFER_SM4_THREADS (1 turns threading off)
+    static int defaultLimit()
+    {
+        if (auto env = getenv("BUFFER_SM4_THREADS")) {
+            int threads = atoi(env);
+            if (threads > 0) {
+                return threads;
+            }
+        }
+        return (int)std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // called with the mutex held; if a thread cannot be created the calls
+    // make do with the helpers there are
+    void start(int helpers)
+    {
+        while ((int)m_threads.size() < helpers && !m_failed) {
+            try {
+                m_threads.emplace_back([this] { helper(); });
+            }
+            catch (const std::system_error&) {
+                m_failed = true;
+            }
+        }
+    }
+
+    // takes the next part of job and runs it without the lock
+    void work(std::unique_lock<std::mutex>& lock, Job* job)
+    {
+        int part = job->next++;
+        if (job->next == job->count) {
+            m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), job));
+        }
+
+        lock.unlock();
+        (*job->func)(part);
+        lock.lock();
+
+        if (++job->done == job->count) {
+            m_finished.notify_all();
+        }
+    }
+
+    void helper()
+    {
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        for (;;) {
+            m_ready.wait(lock, [this] { return !m_jobs.empty() || m_stop; });
+            if (m_stop) {
+                return;
+            }
+            work(lock, m_jobs.front());
+        }
+    }
+
+private:
+    std::atomic<int>         m_limit;
+    std::mutex               m_mutex;
+    std::condition_variable  m_ready;
+    std::condition_variable  m_finished;
+    std::deque<Job*>         m_jobs;
+    std::vector<std::thread> m_threads;
+    bool                     m_failed = false;
+    bool                     m_stop = false;
+};
+
+static int sm4_parallel_threads(int64_t bytes)
+{
+    // keep the pool (and its getenv) off the small message path
+    if (bytes < 2 * sm4_parallel_min_bytes) {
+        return 1;
     }
+
+    int64_t threads = Sm4ThreadPool::instance().limit();
+    return (int)std::max<int64_t>(1, std::min(threads, bytes / sm4_parallel_min_bytes));
 }
 
-static void sm4_crypt_cbc(sm4_context* ctx, int mode, int length, unsigned char iv[16], const unsigned char* input, unsigned char* output)
+// Runs func(0) .. func(count - 1) in parallel; returns once all are done.
+template<typename Func>
+static void sm4_parallel(int count, Func func)
 {
-    int i;
+    Sm4ThreadPool::instance().run(count, func);
+}
+
+// Serial CBC decryption. Every plaintext block only depends on two ciphertext
+// blocks, so the block cipher runs on up to 16 blocks at once. Output may
+// alias input.
+static void sm4_cbc_decrypt_blocks(const uint32_t sk[32], unsigned char iv[16], const unsigned char* input, unsigned char* output, int blocks)
+{
+    unsigned char buffer[16 * 16];
     unsigned char temp[16];
+    int b, i, n;
+
+    while (blocks > 0) {
+        n = std::min(blocks, 16);
+
+        sm4_crypt_blocks(sk, input, buffer, n);
+        memcpy(temp, input + (n - 1) * 16, 16);
+
+        // backwards, so no ciphertext block is overwritten before it is used
+        for (b = n - 1; b > 0; --b) {
+            for (i = 0; i < 16; ++i) {
+                output[b * 16 + i] = (unsigned char)(buffer[b * 16 + i] ^ input[(b - 1) * 16 + i]);
+            }
+        }
+        for (i = 0; i < 16; ++i) {
+            output[i] = (unsigned char)(buffer[i] ^ iv[i]);
+        }
+
+        memcpy(iv, temp, 16);
+
+        input += n * 16;
+        output += n * 16;
+        blocks -= n;
+    }
+}
+
+// Large inputs are cut into one segment per thread. The chaining value of a
+// segment is the ciphertext block in front of it, saved before any thread
+// can overwrite it.
+static void sm4_cbc_decrypt(const uint32_t sk[32], unsigned char iv[16], const unsigned char* input, unsigned char* output, int blocks)
+{
+    int threads = sm4_parallel_threads((int64_t)blocks * 16);
+    if (threads <= 1) {
+        sm4_cbc_decrypt_blocks(sk, iv, input, output, blocks);
+        return;
+    }
+
+    std::vector<unsigned char> ivs(threads * 16);
+    memcpy(ivs.data(), iv, 16);
+
+    int per = blocks / threads;
+    for (int t = 1; t < threads; ++t) {
+        memcpy(ivs.data() + t * 16, input + ((int64_t)t * per - 1) * 16, 16);
+    }
+    memcpy(iv, input + ((int64_t)blocks - 1) * 16, 16);
+
+    sm4_parallel(threads, [&](int t) {
+        int first = t * per;
+        int count = (t == threads - 1) ? blocks - first : per;
+        sm4_cbc_decrypt_blocks(sk, ivs.data() + t * 16, input + (int64_t)first * 16, output + (int64_t)first * 16, count);
+    });
+}
+
+static void sm4_crypt_cbc(const uint32_t sk[32], int mode, int length, unsigned char iv[16], const unsigned char* input, unsigned char* output)
+{
+    int i;
 
     if (mode == 1) {
         while (length > 0) {
@@ -184,7 +529,7 @@ static void sm4_crypt_cbc(sm4_context* ctx, int mode, int length, unsigned char
                 output[i] = (unsigned char)(input[i] ^ iv[i]);
             }
 
-            sm4_one_round(ctx->sk, output, output);
+            sm4_one_round(sk, output, output);
             memcpy(iv, output, 16);
 
             input += 16;
@@ -193,98 +538,1061 @@ static void sm4_crypt_cbc(sm4_context* ctx, int mode, int length, unsigned char
         }
     }
     else {
-        while (length > 0) {
-            memcpy(temp, input, 16);
-            sm4_one_round(ctx->sk, input, output);
+        sm4_cbc_decrypt(sk, iv, input, output, length / 16);
+    }
+}
 
-            for (i = 0; i < 16; ++i) {
-                output[i] = (unsigned char)(output[i] ^ iv[i]);
-            }
+// counter block for block number n: iv + n as a big endian 128-bit integer
+static void sm4_ctr_block(const unsigned char iv[16], uint64_t n, unsigned char output[16])
+{
+    uint32_t w[4];
+    uint64_t lo, hi;
 
-            memcpy(iv, temp, 16);
+    GET_ULONG_BE(w[0], iv, 0)
+    GET_ULONG_BE(w[1], iv, 4)
+    GET_ULONG_BE(w[2], iv, 8)
+    GET_ULONG_BE(w[3], iv, 12)
 
-            input += 16;
-            output += 16;
-            length -= 16;
+    hi = ((uint64_t)w[0] << 32) | w[1];
+    lo = ((uint64_t)w[2] << 32) | w[3];
+
+    lo += n;
+    if (lo < n) {
+        ++hi;
+    }
+
+    PUT_ULONG_BE((uint32_t)(hi >> 32), output, 0);
+    PUT_ULONG_BE((uint32_t)hi, output, 4);
+    PUT_ULONG_BE((uint32_t)(lo >> 32), output, 8);
+    PUT_ULONG_BE((uint32_t)lo, output, 12);
+}
+
+// Whole blocks starting at block number index. The counter blocks of a chunk
+// are built first and encrypted in one multi-block call, so they fill the
+// SIMD lanes (or bitsliced batch) of the kernel.
+static void sm4_ctr_blocks(const uint32_t sk[32], const unsigned char iv[16], uint64_t index, const unsigned char* input, unsigned char* output, int64_t blocks)
+{
+    unsigned char stream[256 * 16];
+    int b, i, n;
+
+    while (blocks > 0) {
+        n = (int)std::min<int64_t>(blocks, 256);
+
+        for (b = 0; b < n; ++b) {
+            sm4_ctr_block(iv, index + b, stream + b * 16);
+        }
+        sm4_crypt_blocks(sk, stream, stream, n);
+
+        for (i = 0; i < n * 16; ++i) {
+            output[i] = (unsigned char)(input[i] ^ stream[i]);
         }
+
+        index += n;
+        input += n * 16;
+        output += n * 16;
+        blocks -= n;
     }
+
+    memset(stream, 0, sizeof(stream));
 }
 
-constexpr unsigned char sm4_iv[16] = {
-    0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38,
-    0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38
+// Counter blocks are independent, so large inputs are split between threads.
+static void sm4_ctr_crypt(const uint32_t sk[32], const unsigned char iv[16], uint64_t index, const unsigned char* input, unsigned char* output, int64_t blocks)
+{
+    int threads = sm4_parallel_threads(blocks * 16);
+    if (threads <= 1) {
+        sm4_ctr_blocks(sk, iv, index, input, output, blocks);
+        return;
+    }
+
+    int64_t per = blocks / threads;
+    sm4_parallel(threads, [&](int t) {
+        int64_t first = t * per;
+        int64_t count = (t == threads - 1) ? blocks - first : per;
+        sm4_ctr_blocks(sk, iv, index + first, input + first * 16, output + first * 16, count);
+    });
+}
+
+// XTS tweak as a 128-bit integer. IEEE 1619 reads the 16 bytes as a little
+// endian polynomial and doubles it with a left shift; GB/T 17964 uses GCM's
+// bit order, so the shift goes right with 0xE1 feedback into the top byte.
+struct sm4_xts_tweak
+{
+    uint64_t lo;
+    uint64_t hi;
 };
 
-constexpr int key_len = 16;
-constexpr int iv_len = 16;
-constexpr int padding_len = 16;
+static sm4_xts_tweak sm4_xts_load(const unsigned char t[16], bool gb)
+{
+    sm4_xts_tweak x{ 0, 0 };
+    int i;
 
+    if (gb) {
+        for (i = 0; i < 8; ++i) {
+            x.hi = (x.hi << 8) | t[i];
+            x.lo = (x.lo << 8) | t[i + 8];
+        }
+    }
+    else {
+        for (i = 7; i >= 0; --i) {
+            x.lo = (x.lo << 8) | t[i];
+            x.hi = (x.hi << 8) | t[i + 8];
+        }
+    }
+    return x;
 }
 
-bool sm4::encrypt(const char* data, int len, const Buffer& key, Buffer& output)
+static void sm4_xts_store(const sm4_xts_tweak& x, bool gb, unsigned char t[16])
 {
-    if (!data || key.isEmpty()) {
-        return false;
+    if (gb) {
+        PUT_ULONG_BE((uint32_t)(x.hi >> 32), t, 0)
+        PUT_ULONG_BE((uint32_t)x.hi, t, 4)
+        PUT_ULONG_BE((uint32_t)(x.lo >> 32), t, 8)
+        PUT_ULONG_BE((uint32_t)x.lo, t, 12)
     }
+    else {
+        PUT_ULONG_LE((uint32_t)x.lo, t, 0)
+        PUT_ULONG_LE((uint32_t)(x.lo >> 32), t, 4)
+        PUT_ULONG_LE((uint32_t)x.hi, t, 8)
+        PUT_ULONG_LE((uint32_t)(x.hi >> 32), t, 12)
+    }
+}
 
-    unsigned char k[key_len] = { 0 };
-    memcpy(k, key.data(), key.size());
+// T = T * alpha, without branches on the tweak bits
+static void sm4_xts_next(sm4_xts_tweak& x, bool gb)
+{
+    uint64_t carry;
 
-    unsigned char iv[iv_len] = { 0 };
-    memcpy(iv, sm4_iv, iv_len);
+    if (gb) {
+        carry = 0 - (x.lo & 1);
+        x.lo = (x.lo >> 1) | (x.hi << 63);
+        x.hi = (x.hi >> 1) ^ (carry & 0xe100000000000000ULL);
+    }
+    else {
+        carry = 0 - (x.hi >> 63);
+        x.hi = (x.hi << 1) | (x.lo >> 63);
+        x.lo = (x.lo << 1) ^ (carry & 0x87);
+    }
+}
 
-    // PKCS7Padding
-    int length = len;
-    length = (length / padding_len + 1) * padding_len;
+// Whole blocks gathered from any number of sectors, so that each kernel call
+// gets up to 256 of them however small the sectors are.
+struct sm4_xts_batch
+{
+    const uint32_t* sk;
+    bool            gb;
+    int             n;
+    unsigned char   data[256 * 16];
+    unsigned char   tweak[256 * 16];
+    unsigned char*  dest[256];
+
+    void add(const unsigned char* input, unsigned char* output, const sm4_xts_tweak& t)
+    {
+        unsigned char tw[16], d[16];
+        int i;
 
-    Buffer input{ length };
-    memset(input.data(), length - len, length);
-    memcpy(input.data(), data, len);
+        // work on locals: input and output may point anywhere, including
+        // into this batch as far as the compiler knows
+        sm4_xts_store(t, gb, tw);
+        memcpy(d, input, 16);
+        for (i = 0; i < 16; ++i) {
+            d[i] ^= tw[i];
+        }
+        memcpy(tweak + n * 16, tw, 16);
+        memcpy(data + n * 16, d, 16);
+        dest[n] = output;
 
-    output.resize(length);
+        if (++n == 256) {
+            flush();
+        }
+    }
 
-    sm4_context ctx;
-    sm4_setkey_enc(&ctx, k);
-    sm4_crypt_cbc(&ctx, 1, length, iv, (const unsigned char*)input.data(), (unsigned char*)output.data());
+    void flush()
+    {
+        int b, i;
 
-    return true;
+        sm4_crypt_blocks(sk, data, data, n);
+        for (i = 0; i < n * 16; ++i) {
+            data[i] ^= tweak[i];
+        }
+        for (b = 0; b < n; ++b) {
+            memcpy(dest[b], data + b * 16, 16);
+        }
+        n = 0;
+    }
+};
+
+// Ciphertext stealing over the last full block (tweak t) and the r trailing
+// bytes. Decryption uses the two tweaks in the opposite order.
+static void sm4_xts_steal(const uint32_t sk[32], bool gb, int mode, sm4_xts_tweak t, const unsigned char* input, unsigned char* output, int r)
+{
+    unsigned char cc[16], pp[16], tw[16];
+    sm4_xts_tweak a = t, b = t;
+    int i;
+
+    if (mode) {
+        sm4_xts_next(b, gb);
+    }
+    else {
+        sm4_xts_next(a, gb);
+    }
+
+    sm4_xts_store(a, gb, tw);
+    for (i = 0; i < 16; ++i) {
+        cc[i] = (unsigned char)(input[i] ^ tw[i]);
+    }
+    sm4_crypt_blocks(sk, cc, cc, 1);
+    for (i = 0; i < 16; ++i) {
+        cc[i] ^= tw[i];
+    }
+
+    // read the partial block before it is overwritten in place
+    memcpy(pp, input + 16, r);
+    memcpy(pp + r, cc + r, 16 - r);
+    memcpy(output + 16, cc, r);
+
+    sm4_xts_store(b, gb, tw);
+    for (i = 0; i < 16; ++i) {
+        pp[i] ^= tw[i];
+    }
+    sm4_crypt_blocks(sk, pp, pp, 1);
+    for (i = 0; i < 16; ++i) {
+        output[i] = (unsigned char)(pp[i] ^ tw[i]);
+    }
+
+    memset(cc, 0, sizeof(cc));
+    memset(pp, 0, sizeof(pp));
 }
 
-bool sm4::encrypt(const Buffer& data, const Buffer& key, Buffer& output)
+// count sectors of size bytes, numbered from first. The initial tweaks of up
+// to 256 sectors are encrypted in one kernel call.
+static void sm4_xts_sectors(const uint32_t sk[32], const uint32_t tk[32], bool gb, int mode, uint64_t first, int size, int64_t count, const unsigned char* input, unsigned char* output)
 {
-    return encrypt(data.data(), data.size(), key, output);
+    sm4_xts_batch batch;
+    unsigned char tweaks[256 * 16];
+    int full = size / 16 - (size % 16 ? 1 : 0);
+    int r = size % 16;
+    int b, i, n;
+
+    batch.sk = sk;
+    batch.gb = gb;
+    batch.n = 0;
+
+    while (count > 0) {
+        n = (int)std::min<int64_t>(count, 256);
+
+        memset(tweaks, 0, n * 16);
+        for (i = 0; i < n; ++i) {
+            uint64_t sector = first + i;
+            for (b = 0; b < 8; ++b) {
+                tweaks[i * 16 + b] = (unsigned char)(sector >> (8 * b));
+            }
+        }
+        sm4_crypt_blocks(tk, tweaks, tweaks, n);
+
+        for (i = 0; i < n; ++i) {
+            const unsigned char* in = input + (int64_t)i * size;
+            unsigned char* out = output + (int64_t)i * size;
+            sm4_xts_tweak t = sm4_xts_load(tweaks + i * 16, gb);
+
+            for (b = 0; b < full; ++b) {
+                batch.add(in + b * 16, out + b * 16, t);
+                sm4_xts_next(t, gb);
+            }
+            if (r) {
+                sm4_xts_steal(sk, gb, mode, t, in + full * 16, out + full * 16, r);
+            }
+        }
+
+        first += n;
+        count -= n;
+        input += (int64_t)n * size;
+        output += (int64_t)n * size;
+    }
+
+    if (batch.n > 0) {
+        batch.flush();
+    }
+
+    memset(tweaks, 0, sizeof(tweaks));
+    memset(batch.data, 0, sizeof(batch.data));
+    memset(batch.tweak, 0, sizeof(batch.tweak));
 }
 
-bool sm4::decrypt(const char* data, int len, const Buffer& key, Buffer& output)
+// Sectors are independent, so large batches are split between threads.
+static void sm4_xts_crypt(const uint32_t sk[32], const uint32_t tk[32], bool gb, int mode, uint64_t first, int size, int64_t count, const unsigned char* input, unsigned char* output)
 {
-    if (!data || key.isEmpty()) {
-        return false;
+    int threads = (int)std::min<int64_t>(count, sm4_parallel_threads(count * size));
+    if (threads <= 1) {
+        sm4_xts_sectors(sk, tk, gb, mode, first, size, count, input, output);
+        return;
     }
 
-    int length = len;
+    int64_t per = count / threads;
+    sm4_parallel(threads, [&](int t) {
+        int64_t start = t * per;
+        int64_t n = (t == threads - 1) ? count - start : per;
+        sm4_xts_sectors(sk, tk, gb, mode, first + start, size, n, input + start * size, output + start * size);
+    });
+}
 
-    unsigned char k[key_len] = { 0 };
-    memcpy(k, key.data(), key.size());
+constexpr unsigned char sm4_iv[16] = {
+    0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38,
+    0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38
+};
 
-    unsigned char iv[iv_len] = { 0 };
-    memcpy(iv, sm4_iv, iv_len);
+constexpr int key_len = 16;
+constexpr int iv_len = 16;
+constexpr int padding_len = 16;
 
-    output.resize(length);
+constexpr int sm4_batch_lanes = 256;
 
-    sm4_context ctx;
-    sm4_setkey_dec(&ctx, k);
-    sm4_crypt_cbc(&ctx, 0, length, iv, (const unsigned char*)data, (unsigned char*)output.data());
+// Length of the PKCS#7 padding ending this block, -1 if malformed. The time
+// taken does not depend on the block contents: every byte is inspected and
+// the checks are combined with masks instead of branches.
+static int sm4_padding(const unsigned char last[16])
+{
+    uint32_t pad = last[padding_len - 1];
 
-    length = length - (int)output[length - 1];
-    if (length < 0) {
-        return false;
+    // all ones when pad is 0 or above 16
+    uint32_t bad = (uint32_t)0 - (((pad - 1) >> 31) | ((16 - pad) >> 31));
+
+    for (uint32_t i = 0; i < padding_len; ++i) {
+        // all ones when byte i belongs to the padding, i.e. 15 - i < pad
+        uint32_t in = (uint32_t)0 - (((15 - i) - pad) >> 31);
+        bad |= in & (uint32_t)(last[i] ^ pad);
     }
 
-    output.resize(length);
-    return true;
+    // bad is either 0 or non-zero; fold it to 0 / all ones
+    bad = (uint32_t)0 - ((bad | ((uint32_t)0 - bad)) >> 31);
+    return (int)((pad & ~bad) | bad);
 }
 
-bool sm4::decrypt(const Buffer& data, const Buffer& key, Buffer& output)
+// CBC is serial within a message but not across messages. Each lane carries
+// one message; every step encrypts the next block of all lanes in a single
+// kernel call, and a lane whose message is done takes the next one.
+static bool sm4_encrypt_batch(const uint32_t sk[32], Sm4Message* messages, int count)
 {
-    return decrypt(data.data(), data.size(), key, output);
+    unsigned char blocks[sm4_batch_lanes * 16];
+    int msg[sm4_batch_lanes];
+    int pos[sm4_batch_lanes];
+    int lanes = 0;
+    int next = 0;
+    bool ok = true;
+    int i, k;
+
+    // the next acceptable message, or -1
+    auto take = [&]() {
+        while (next < count) {
+            auto& m = messages[next];
+            int size = sm4::encryptedSize(m.len);
+            if (size >= 0 && (m.data || m.len == 0) && m.output && m.outputSize >= size) {
+                return next++;
+            }
+            m.result = -1;
+            ok = false;
+            ++next;
+        }
+        return -1;
+    };
+
+    while (lanes < sm4_batch_lanes && (msg[lanes] = take()) >= 0) {
+        pos[lanes++] = 0;
+    }
+
+    while (lanes > 0) {
+        for (k = 0; k < lanes; ++k) {
+            auto& m = messages[msg[k]];
+            auto in = (const unsigned char*)m.data + pos[k];
+            auto chain = pos[k] == 0 ? sm4_iv : (const unsigned char*)m.output + pos[k] - 16;
+            auto b = blocks + k * 16;
+            int rest = m.len - pos[k];
+
+            if (rest >= padding_len) {
+                for (i = 0; i < 16; ++i) {
+                    b[i] = (unsigned char)(in[i] ^ chain[i]);
+                }
+            }
+            else {
+                // PKCS7Padding
+                for (i = 0; i < 16; ++i) {
+                    b[i] = (unsigned char)((i < rest ? in[i] : padding_len - rest) ^ chain[i]);
+                }
+            }
+        }
+
+        sm4_crypt_blocks(sk, blocks, blocks, lanes);
+
+        for (k = 0; k < lanes; ++k) {
+            auto& m = messages[msg[k]];
+            memcpy(m.output + pos[k], blocks + k * 16, 16);
+            pos[k] += 16;
+            if (pos[k] <= m.len) {
+                continue;
+            }
+
+            m.result = pos[k];
+            if ((msg[k] = take()) >= 0) {
+                pos[k] = 0;
+                continue;
+            }
+
+            // no more messages: close the gap with the last lane
+            --lanes;
+            msg[k] = msg[lanes];
+            pos[k] = pos[lanes];
+            memcpy(blocks + k * 16, blocks + lanes * 16, 16);
+            --k;
+        }
+    }
+
+    memset(blocks, 0, sizeof(blocks));
+    return ok;
+}
+
+// Every CBC block can be decrypted independently, so the blocks of
+// consecutive messages are simply packed into full kernel calls. The
+// ciphertext is copied first, which keeps in-place decryption correct.
+static bool sm4_decrypt_batch(const uint32_t sk[32], Sm4Message* messages, int count)
+{
+    unsigned char input[sm4_batch_lanes * 16];
+    unsigned char output[sm4_batch_lanes * 16];
+    unsigned char prev[16];
+    int msg[sm4_batch_lanes];
+    int pos[sm4_batch_lanes];
+    bool ok = true;
+    int n = 0;
+    int i, j, k;
+
+    auto flush = [&]() {
+        sm4_crypt_blocks(sk, input, output, n);
+
+        for (k = 0; k < n; ++k) {
+            auto& m = messages[msg[k]];
+            const unsigned char* chain = pos[k] == 0 ? sm4_iv : (k > 0 ? input + (k - 1) * 16 : prev);
+            auto b = output + k * 16;
+
+            for (i = 0; i < 16; ++i) {
+                b[i] ^= chain[i];
+            }
+
+            if (pos[k] + 16 < m.len) {
+                memcpy(m.output + pos[k], b, 16);
+                continue;
+            }
+
+            int pad = sm4_padding(b);
+            if (pad < 0) {
+                m.result = -1;
+                ok = false;
+                continue;
+            }
+            memcpy(m.output + pos[k], b, 16 - pad);
+            m.result = m.len - pad;
+        }
+
+        memcpy(prev, input + (n - 1) * 16, 16);
+        n = 0;
+    };
+
+    for (j = 0; j < count; ++j) {
+        auto& m = messages[j];
+        if (!m.data || !m.output || m.len <= 0 || m.len % padding_len || m.outputSize < m.len) {
+            m.result = -1;
+            ok = false;
+            continue;
+        }
+
+        for (int p = 0; p < m.len; p += 16) {
+            memcpy(input + n * 16, m.data + p, 16);
+            msg[n] = j;
+            pos[n] = p;
+            if (++n == sm4_batch_lanes) {
+                flush();
+            }
+        }
+    }
+    if (n > 0) {
+        flush();
+    }
+
+    memset(output, 0, sizeof(output));
+    return ok;
+}
+
+}
+
+void sm4_crypt_ecb(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    sm4_crypt_blocks(sk, input, output, blocks);
+}
+
+Sm4Key::Sm4Key(const Buffer& key)
+    : Sm4Key{ key.data(), key.size() }
+{
+
+}
+
+Sm4Key::Sm4Key(const char* key, int len)
+    : m_valid{ key && len > 0 && len <= key_len }
+{
+    // shorter keys are zero padded, as sm4::encrypt always did
+    unsigned char k[key_len] = { 0 };
+    if (m_valid) {
+        memcpy(k, key, len);
+    }
+
+    sm4_setkey(m_ek, k);
+    sm4_setkey_dec(m_dk, m_ek);
+
+    memset(k, 0, sizeof(k));
+}
+
+Sm4Key::~Sm4Key()
+{
+    memset(m_ek, 0, sizeof(m_ek));
+    memset(m_dk, 0, sizeof(m_dk));
+}
+
+bool Sm4Key::isValid() const
+{
+    return m_valid;
+}
+
+bool Sm4Key::encrypt(const char* data, int len, Buffer& output) const
+{
+    int length = sm4::encryptedSize(len);
+    if (!data || !m_valid || length < 0) {
+        return false;
+    }
+
+    // data may lie inside output, as in sm4::encrypt(buffer, key, buffer).
+    // Growing output can move it, so find it again afterwards; encrypting
+    // over (or in front of) the input is fine, every block is read before the
+    // bytes it lands on are written.
+    auto begin = reinterpret_cast<uintptr_t>(output.data());
+    auto at = reinterpret_cast<uintptr_t>(data);
+    bool inside = output.data() && at >= begin && at < begin + (uintptr_t)output.size();
+
+    // every byte is written by the encryption, no need to clear them first
+    output.resizeForOverwrite(length);
+    if (inside) {
+        data = output.data() + (at - begin);
+    }
+    return encrypt(data, len, output.data(), length);
+}
+
+bool Sm4Key::encrypt(const char* data, int len, char* output, int outputSize) const
+{
+    int length = sm4::encryptedSize(len);
+    if (!data || !output || !m_valid || length < 0 || outputSize < length) {
+        return false;
+    }
+
+    unsigned char iv[iv_len] = { 0 };
+    memcpy(iv, sm4_iv, iv_len);
+
+    // whole blocks straight from the input, only the last one is padded
+    // (PKCS7Padding) in a scratch block
+    int full = len / padding_len * padding_len;
+    int rest = len - full;
+
+    unsigned char last[padding_len];
+    memcpy(last, data + full, rest);
+    memset(last + rest, padding_len - rest, padding_len - rest);
+
+    sm4_crypt_cbc(m_ek, 1, full, iv, (const unsigned char*)data, (unsigned char*)output);
+    sm4_crypt_cbc(m_ek, 1, padding_len, iv, last, (unsigned char*)output + full);
+
+    memset(last, 0, sizeof(last));
+    return true;
+}
+
+bool Sm4Key::encrypt(const Buffer& data, Buffer& output) const
+{
+    return encrypt(data.data(), data.size(), output);
+}
+
+bool Sm4Key::decrypt(const char* data, int len, Buffer& output, Sm4Error* error) const
+{
+    Sm4Error e = Sm4Error::None;
+    if (!error) {
+        error = &e;
+    }
+    if (!data || len <= 0 || len % padding_len) {
+        *error = data ? Sm4Error::InvalidLength : Sm4Error::InvalidArgument;
+        return false;
+    }
+
+    // every byte is written by the decryption, no need to clear them first
+    output.resizeForOverwrite(len);
+
+    int length = decrypt(data, len, output.data(), len, error);
+    output.resize(std::max(length, 0));
+    return length >= 0;
+}
+
+bool Sm4Key::decrypt(const Buffer& data, Buffer& output, Sm4Error* error) const
+{
+    return decrypt(data.data(), data.size(), output, error);
+}
+
+int Sm4Key::decrypt(const char* data, int len, char* output, int outputSize, Sm4Error* error) const
+{
+    Sm4Error e = Sm4Error::None;
+    if (!error) {
+        error = &e;
+    }
+    *error = Sm4Error::None;
+
+    if (!m_valid) {
+        *error = Sm4Error::InvalidKey;
+        return -1;
+    }
+    if (!data || !output) {
+        *error = Sm4Error::InvalidArgument;
+        return -1;
+    }
+    if (len <= 0 || len % padding_len) {
+        *error = Sm4Error::InvalidLength;
+        return -1;
+    }
+    if (outputSize < len - padding_len) {
+        *error = Sm4Error::OutputTooSmall;
+        return -1;
+    }
+
+    unsigned char iv[iv_len] = { 0 };
+    memcpy(iv, sm4_iv, iv_len);
+
+    // all blocks but the last straight into the output; the last one goes
+    // through a scratch block so that only the plaintext is ever written
+    unsigned char last[padding_len];
+    int full = len - padding_len;
+
+    sm4_crypt_cbc(m_dk, 0, full, iv, (const unsigned char*)data, (unsigned char*)output);
+    sm4_crypt_cbc(m_dk, 0, padding_len, iv, (const unsigned char*)data + full, last);
+
+    int pad = sm4_padding(last);
+    int length = full + padding_len - pad;
+
+    if (pad < 0) {
+        *error = Sm4Error::BadPadding;
+        length = -1;
+    }
+    else if (outputSize < length) {
+        *error = Sm4Error::OutputTooSmall;
+        length = -1;
+    }
+    else {
+        memcpy(output + full, last, padding_len - pad);
+    }
+
+    memset(last, 0, sizeof(last));
+    return length;
+}
+
+bool Sm4Key::encryptBatch(Sm4Message* messages, int count) const
+{
+    if ((!messages && count > 0) || count < 0 || !m_valid) {
+        return false;
+    }
+    return sm4_encrypt_batch(m_ek, messages, count);
+}
+
+bool Sm4Key::decryptBatch(Sm4Message* messages, int count) const
+{
+    if ((!messages && count > 0) || count < 0 || !m_valid) {
+        return false;
+    }
+    return sm4_decrypt_batch(m_dk, messages, count);
+}
+
+bool sm4::encrypt(const char* data, int len, const Buffer& key, Buffer& output)
+{
+    return Sm4Key{ key }.encrypt(data, len, output);
+}
+
+bool sm4::encrypt(const Buffer& data, const Buffer& key, Buffer& output)
+{
+    return encrypt(data.data(), data.size(), key, output);
+}
+
+bool sm4::encrypt(const char* data, int len, const Buffer& key, char* output, int outputSize)
+{
+    return Sm4Key{ key }.encrypt(data, len, output, outputSize);
+}
+
+bool sm4::encryptBatch(Sm4Message* messages, int count, const Buffer& key)
+{
+    return Sm4Key{ key }.encryptBatch(messages, count);
+}
+
+bool sm4::decryptBatch(Sm4Message* messages, int count, const Buffer& key)
+{
+    return Sm4Key{ key }.decryptBatch(messages, count);
+}
+
+void sm4::setThreads(int count)
+{
+    Sm4ThreadPool::instance().setLimit(count);
+}
+
+int sm4::encryptedSize(int len)
+{
+    if (len < 0 || len > INT_MAX - padding_len) {
+        return -1;
+    }
+    return (len / padding_len + 1) * padding_len;
+}
+
+bool sm4::decrypt(const char* data, int len, const Buffer& key, Buffer& output, Sm4Error* error)
+{
+    return Sm4Key{ key }.decrypt(data, len, output, error);
+}
+
+bool sm4::decrypt(const Buffer& data, const Buffer& key, Buffer& output, Sm4Error* error)
+{
+    return decrypt(data.data(), data.size(), key, output, error);
+}
+
+int sm4::decrypt(const char* data, int len, const Buffer& key, char* output, int outputSize, Sm4Error* error)
+{
+    return Sm4Key{ key }.decrypt(data, len, output, outputSize, error);
+}
+
+Sm4Encryptor::Sm4Encryptor(const Sm4Key& key)
+    : m_key{ key }
+{
+    reset();
+}
+
+Sm4Encryptor::~Sm4Encryptor()
+{
+    memset(m_iv, 0, sizeof(m_iv));
+    memset(m_block, 0, sizeof(m_block));
+}
+
+void Sm4Encryptor::reset()
+{
+    memcpy(m_iv, sm4_iv, iv_len);
+    memset(m_block, 0, sizeof(m_block));
+    m_blockLen = 0;
+    m_finished = false;
+}
+
+int Sm4Encryptor::update(const char* data, int len, char* output)
+{
+    if (!m_key.isValid() || m_finished || len < 0 || (len > 0 && (!data || !output))) {
+        return -1;
+    }
+
+    auto input = (const unsigned char*)data;
+    auto out = (unsigned char*)output;
+    int written = 0;
+    int n;
+
+    // complete the block carried over from the previous call
+    if (m_blockLen > 0) {
+        n = std::min(padding_len - m_blockLen, len);
+        memcpy(m_block + m_blockLen, input, n);
+        m_blockLen += n;
+        input += n;
+        len -= n;
+
+        if (m_blockLen < padding_len) {
+            return 0;
+        }
+
+        sm4_crypt_cbc(m_key.m_ek, 1, padding_len, m_iv, m_block, out);
+        written += padding_len;
+        m_blockLen = 0;
+    }
+
+    n = len / padding_len * padding_len;
+    sm4_crypt_cbc(m_key.m_ek, 1, n, m_iv, input, out + written);
+    written += n;
+
+    m_blockLen = len - n;
+    memcpy(m_block, input + n, m_blockLen);
+
+    return written;
+}
+
+bool Sm4Encryptor::update(const Buffer& data, Buffer& output)
+{
+    output.resize(data.size() + padding_len - 1);
+
+    int written = update(data.data(), data.size(), output.data());
+    output.resize(std::max(written, 0));
+    return written >= 0;
+}
+
+int Sm4Encryptor::finish(char* output)
+{
+    if (!m_key.isValid() || m_finished || !output) {
+        return -1;
+    }
+
+    // PKCS7Padding
+    memset(m_block + m_blockLen, padding_len - m_blockLen, padding_len - m_blockLen);
+    sm4_crypt_cbc(m_key.m_ek, 1, padding_len, m_iv, m_block, (unsigned char*)output);
+
+    memset(m_block, 0, sizeof(m_block));
+    m_blockLen = 0;
+    m_finished = true;
+    return padding_len;
+}
+
+bool Sm4Encryptor::finish(Buffer& output)
+{
+    output.resize(padding_len);
+
+    int written = finish(output.data());
+    output.resize(std::max(written, 0));
+    return written >= 0;
+}
+
+Sm4Decryptor::Sm4Decryptor(const Sm4Key& key)
+    : m_key{ key }
+{
+    reset();
+}
+
+Sm4Decryptor::~Sm4Decryptor()
+{
+    memset(m_iv, 0, sizeof(m_iv));
+    memset(m_block, 0, sizeof(m_block));
+}
+
+void Sm4Decryptor::reset()
+{
+    memcpy(m_iv, sm4_iv, iv_len);
+    memset(m_block, 0, sizeof(m_block));
+    m_blockLen = 0;
+    m_finished = false;
+}
+
+int Sm4Decryptor::update(const char* data, int len, char* output)
+{
+    if (!m_key.isValid() || m_finished || len < 0 || (len > 0 && (!data || !output))) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    auto input = (const unsigned char*)data;
+    auto out = (unsigned char*)output;
+    int written = 0;
+    int n;
+
+    if (m_blockLen < padding_len) {
+        n = std::min(padding_len - m_blockLen, len);
+        memcpy(m_block + m_blockLen, input, n);
+        m_blockLen += n;
+        input += n;
+        len -= n;
+
+        if (len == 0) {
+            return 0;
+        }
+    }
+
+    // more data follows, so the held block is not the last one
+    sm4_crypt_cbc(m_key.m_dk, 0, padding_len, m_iv, m_block, out);
+    written += padding_len;
+
+    // hold back the final (possibly partial) block of this piece
+    n = (len - 1) / padding_len * padding_len;
+    sm4_crypt_cbc(m_key.m_dk, 0, n, m_iv, input, out + written);
+    written += n;
+
+    m_blockLen = len - n;
+    memcpy(m_block, input + n, m_blockLen);
+
+    return written;
+}
+
+bool Sm4Decryptor::update(const Buffer& data, Buffer& output)
+{
+    output.resize(data.size() + padding_len - 1);
+
+    int written = update(data.data(), data.size(), output.data());
+    output.resize(std::max(written, 0));
+    return written >= 0;
+}
+
+int Sm4Decryptor::finish(char* output)
+{
+    if (!m_key.isValid() || m_finished || !output || m_blockLen != padding_len) {
+        return -1;
+    }
+
+    unsigned char last[padding_len];
+    sm4_crypt_cbc(m_key.m_dk, 0, padding_len, m_iv, m_block, last);
+
+    int pad = sm4_padding(last);
+
+    int written = -1;
+    if (pad > 0) {
+        written = padding_len - pad;
+        memcpy(output, last, written);
+    }
+
+    memset(last, 0, sizeof(last));
+    memset(m_block, 0, sizeof(m_block));
+    m_blockLen = 0;
+    m_finished = true;
+    return written;
+}
+
+bool Sm4Decryptor::finish(Buffer& output)
+{
+    output.resize(padding_len - 1);
+
+    int written = finish(output.data());
+    output.resize(std::max(written, 0));
+    return written >= 0;
+}
+
+Sm4Ctr::Sm4Ctr(const Sm4Key& key, const unsigned char iv[16])
+    : m_key{ key }
+    , m_position{ 0 }
+{
+    memcpy(m_iv, iv, iv_len);
+}
+
+Sm4Ctr::Sm4Ctr(const Sm4Key& key, const Buffer& iv)
+    : m_key{ key }
+    , m_position{ 0 }
+{
+    memset(m_iv, 0, iv_len);
+    memcpy(m_iv, iv.data(), std::min(iv.size(), iv_len));
+}
+
+Sm4Ctr::~Sm4Ctr()
+{
+    memset(m_iv, 0, sizeof(m_iv));
+}
+
+void Sm4Ctr::seek(uint64_t position)
+{
+    m_position = position;
+}
+
+uint64_t Sm4Ctr::position() const
+{
+    return m_position;
+}
+
+bool Sm4Ctr::crypt(const char* data, int len, char* output)
+{
+    if (!data || !output || len < 0 || !m_key.isValid()) {
+        return false;
+    }
+
+    auto input = (const unsigned char*)data;
+    auto out = (unsigned char*)output;
+    unsigned char stream[16];
+    int i;
+
+    // finish the block a previous call or seek() stopped in
+    int offset = (int)(m_position % 16);
+    if (offset != 0 && len > 0) {
+        int n = std::min(len, 16 - offset);
+        sm4_ctr_block(m_iv, m_position / 16, stream);
+        sm4_one_round(m_key.m_ek, stream, stream);
+
+        for (i = 0; i < n; ++i) {
+            out[i] = (unsigned char)(input[i] ^ stream[offset + i]);
+        }
+
+        input += n;
+        out += n;
+        len -= n;
+        m_position += n;
+    }
+
+    int blocks = len / 16;
+    if (blocks > 0) {
+        sm4_ctr_crypt(m_key.m_ek, m_iv, m_position / 16, input, out, blocks);
+
+        input += blocks * 16;
+        out += blocks * 16;
+        len -= blocks * 16;
+        m_position += (uint64_t)blocks * 16;
+    }
+
+    if (len > 0) {
+        sm4_ctr_block(m_iv, m_position / 16, stream);
+        sm4_one_round(m_key.m_ek, stream, stream);
+
+        for (i = 0; i < len; ++i) {
+            out[i] = (unsigned char)(input[i] ^ stream[i]);
+        }
+        m_position += len;
+    }
+
+    memset(stream, 0, sizeof(stream));
+    return true;
+}
+
+bool Sm4Ctr::crypt(const Buffer& data, Buffer& output)
+{
+    output.resize(data.size());
+    return crypt(data.data(), data.size(), output.data());
+}
+
+Sm4Xts::Sm4Xts(const Sm4Key& dataKey, const Sm4Key& tweakKey, Standard standard)
+    : m_dataKey{ dataKey }
+    , m_tweakKey{ tweakKey }
+    , m_standard{ standard }
+{
+    // IEEE 1619 requires the two halves of the key to differ
+    m_valid = m_dataKey.isValid() && m_tweakKey.isValid() && memcmp(m_dataKey.m_ek, m_tweakKey.m_ek, sizeof(m_dataKey.m_ek)) != 0;
+}
+
+Sm4Xts::Sm4Xts(const Buffer& key, Standard standard)
+    : Sm4Xts{ Sm4Key{ key.size() == 2 * key_len ? key.data() : nullptr, key_len },
+              Sm4Key{ key.size() == 2 * key_len ? key.data() + key_len : nullptr, key_len },
+              standard }
+{
+
+}
+
+bool Sm4Xts::isValid() const
+{
+    return m_valid;
+}
+
+bool Sm4Xts::encrypt(uint64_t sector, const char* data, int len, char* output) const
+{
+    return crypt(1, sector, len, 1, data, output);
+}
+
+bool Sm4Xts::decrypt(uint64_t sector, const char* data, int len, char* output) const
+{
+    return crypt(0, sector, len, 1, data, output);
+}
+
+bool Sm4Xts::encryptSectors(uint64_t firstSector, int sectorSize, int count, const char* data, char* output) const
+{
+    return crypt(1, firstSector, sectorSize, count, data, output);
+}
+
+bool Sm4Xts::decryptSectors(uint64_t firstSector, int sectorSize, int count, const char* data, char* output) const
+{
+    return crypt(0, firstSector, sectorSize, count, data, output);
+}
+
+bool Sm4Xts::crypt(int mode, uint64_t firstSector, int sectorSize, int count, const char* data, char* output) const
+{
+    if (!m_valid || sectorSize < padding_len || count < 0 || (count > 0 && (!data || !output))) {
+        return false;
+    }
+
+    sm4_xts_crypt(mode ? m_dataKey.m_ek : m_dataKey.m_dk, m_tweakKey.m_ek, m_standard == GbT17964, mode,
+                  firstSector, sectorSize, count, (const unsigned char*)data, (unsigned char*)output);
+    return true;
 }
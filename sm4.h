@@ -1,16 +1,292 @@
 #pragma once
 
+#include <stdint.h>
+
 class Buffer;
 
+enum class Sm4Error
+{
+    None,
+    InvalidKey,
+    InvalidArgument,
+    InvalidLength,      // ciphertext is not a positive multiple of 16 bytes
+    OutputTooSmall,
+    BadPadding
+};
+
+// One message of a batch call. Encryption needs outputSize of at least
+// sm4::encryptedSize(len), decryption at least len; output may be data itself.
+// result receives the number of bytes written, or -1 if the message was
+// rejected.
+struct Sm4Message
+{
+    const char* data;
+    int         len;
+    char*       output;
+    int         outputSize;
+    int         result;
+};
+
 class sm4
 {
 public:
     sm4() = delete;
     ~sm4() = delete;
 
+    // PKCS#7 always adds 1 to 16 bytes; -1 if len is negative or too large
+    static int encryptedSize(int len);
+
     static bool encrypt(const char* data, int len, const Buffer& key, Buffer& output);
     static bool encrypt(const Buffer& data, const Buffer& key, Buffer& output);
 
-    static bool decrypt(const char* data, int len, const Buffer& key, Buffer& output);
-    static bool decrypt(const Buffer& data, const Buffer& key, Buffer& output);
+    // into a caller provided buffer of at least encryptedSize(len) bytes;
+    // output may be data itself for in-place encryption
+    static bool encrypt(const char* data, int len, const Buffer& key, char* output, int outputSize);
+
+    static bool decrypt(const char* data, int len, const Buffer& key, Buffer& output, Sm4Error* error = nullptr);
+    static bool decrypt(const Buffer& data, const Buffer& key, Buffer& output, Sm4Error* error = nullptr);
+
+    // into a caller provided buffer with room for the plaintext (at most
+    // len - 1 bytes); output may be data itself. Returns the plaintext
+    // length, -1 on error.
+    static int decrypt(const char* data, int len, const Buffer& key, char* output, int outputSize, Sm4Error* error = nullptr);
+
+    // Many independent messages under one key. Blocks of different messages
+    // are interleaved so they fill the lanes of the multi-block kernels, and
+    // nothing is allocated per message. Returns true if every message succeeded.
+    static bool encryptBatch(Sm4Message* messages, int count, const Buffer& key);
+    static bool decryptBatch(Sm4Message* messages, int count, const Buffer& key);
+
+    // Most threads one large CBC decryption, CTR or XTS call may use,
+    // including the caller's; they come from a shared pool started on first
+    // use. 1 turns threading off, 0 restores the default: BUFFER_SM4_THREADS
+    // if set, otherwise one per core.
+    static void setThreads(int count);
+};
+
+// Expanded SM4 key. The encryption and decryption schedules are computed once
+// in the constructor; the object is immutable afterwards and can be shared
+// between threads.
+class Sm4Key
+{
+public:
+    explicit Sm4Key(const Buffer& key);
+    Sm4Key(const char* key, int len);
+    ~Sm4Key();
+
+    bool isValid() const;
+
+    bool encrypt(const char* data, int len, Buffer& output) const;
+    bool encrypt(const Buffer& data, Buffer& output) const;
+    bool encrypt(const char* data, int len, char* output, int outputSize) const;
+
+    bool decrypt(const char* data, int len, Buffer& output, Sm4Error* error = nullptr) const;
+    bool decrypt(const Buffer& data, Buffer& output, Sm4Error* error = nullptr) const;
+    int decrypt(const char* data, int len, char* output, int outputSize, Sm4Error* error = nullptr) const;
+
+    bool encryptBatch(Sm4Message* messages, int count) const;
+    bool decryptBatch(Sm4Message* messages, int count) const;
+
+private:
+    friend class Sm4Ctr;
+    friend class Sm4Encryptor;
+    friend class Sm4Decryptor;
+    friend class Sm4Gcm;
+    friend class Sm4Xts;
+
+    uint32_t m_ek[32];
+    uint32_t m_dk[32];
+    bool     m_valid;
+};
+
+// Streaming form of Sm4Key::encrypt: the same CBC chaining, IV and PKCS#7
+// padding, fed in pieces of any size. update() writes whole blocks only and
+// carries the partial block to the next call; finish() pads and writes the
+// last block. Memory use does not depend on the message size.
+class Sm4Encryptor
+{
+public:
+    explicit Sm4Encryptor(const Sm4Key& key);
+    ~Sm4Encryptor();
+
+    // output needs room for len + 15 bytes and must not overlap data.
+    // Returns the number of bytes written, -1 on error.
+    int update(const char* data, int len, char* output);
+    bool update(const Buffer& data, Buffer& output);
+
+    // output needs room for 16 bytes
+    int finish(char* output);
+    bool finish(Buffer& output);
+
+    // start a new message with the same key
+    void reset();
+
+private:
+    Sm4Key        m_key;
+    unsigned char m_iv[16];
+    unsigned char m_block[16];
+    int           m_blockLen;
+    bool          m_finished;
+};
+
+// Streaming form of Sm4Key::decrypt. The last complete block is held back
+// until finish(), which checks and strips the padding.
+class Sm4Decryptor
+{
+public:
+    explicit Sm4Decryptor(const Sm4Key& key);
+    ~Sm4Decryptor();
+
+    // output needs room for len + 15 bytes and must not overlap data.
+    // Returns the number of bytes written, -1 on error.
+    int update(const char* data, int len, char* output);
+    bool update(const Buffer& data, Buffer& output);
+
+    // output needs room for 15 bytes. Fails when the total length is not a
+    // multiple of 16 or the padding is malformed.
+    int finish(char* output);
+    bool finish(Buffer& output);
+
+    void reset();
+
+private:
+    Sm4Key        m_key;
+    unsigned char m_iv[16];
+    unsigned char m_block[16];
+    int           m_blockLen;
+    bool          m_finished;
+};
+
+// SM4 in counter mode (no padding). The 16-byte initial counter block is
+// incremented as one big endian 128-bit integer per block, so the caller owns
+// the nonce/counter split. Encryption and decryption are the same operation,
+// and seek() moves to any byte offset of the key stream.
+class Sm4Ctr
+{
+public:
+    Sm4Ctr(const Sm4Key& key, const unsigned char iv[16]);
+    Sm4Ctr(const Sm4Key& key, const Buffer& iv);
+    ~Sm4Ctr();
+
+    void seek(uint64_t position);
+    uint64_t position() const;
+
+    // output may alias data
+    bool crypt(const char* data, int len, char* output);
+    bool crypt(const Buffer& data, Buffer& output);
+
+private:
+    Sm4Key        m_key;
+    unsigned char m_iv[16];
+    uint64_t      m_position;
+};
+
+// SM4-XTS for fixed size storage units (sectors). Every sector is encrypted
+// on its own with a tweak derived from its sector number (128-bit little
+// endian), so nothing grows and any sector can be rewritten independently.
+// Sectors that are not a multiple of 16 bytes use ciphertext stealing; the
+// minimum size is 16. The tweak is advanced as in GB/T 17964-2021 by default,
+// or as in IEEE 1619.
+class Sm4Xts
+{
+public:
+    enum Standard
+    {
+        GbT17964,
+        Ieee1619
+    };
+
+    Sm4Xts(const Sm4Key& dataKey, const Sm4Key& tweakKey, Standard standard = GbT17964);
+
+    // 32 bytes: the data key followed by the tweak key
+    explicit Sm4Xts(const Buffer& key, Standard standard = GbT17964);
+
+    // both keys valid and different
+    bool isValid() const;
+
+    // one sector of len bytes, output may alias data
+    bool encrypt(uint64_t sector, const char* data, int len, char* output) const;
+    bool decrypt(uint64_t sector, const char* data, int len, char* output) const;
+
+    // count consecutive sectors of sectorSize bytes, the first one numbered
+    // firstSector. Blocks of several sectors share each kernel call, and large
+    // batches are split between threads. output may alias data.
+    bool encryptSectors(uint64_t firstSector, int sectorSize, int count, const char* data, char* output) const;
+    bool decryptSectors(uint64_t firstSector, int sectorSize, int count, const char* data, char* output) const;
+
+private:
+    bool crypt(int mode, uint64_t firstSector, int sectorSize, int count, const char* data, char* output) const;
+
+private:
+    Sm4Key   m_dataKey;
+    Sm4Key   m_tweakKey;
+    Standard m_standard;
+    bool     m_valid;
+};
+
+class Sm4GcmPrivate;
+
+// SM4 in Galois/Counter Mode (NIST SP 800-38D, RFC 8998). Encryption and
+// authentication happen in one pass over the data; the 16-byte tag covers the
+// associated data and the ciphertext. Any non-empty IV is accepted, 12 bytes
+// is the recommended size. Like Sm4Key the object is immutable once built and
+// can be shared between threads.
+class Sm4Gcm
+{
+public:
+    explicit Sm4Gcm(const Sm4Key& key);
+    ~Sm4Gcm();
+
+    Sm4Gcm(const Sm4Gcm&) = delete;
+    Sm4Gcm& operator=(const Sm4Gcm&) = delete;
+
+    bool isValid() const;
+
+    // output may alias data
+    bool encrypt(const Buffer& iv, const Buffer& aad, const char* data, int len, char* output, unsigned char tag[16]) const;
+    bool encrypt(const Buffer& iv, const Buffer& aad, const Buffer& data, Buffer& output, Buffer& tag) const;
+
+    // returns false and clears the output when the tag does not match
+    bool decrypt(const Buffer& iv, const Buffer& aad, const char* data, int len, const unsigned char tag[16], char* output) const;
+    bool decrypt(const Buffer& iv, const Buffer& aad, const Buffer& data, const Buffer& tag, Buffer& output) const;
+
+private:
+    friend class Sm4GcmStream;
+
+    Sm4GcmPrivate* m_ptr;
+};
+
+// One GCM message processed piece by piece: all updateAad() calls come first,
+// then update() for the payload, then finish() (encrypting) or verify()
+// (decrypting). Decrypted data is released before the tag is checked, so it
+// must be discarded when verify() fails.
+class Sm4GcmStream
+{
+public:
+    Sm4GcmStream(const Sm4Gcm& gcm, const Buffer& iv, bool encrypt);
+    ~Sm4GcmStream();
+
+    bool updateAad(const char* aad, int len);
+
+    // output may alias data
+    bool update(const char* data, int len, char* output);
+
+    bool finish(unsigned char tag[16]);
+    bool verify(const unsigned char tag[16]);
+
+private:
+    void flushAad();
+
+private:
+    const Sm4Gcm& m_gcm;
+    unsigned char m_j0[16];
+    unsigned char m_x[16];       // GHASH accumulator
+    unsigned char m_block[16];   // partial AAD or ciphertext block
+    unsigned char m_stream[16];  // unused key stream of the current block
+    uint32_t      m_counter;     // blocks of payload started so far
+    uint64_t      m_aadLen;
+    uint64_t      m_dataLen;
+    bool          m_encrypt;
+    bool          m_payload;     // AAD is complete
+    bool          m_done;
 };
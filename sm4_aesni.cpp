@@ -0,0 +1,338 @@
+#include <string.h>
+
+#include "sm4_p.h"
+
+#ifdef SM4_HAVE_X86
+
+#include <immintrin.h>
+
+// The SM4 and AES S-boxes are both affine transforms around an inversion in
+// GF(2^8), and the two fields are isomorphic. With the isomorphism folded into
+// the affine parts, S_sm4(x) = Q * S_aes(P * x + p) + q, so one AESENCLAST
+// with a zero round key evaluates 16 SM4 S-boxes at once. P and Q are applied
+// as two 4-bit table lookups (PSHUFB) on the low and high nibble of each byte.
+//
+// Blocks are transposed so that a register holds the same word of 4 blocks.
+
+namespace
+{
+
+#define SM4_NI_TARGET __attribute__((target("aes,ssse3")))
+#define SM4_VAES_TARGET __attribute__((target("vaes,avx2")))
+#define SM4_VAES512_TARGET __attribute__((target("vaes,avx512f,avx512bw")))
+
+alignas(16) const unsigned char sm4_pre_lo[16] = {
+    0x3E, 0xB2, 0x0E, 0x82, 0xBB, 0x37, 0x8B, 0x07, 0xA1, 0x2D, 0x91, 0x1D, 0x24, 0xA8, 0x14, 0x98
+};
+alignas(16) const unsigned char sm4_pre_hi[16] = {
+    0x00, 0xDC, 0x2E, 0xF2, 0xC5, 0x19, 0xEB, 0x37, 0x08, 0xD4, 0x26, 0xFA, 0xCD, 0x11, 0xE3, 0x3F
+};
+alignas(16) const unsigned char sm4_post_lo[16] = {
+    0x6C, 0xD4, 0xA6, 0x1E, 0x52, 0xEA, 0x98, 0x20, 0x0B, 0xB3, 0xC1, 0x79, 0x35, 0x8D, 0xFF, 0x47
+};
+alignas(16) const unsigned char sm4_post_hi[16] = {
+    0x00, 0xE0, 0x50, 0xB0, 0x9D, 0x7D, 0xCD, 0x2D, 0xC0, 0x20, 0x90, 0x70, 0x5D, 0xBD, 0x0D, 0xED
+};
+
+// cancels the ShiftRows step of AESENCLAST
+alignas(16) const unsigned char sm4_inv_shift_rows[16] = {
+    0x00, 0x0D, 0x0A, 0x07, 0x04, 0x01, 0x0E, 0x0B, 0x08, 0x05, 0x02, 0x0F, 0x0C, 0x09, 0x06, 0x03
+};
+
+// big endian words to native order
+alignas(16) const unsigned char sm4_bswap32[16] = {
+    0x03, 0x02, 0x01, 0x00, 0x07, 0x06, 0x05, 0x04, 0x0B, 0x0A, 0x09, 0x08, 0x0F, 0x0E, 0x0D, 0x0C
+};
+
+// ---- 128-bit, AES-NI ----
+
+struct sm4_ni_consts
+{
+    __m128i pre_lo, pre_hi, post_lo, post_hi, inv_shift_rows, mask;
+};
+
+SM4_NI_TARGET inline __m128i sm4_ni_load(const unsigned char table[16])
+{
+    return _mm_load_si128((const __m128i*)table);
+}
+
+SM4_NI_TARGET inline __m128i sm4_ni_affine(__m128i x, __m128i lo, __m128i hi, __m128i mask)
+{
+    return _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+                         _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+}
+
+SM4_NI_TARGET inline __m128i sm4_ni_rotl(__m128i x, int n)
+{
+    return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+}
+
+// T = L(S(x)) on four words
+SM4_NI_TARGET inline __m128i sm4_ni_t(__m128i x, const sm4_ni_consts& c)
+{
+    x = sm4_ni_affine(x, c.pre_lo, c.pre_hi, c.mask);
+    x = _mm_shuffle_epi8(x, c.inv_shift_rows);
+    x = _mm_aesenclast_si128(x, _mm_setzero_si128());
+    x = sm4_ni_affine(x, c.post_lo, c.post_hi, c.mask);
+
+    // x ^ (x <<< 2) ^ (x <<< 10) ^ (x <<< 18) ^ (x <<< 24)
+    auto y = _mm_xor_si128(x, _mm_xor_si128(sm4_ni_rotl(x, 8), sm4_ni_rotl(x, 16)));
+    return _mm_xor_si128(_mm_xor_si128(x, sm4_ni_rotl(x, 24)), sm4_ni_rotl(y, 2));
+}
+
+SM4_NI_TARGET inline void sm4_ni_transpose(__m128i& x0, __m128i& x1, __m128i& x2, __m128i& x3)
+{
+    auto t0 = _mm_unpacklo_epi32(x0, x1);
+    auto t1 = _mm_unpacklo_epi32(x2, x3);
+    auto t2 = _mm_unpackhi_epi32(x0, x1);
+    auto t3 = _mm_unpackhi_epi32(x2, x3);
+
+    x0 = _mm_unpacklo_epi64(t0, t1);
+    x1 = _mm_unpackhi_epi64(t0, t1);
+    x2 = _mm_unpacklo_epi64(t2, t3);
+    x3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+SM4_NI_TARGET void sm4_ni_x4(const uint32_t sk[32], const unsigned char* input, unsigned char* output, const sm4_ni_consts& c)
+{
+    auto bswap = sm4_ni_load(sm4_bswap32);
+
+    auto x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)input + 0), bswap);
+    auto x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)input + 1), bswap);
+    auto x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)input + 2), bswap);
+    auto x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)input + 3), bswap);
+    sm4_ni_transpose(x0, x1, x2, x3);
+
+    for (int i = 0; i < 32; i += 4) {
+        x0 = _mm_xor_si128(x0, sm4_ni_t(_mm_xor_si128(_mm_xor_si128(x1, x2), _mm_xor_si128(x3, _mm_set1_epi32((int)sk[i]))), c));
+        x1 = _mm_xor_si128(x1, sm4_ni_t(_mm_xor_si128(_mm_xor_si128(x2, x3), _mm_xor_si128(x0, _mm_set1_epi32((int)sk[i + 1]))), c));
+        x2 = _mm_xor_si128(x2, sm4_ni_t(_mm_xor_si128(_mm_xor_si128(x3, x0), _mm_xor_si128(x1, _mm_set1_epi32((int)sk[i + 2]))), c));
+        x3 = _mm_xor_si128(x3, sm4_ni_t(_mm_xor_si128(_mm_xor_si128(x0, x1), _mm_xor_si128(x2, _mm_set1_epi32((int)sk[i + 3]))), c));
+    }
+
+    sm4_ni_transpose(x3, x2, x1, x0);
+    _mm_storeu_si128((__m128i*)output + 0, _mm_shuffle_epi8(x3, bswap));
+    _mm_storeu_si128((__m128i*)output + 1, _mm_shuffle_epi8(x2, bswap));
+    _mm_storeu_si128((__m128i*)output + 2, _mm_shuffle_epi8(x1, bswap));
+    _mm_storeu_si128((__m128i*)output + 3, _mm_shuffle_epi8(x0, bswap));
+}
+
+// ---- 256-bit, VAES + AVX2 ----
+
+struct sm4_vaes_consts
+{
+    __m256i pre_lo, pre_hi, post_lo, post_hi, inv_shift_rows, mask;
+};
+
+SM4_VAES_TARGET inline __m256i sm4_vaes_load(const unsigned char table[16])
+{
+    return _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)table));
+}
+
+SM4_VAES_TARGET inline __m256i sm4_vaes_affine(__m256i x, __m256i lo, __m256i hi, __m256i mask)
+{
+    return _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+                            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+}
+
+SM4_VAES_TARGET inline __m256i sm4_vaes_rotl(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+SM4_VAES_TARGET inline __m256i sm4_vaes_t(__m256i x, const sm4_vaes_consts& c)
+{
+    x = sm4_vaes_affine(x, c.pre_lo, c.pre_hi, c.mask);
+    x = _mm256_shuffle_epi8(x, c.inv_shift_rows);
+    x = _mm256_aesenclast_epi128(x, _mm256_setzero_si256());
+    x = sm4_vaes_affine(x, c.post_lo, c.post_hi, c.mask);
+
+    auto y = _mm256_xor_si256(x, _mm256_xor_si256(sm4_vaes_rotl(x, 8), sm4_vaes_rotl(x, 16)));
+    return _mm256_xor_si256(_mm256_xor_si256(x, sm4_vaes_rotl(x, 24)), sm4_vaes_rotl(y, 2));
+}
+
+// transposes each 128-bit lane on its own, lane 0 holds blocks 0, 2, 4, 6
+SM4_VAES_TARGET inline void sm4_vaes_transpose(__m256i& x0, __m256i& x1, __m256i& x2, __m256i& x3)
+{
+    auto t0 = _mm256_unpacklo_epi32(x0, x1);
+    auto t1 = _mm256_unpacklo_epi32(x2, x3);
+    auto t2 = _mm256_unpackhi_epi32(x0, x1);
+    auto t3 = _mm256_unpackhi_epi32(x2, x3);
+
+    x0 = _mm256_unpacklo_epi64(t0, t1);
+    x1 = _mm256_unpackhi_epi64(t0, t1);
+    x2 = _mm256_unpacklo_epi64(t2, t3);
+    x3 = _mm256_unpackhi_epi64(t2, t3);
+}
+
+SM4_VAES_TARGET void sm4_vaes_x8(const uint32_t sk[32], const unsigned char* input, unsigned char* output, const sm4_vaes_consts& c)
+{
+    auto bswap = sm4_vaes_load(sm4_bswap32);
+
+    auto x0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)input + 0), bswap);
+    auto x1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)input + 1), bswap);
+    auto x2 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)input + 2), bswap);
+    auto x3 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)input + 3), bswap);
+    sm4_vaes_transpose(x0, x1, x2, x3);
+
+    for (int i = 0; i < 32; i += 4) {
+        x0 = _mm256_xor_si256(x0, sm4_vaes_t(_mm256_xor_si256(_mm256_xor_si256(x1, x2), _mm256_xor_si256(x3, _mm256_set1_epi32((int)sk[i]))), c));
+        x1 = _mm256_xor_si256(x1, sm4_vaes_t(_mm256_xor_si256(_mm256_xor_si256(x2, x3), _mm256_xor_si256(x0, _mm256_set1_epi32((int)sk[i + 1]))), c));
+        x2 = _mm256_xor_si256(x2, sm4_vaes_t(_mm256_xor_si256(_mm256_xor_si256(x3, x0), _mm256_xor_si256(x1, _mm256_set1_epi32((int)sk[i + 2]))), c));
+        x3 = _mm256_xor_si256(x3, sm4_vaes_t(_mm256_xor_si256(_mm256_xor_si256(x0, x1), _mm256_xor_si256(x2, _mm256_set1_epi32((int)sk[i + 3]))), c));
+    }
+
+    sm4_vaes_transpose(x3, x2, x1, x0);
+    _mm256_storeu_si256((__m256i*)output + 0, _mm256_shuffle_epi8(x3, bswap));
+    _mm256_storeu_si256((__m256i*)output + 1, _mm256_shuffle_epi8(x2, bswap));
+    _mm256_storeu_si256((__m256i*)output + 2, _mm256_shuffle_epi8(x1, bswap));
+    _mm256_storeu_si256((__m256i*)output + 3, _mm256_shuffle_epi8(x0, bswap));
+}
+
+// ---- 512-bit, VAES + AVX-512 ----
+
+SM4_AVX512_WARNINGS_OFF
+
+struct sm4_vaes512_consts
+{
+    __m512i pre_lo, pre_hi, post_lo, post_hi, inv_shift_rows, mask;
+};
+
+SM4_VAES512_TARGET inline __m512i sm4_vaes512_load(const unsigned char table[16])
+{
+    return _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128((const __m128i*)table));
+}
+
+SM4_VAES512_TARGET inline __m512i sm4_vaes512_affine(__m512i x, __m512i lo, __m512i hi, __m512i mask)
+{
+    return _mm512_xor_si512(_mm512_shuffle_epi8(lo, _mm512_and_si512(x, mask)),
+                            _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi64(x, 4), mask)));
+}
+
+SM4_VAES512_TARGET inline __m512i sm4_vaes512_t(__m512i x, const sm4_vaes512_consts& c)
+{
+    x = sm4_vaes512_affine(x, c.pre_lo, c.pre_hi, c.mask);
+    x = _mm512_shuffle_epi8(x, c.inv_shift_rows);
+    x = _mm512_aesenclast_epi128(x, _mm512_setzero_si512());
+    x = sm4_vaes512_affine(x, c.post_lo, c.post_hi, c.mask);
+
+    // three-way XORs as a single VPTERNLOGD (0x96)
+    auto y = _mm512_ternarylogic_epi32(x, _mm512_rol_epi32(x, 8), _mm512_rol_epi32(x, 16), 0x96);
+    return _mm512_ternarylogic_epi32(x, _mm512_rol_epi32(x, 24), _mm512_rol_epi32(y, 2), 0x96);
+}
+
+SM4_VAES512_TARGET inline void sm4_vaes512_transpose(__m512i& x0, __m512i& x1, __m512i& x2, __m512i& x3)
+{
+    auto t0 = _mm512_unpacklo_epi32(x0, x1);
+    auto t1 = _mm512_unpacklo_epi32(x2, x3);
+    auto t2 = _mm512_unpackhi_epi32(x0, x1);
+    auto t3 = _mm512_unpackhi_epi32(x2, x3);
+
+    x0 = _mm512_unpacklo_epi64(t0, t1);
+    x1 = _mm512_unpackhi_epi64(t0, t1);
+    x2 = _mm512_unpacklo_epi64(t2, t3);
+    x3 = _mm512_unpackhi_epi64(t2, t3);
+}
+
+SM4_VAES512_TARGET inline __m512i sm4_vaes512_round(__m512i x0, __m512i x1, __m512i x2, __m512i x3, uint32_t rk, const sm4_vaes512_consts& c)
+{
+    auto t = _mm512_ternarylogic_epi32(x1, x2, x3, 0x96);
+    return _mm512_xor_si512(x0, sm4_vaes512_t(_mm512_xor_si512(t, _mm512_set1_epi32((int)rk)), c));
+}
+
+SM4_VAES512_TARGET void sm4_vaes512_x16(const uint32_t sk[32], const unsigned char* input, unsigned char* output, const sm4_vaes512_consts& c)
+{
+    auto bswap = sm4_vaes512_load(sm4_bswap32);
+
+    auto x0 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)input + 0), bswap);
+    auto x1 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)input + 1), bswap);
+    auto x2 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)input + 2), bswap);
+    auto x3 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)input + 3), bswap);
+    sm4_vaes512_transpose(x0, x1, x2, x3);
+
+    for (int i = 0; i < 32; i += 4) {
+        x0 = sm4_vaes512_round(x0, x1, x2, x3, sk[i], c);
+        x1 = sm4_vaes512_round(x1, x2, x3, x0, sk[i + 1], c);
+        x2 = sm4_vaes512_round(x2, x3, x0, x1, sk[i + 2], c);
+        x3 = sm4_vaes512_round(x3, x0, x1, x2, sk[i + 3], c);
+    }
+
+    sm4_vaes512_transpose(x3, x2, x1, x0);
+    _mm512_storeu_si512((__m512i*)output + 0, _mm512_shuffle_epi8(x3, bswap));
+    _mm512_storeu_si512((__m512i*)output + 1, _mm512_shuffle_epi8(x2, bswap));
+    _mm512_storeu_si512((__m512i*)output + 2, _mm512_shuffle_epi8(x1, bswap));
+    _mm512_storeu_si512((__m512i*)output + 3, _mm512_shuffle_epi8(x0, bswap));
+}
+
+}
+
+SM4_NI_TARGET void sm4_crypt_blocks_aesni(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    sm4_ni_consts c;
+    c.pre_lo = sm4_ni_load(sm4_pre_lo);
+    c.pre_hi = sm4_ni_load(sm4_pre_hi);
+    c.post_lo = sm4_ni_load(sm4_post_lo);
+    c.post_hi = sm4_ni_load(sm4_post_hi);
+    c.inv_shift_rows = sm4_ni_load(sm4_inv_shift_rows);
+    c.mask = _mm_set1_epi8(0x0F);
+
+    for (; blocks >= 4; blocks -= 4) {
+        sm4_ni_x4(sk, input, output, c);
+        input += 64;
+        output += 64;
+    }
+
+    if (blocks > 0) {
+        unsigned char tmp[64] = { 0 };
+        memcpy(tmp, input, blocks * 16);
+        sm4_ni_x4(sk, tmp, tmp, c);
+        memcpy(output, tmp, blocks * 16);
+        memset(tmp, 0, sizeof(tmp));
+    }
+}
+
+SM4_VAES_TARGET void sm4_crypt_blocks_vaes_avx2(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    sm4_vaes_consts c;
+    c.pre_lo = sm4_vaes_load(sm4_pre_lo);
+    c.pre_hi = sm4_vaes_load(sm4_pre_hi);
+    c.post_lo = sm4_vaes_load(sm4_post_lo);
+    c.post_hi = sm4_vaes_load(sm4_post_hi);
+    c.inv_shift_rows = sm4_vaes_load(sm4_inv_shift_rows);
+    c.mask = _mm256_set1_epi8(0x0F);
+
+    for (; blocks >= 8; blocks -= 8) {
+        sm4_vaes_x8(sk, input, output, c);
+        input += 128;
+        output += 128;
+    }
+
+    if (blocks > 0) {
+        sm4_crypt_blocks_aesni(sk, input, output, blocks);
+    }
+}
+
+SM4_VAES512_TARGET void sm4_crypt_blocks_vaes_avx512(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    sm4_vaes512_consts c;
+    c.pre_lo = sm4_vaes512_load(sm4_pre_lo);
+    c.pre_hi = sm4_vaes512_load(sm4_pre_hi);
+    c.post_lo = sm4_vaes512_load(sm4_post_lo);
+    c.post_hi = sm4_vaes512_load(sm4_post_hi);
+    c.inv_shift_rows = sm4_vaes512_load(sm4_inv_shift_rows);
+    c.mask = _mm512_set1_epi8(0x0F);
+
+    for (; blocks >= 16; blocks -= 16) {
+        sm4_vaes512_x16(sk, input, output, c);
+        input += 256;
+        output += 256;
+    }
+
+    if (blocks > 0) {
+        sm4_crypt_blocks_vaes_avx2(sk, input, output, blocks);
+    }
+}
+
+SM4_AVX512_WARNINGS_ON
+
+#endif
@@ -0,0 +1,641 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "sm4.h"
+#include "sm4_p.h"
+#include "cpu_p.h"
+#include "buffer.h"
+
+#ifdef SM4_HAVE_X86
+#include <immintrin.h>
+#endif
+
+class Sm4GcmPrivate
+{
+public:
+    uint32_t      ek[32];
+    bool          valid;
+
+    // Shoup's 4-bit tables of H for the portable GHASH
+    uint64_t      hl[16];
+    uint64_t      hh[16];
+
+    // H^8 .. H^1, so that block i of an 8-block group is multiplied by pow[i]
+    unsigned char pow[8][16];
+};
+
+namespace
+{
+
+#define GCM_GET_ULONG_BE(n, b, i) {          \
+    (n) = ((uint32_t)(b)[(i)    ] << 24)     \
+        | ((uint32_t)(b)[(i) + 1] << 16)     \
+        | ((uint32_t)(b)[(i) + 2] <<  8)     \
+        | ((uint32_t)(b)[(i) + 3]      );    \
+}
+
+#define GCM_PUT_ULONG_BE(n, b, i) {                  \
+    (b)[(i)    ] = (unsigned char)((n) >> 24);       \
+    (b)[(i) + 1] = (unsigned char)((n) >> 16);       \
+    (b)[(i) + 2] = (unsigned char)((n) >>  8);       \
+    (b)[(i) + 3] = (unsigned char)((n)      );       \
+}
+
+// X = (X ^ block) * H for each block
+typedef void (*ghash_func)(const Sm4GcmPrivate* d, unsigned char x[16], const unsigned char* data, int blocks);
+
+constexpr int block_size = 16;
+
+// key stream blocks encrypted per kernel call; the chunk is hashed right after
+// it is produced, while it is still in L1
+constexpr int chunk_blocks = 256;
+
+// SP 800-38D limits the payload to 2^32 - 2 blocks
+constexpr uint64_t max_data_len = (((uint64_t)1 << 32) - 2) * block_size;
+
+// ---- portable GHASH, 4 bits at a time ----
+
+const uint64_t ghash_last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+void ghash_gen_table(uint64_t hl[16], uint64_t hh[16], const unsigned char h[16])
+{
+    uint32_t w[4];
+    uint64_t vh, vl;
+    int i, j;
+
+    GCM_GET_ULONG_BE(w[0], h, 0)
+    GCM_GET_ULONG_BE(w[1], h, 4)
+    GCM_GET_ULONG_BE(w[2], h, 8)
+    GCM_GET_ULONG_BE(w[3], h, 12)
+    vh = ((uint64_t)w[0] << 32) | w[1];
+    vl = ((uint64_t)w[2] << 32) | w[3];
+
+    // index 8 holds H, 4, 2 and 1 its successive halvings
+    hl[8] = vl;
+    hh[8] = vh;
+    hl[0] = 0;
+    hh[0] = 0;
+
+    for (i = 4; i > 0; i >>= 1) {
+        uint32_t t = (uint32_t)(vl & 1) * 0xe1000000U;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ ((uint64_t)t << 32);
+        hl[i] = vl;
+        hh[i] = vh;
+    }
+
+    for (i = 2; i <= 8; i *= 2) {
+        vh = hh[i];
+        vl = hl[i];
+        for (j = 1; j < i; ++j) {
+            hh[i + j] = vh ^ hh[j];
+            hl[i + j] = vl ^ hl[j];
+        }
+    }
+}
+
+void ghash_mult(const uint64_t hl[16], const uint64_t hh[16], unsigned char x[16])
+{
+    uint64_t zh, zl;
+    unsigned char lo, hi, rem;
+    int i;
+
+    lo = x[15] & 0x0f;
+    zh = hh[lo];
+    zl = hl[lo];
+
+    for (i = 15; i >= 0; --i) {
+        lo = x[i] & 0x0f;
+        hi = (x[i] >> 4) & 0x0f;
+
+        if (i != 15) {
+            rem = (unsigned char)(zl & 0x0f);
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (ghash_last4[rem] << 48);
+            zh ^= hh[lo];
+            zl ^= hl[lo];
+        }
+
+        rem = (unsigned char)(zl & 0x0f);
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (ghash_last4[rem] << 48);
+        zh ^= hh[hi];
+        zl ^= hl[hi];
+    }
+
+    GCM_PUT_ULONG_BE((uint32_t)(zh >> 32), x, 0)
+    GCM_PUT_ULONG_BE((uint32_t)zh, x, 4)
+    GCM_PUT_ULONG_BE((uint32_t)(zl >> 32), x, 8)
+    GCM_PUT_ULONG_BE((uint32_t)zl, x, 12)
+}
+
+void ghash_table(const Sm4GcmPrivate* d, unsigned char x[16], const unsigned char* data, int blocks)
+{
+    int b, i;
+
+    for (b = 0; b < blocks; ++b, data += block_size) {
+        for (i = 0; i < block_size; ++i) {
+            x[i] ^= data[i];
+        }
+        ghash_mult(d->hl, d->hh, x);
+    }
+}
+
+#ifdef SM4_HAVE_X86
+
+// ---- PCLMULQDQ ----
+//
+// Operands are byte reversed on load so that a 64x64 carry-less multiply sees
+// GCM's bit order as a plain polynomial (Intel's GCM white paper, algorithm
+// 5). Eight blocks are multiplied by H^8 .. H^1 and their unreduced products
+// summed, so one reduction serves the whole group.
+
+#define GHASH_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#define GHASH_VPCLMUL_TARGET __attribute__((target("pclmul,vpclmulqdq,avx512f,avx512bw")))
+
+alignas(16) const unsigned char ghash_bswap128[16] = {
+    0x0F, 0x0E, 0x0D, 0x0C, 0x0B, 0x0A, 0x09, 0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00
+};
+
+GHASH_CLMUL_TARGET inline __m128i ghash_clmul_load(const unsigned char* p, __m128i bswap)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), bswap);
+}
+
+GHASH_CLMUL_TARGET inline void ghash_clmul_acc(__m128i a, __m128i b, __m128i& lo, __m128i& mid, __m128i& hi)
+{
+    lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+    hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+    mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x01));
+    mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x10));
+}
+
+GHASH_CLMUL_TARGET inline __m128i ghash_clmul_reduce(__m128i lo, __m128i mid, __m128i hi)
+{
+    __m128i t2, t7, t8, t9;
+
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // the operands are bit reflected, so the product is one bit short
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(hi, _mm_or_si128(t8, t9));
+
+    // modulo x^128 + x^7 + x^2 + x + 1
+    t7 = _mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_xor_si128(_mm_slli_epi32(lo, 30), _mm_slli_epi32(lo, 25)));
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    lo = _mm_xor_si128(lo, t7);
+
+    t2 = _mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_xor_si128(_mm_srli_epi32(lo, 2), _mm_srli_epi32(lo, 7)));
+    t2 = _mm_xor_si128(t2, t8);
+    lo = _mm_xor_si128(lo, t2);
+
+    return _mm_xor_si128(hi, lo);
+}
+
+GHASH_CLMUL_TARGET void ghash_clmul(const Sm4GcmPrivate* d, unsigned char x[16], const unsigned char* data, int blocks)
+{
+    const __m128i bswap = _mm_load_si128((const __m128i*)ghash_bswap128);
+    __m128i h[8];
+    __m128i lo, mid, hi, z;
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        h[i] = ghash_clmul_load(d->pow[i], bswap);
+    }
+
+    __m128i acc = ghash_clmul_load(x, bswap);
+
+    for (; blocks >= 8; blocks -= 8, data += 8 * block_size) {
+        lo = mid = hi = _mm_setzero_si128();
+        for (i = 0; i < 8; ++i) {
+            z = ghash_clmul_load(data + i * block_size, bswap);
+            if (i == 0) {
+                z = _mm_xor_si128(z, acc);
+            }
+            ghash_clmul_acc(z, h[i], lo, mid, hi);
+        }
+        acc = ghash_clmul_reduce(lo, mid, hi);
+    }
+
+    for (; blocks > 0; --blocks, data += block_size) {
+        lo = mid = hi = _mm_setzero_si128();
+        z = _mm_xor_si128(ghash_clmul_load(data, bswap), acc);
+        ghash_clmul_acc(z, h[7], lo, mid, hi);
+        acc = ghash_clmul_reduce(lo, mid, hi);
+    }
+
+    _mm_storeu_si128((__m128i*)x, _mm_shuffle_epi8(acc, bswap));
+}
+
+// ---- VPCLMULQDQ, four blocks per 512-bit register ----
+
+SM4_AVX512_WARNINGS_OFF
+
+GHASH_VPCLMUL_TARGET inline void ghash_vpclmul_acc(__m512i a, __m512i b, __m512i& lo, __m512i& mid, __m512i& hi)
+{
+    lo = _mm512_xor_si512(lo, _mm512_clmulepi64_epi128(a, b, 0x00));
+    hi = _mm512_xor_si512(hi, _mm512_clmulepi64_epi128(a, b, 0x11));
+    mid = _mm512_ternarylogic_epi64(mid, _mm512_clmulepi64_epi128(a, b, 0x01), _mm512_clmulepi64_epi128(a, b, 0x10), 0x96);
+}
+
+GHASH_VPCLMUL_TARGET inline __m128i ghash_vpclmul_fold(__m512i v)
+{
+    __m256i t = _mm256_xor_si256(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+    return _mm_xor_si128(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));
+}
+
+GHASH_VPCLMUL_TARGET void ghash_vpclmul(const Sm4GcmPrivate* d, unsigned char x[16], const unsigned char* data, int blocks)
+{
+    if (blocks >= 8) {
+        const __m512i bswap = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128((const __m128i*)ghash_bswap128));
+        const __m512i h0 = _mm512_shuffle_epi8(_mm512_loadu_si512(d->pow[0]), bswap);
+        const __m512i h1 = _mm512_shuffle_epi8(_mm512_loadu_si512(d->pow[4]), bswap);
+        __m512i a, b, lo, mid, hi;
+
+        __m128i acc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)x), _mm512_castsi512_si128(bswap));
+
+        for (; blocks >= 8; blocks -= 8, data += 8 * block_size) {
+            a = _mm512_shuffle_epi8(_mm512_loadu_si512(data), bswap);
+            b = _mm512_shuffle_epi8(_mm512_loadu_si512(data + 4 * block_size), bswap);
+            a = _mm512_xor_si512(a, _mm512_zextsi128_si512(acc));
+
+            lo = mid = hi = _mm512_setzero_si512();
+            ghash_vpclmul_acc(a, h0, lo, mid, hi);
+            ghash_vpclmul_acc(b, h1, lo, mid, hi);
+            acc = ghash_clmul_reduce(ghash_vpclmul_fold(lo), ghash_vpclmul_fold(mid), ghash_vpclmul_fold(hi));
+        }
+
+        _mm_storeu_si128((__m128i*)x, _mm_shuffle_epi8(acc, _mm512_castsi512_si128(bswap)));
+    }
+
+    if (blocks > 0) {
+        ghash_clmul(d, x, data, blocks);
+    }
+}
+
+SM4_AVX512_WARNINGS_ON
+
+#endif
+
+const cpu_kernel<ghash_func> ghash_kernels[] = {
+#ifdef SM4_HAVE_X86
+    { "vpclmul", CPU_VPCLMUL | CPU_AVX512F | CPU_AVX512BW, ghash_vpclmul },
+    { "clmul", CPU_PCLMUL | CPU_SSSE3, ghash_clmul },
+#endif
+    { "table", 0, ghash_table },
+};
+
+void ghash(const Sm4GcmPrivate* d, unsigned char x[16], const unsigned char* data, int blocks)
+{
+    static const ghash_func func = cpu_select("ghash", ghash_kernels);
+    func(d, x, data, blocks);
+}
+
+// J0 with its low 32 bits advanced by n (inc32 applied n times)
+void gcm_counter_block(const unsigned char j0[16], uint32_t n, unsigned char output[16])
+{
+    uint32_t c;
+
+    memcpy(output, j0, 12);
+    GCM_GET_ULONG_BE(c, j0, 12)
+    c += n;
+    GCM_PUT_ULONG_BE(c, output, 12)
+}
+
+void gcm_length_block(uint64_t aadLen, uint64_t dataLen, unsigned char output[16])
+{
+    uint64_t a = aadLen * 8;
+    uint64_t c = dataLen * 8;
+
+    GCM_PUT_ULONG_BE((uint32_t)(a >> 32), output, 0)
+    GCM_PUT_ULONG_BE((uint32_t)a, output, 4)
+    GCM_PUT_ULONG_BE((uint32_t)(c >> 32), output, 8)
+    GCM_PUT_ULONG_BE((uint32_t)c, output, 12)
+}
+
+}
+
+Sm4Gcm::Sm4Gcm(const Sm4Key& key)
+    : m_ptr{ new Sm4GcmPrivate }
+{
+    unsigned char h[block_size] = { 0 };
+    int i;
+
+    memcpy(m_ptr->ek, key.m_ek, sizeof(m_ptr->ek));
+    m_ptr->valid = key.isValid();
+
+    // H = E(K, 0^128)
+    sm4_crypt_ecb(m_ptr->ek, h, h, 1);
+    ghash_gen_table(m_ptr->hl, m_ptr->hh, h);
+
+    memcpy(m_ptr->pow[7], h, block_size);
+    for (i = 6; i >= 0; --i) {
+        memcpy(m_ptr->pow[i], m_ptr->pow[i + 1], block_size);
+        ghash_mult(m_ptr->hl, m_ptr->hh, m_ptr->pow[i]);
+    }
+
+    memset(h, 0, sizeof(h));
+}
+
+Sm4Gcm::~Sm4Gcm()
+{
+    memset(m_ptr, 0, sizeof(Sm4GcmPrivate));
+    delete m_ptr;
+}
+
+bool Sm4Gcm::isValid() const
+{
+    return m_ptr->valid;
+}
+
+bool Sm4Gcm::encrypt(const Buffer& iv, const Buffer& aad, const char* data, int len, char* output, unsigned char tag[16]) const
+{
+    if ((!data && len > 0) || (!output && len > 0) || len < 0 || !tag) {
+        return false;
+    }
+
+    Sm4GcmStream stream{ *this, iv, true };
+    return stream.updateAad(aad.data(), aad.size())
+        && stream.update(data, len, output)
+        && stream.finish(tag);
+}
+
+bool Sm4Gcm::encrypt(const Buffer& iv, const Buffer& aad, const Buffer& data, Buffer& output, Buffer& tag) const
+{
+    unsigned char t[block_size];
+
+    output.resize(data.size());
+    if (!encrypt(iv, aad, data.data(), data.size(), output.data(), t)) {
+        return false;
+    }
+
+    tag = Buffer{ (const char*)t, block_size };
+    return true;
+}
+
+bool Sm4Gcm::decrypt(const Buffer& iv, const Buffer& aad, const char* data, int len, const unsigned char tag[16], char* output) const
+{
+    if ((!data && len > 0) || (!output && len > 0) || len < 0 || !tag) {
+        return false;
+    }
+
+    Sm4GcmStream stream{ *this, iv, false };
+    if (stream.updateAad(aad.data(), aad.size())
+        && stream.update(data, len, output)
+        && stream.verify(tag)) {
+        return true;
+    }
+
+    if (len > 0) {
+        memset(output, 0, len);
+    }
+    return false;
+}
+
+bool Sm4Gcm::decrypt(const Buffer& iv, const Buffer& aad, const Buffer& data, const Buffer& tag, Buffer& output) const
+{
+    if (tag.size() != block_size) {
+        return false;
+    }
+
+    output.resize(data.size());
+    if (!decrypt(iv, aad, data.data(), data.size(), (const unsigned char*)tag.data(), output.data())) {
+        output.resize(0);
+        return false;
+    }
+
+    return true;
+}
+
+Sm4GcmStream::Sm4GcmStream(const Sm4Gcm& gcm, const Buffer& iv, bool encrypt)
+    : m_gcm{ gcm }
+    , m_x{ 0 }
+    , m_block{ 0 }
+    , m_stream{ 0 }
+    , m_counter{ 0 }
+    , m_aadLen{ 0 }
+    , m_dataLen{ 0 }
+    , m_encrypt{ encrypt }
+    , m_payload{ false }
+    , m_done{ !gcm.isValid() || iv.isEmpty() }
+{
+    memset(m_j0, 0, sizeof(m_j0));
+    if (m_done) {
+        return;
+    }
+
+    auto d = m_gcm.m_ptr;
+    auto p = (const unsigned char*)iv.data();
+    int len = iv.size();
+
+    if (len == 12) {
+        memcpy(m_j0, p, 12);
+        m_j0[15] = 1;
+        return;
+    }
+
+    // J0 = GHASH(IV || 0-pad || 0^64 || [len(IV)]64)
+    unsigned char last[block_size] = { 0 };
+    ghash(d, m_j0, p, len / block_size);
+    if (len % block_size) {
+        memcpy(last, p + len / block_size * block_size, len % block_size);
+        ghash(d, m_j0, last, 1);
+    }
+    gcm_length_block(0, (uint64_t)len, last);
+    ghash(d, m_j0, last, 1);
+}
+
+Sm4GcmStream::~Sm4GcmStream()
+{
+    memset(m_j0, 0, sizeof(m_j0));
+    memset(m_x, 0, sizeof(m_x));
+    memset(m_block, 0, sizeof(m_block));
+    memset(m_stream, 0, sizeof(m_stream));
+}
+
+bool Sm4GcmStream::updateAad(const char* aad, int len)
+{
+    if (m_done || m_payload || len < 0 || (!aad && len > 0)) {
+        return false;
+    }
+
+    auto d = m_gcm.m_ptr;
+    auto input = (const unsigned char*)aad;
+    int off = (int)(m_aadLen % block_size);
+    int n;
+
+    m_aadLen += len;
+
+    if (off > 0) {
+        n = std::min(block_size - off, len);
+        memcpy(m_block + off, input, n);
+        input += n;
+        len -= n;
+        if (off + n < block_size) {
+            return true;
+        }
+        ghash(d, m_x, m_block, 1);
+    }
+
+    n = len / block_size;
+    ghash(d, m_x, input, n);
+    input += n * block_size;
+    len -= n * block_size;
+
+    memcpy(m_block, input, len);
+    return true;
+}
+
+void Sm4GcmStream::flushAad()
+{
+    int off = (int)(m_aadLen % block_size);
+    if (off > 0) {
+        memset(m_block + off, 0, block_size - off);
+        ghash(m_gcm.m_ptr, m_x, m_block, 1);
+    }
+    m_payload = true;
+}
+
+bool Sm4GcmStream::update(const char* data, int len, char* output)
+{
+    if (m_done || len < 0 || (len > 0 && (!data || !output)) || (uint64_t)len > max_data_len - m_dataLen) {
+        return false;
+    }
+    if (!m_payload) {
+        flushAad();
+    }
+
+    auto d = m_gcm.m_ptr;
+    auto input = (const unsigned char*)data;
+    auto out = (unsigned char*)output;
+    int off = (int)(m_dataLen % block_size);
+    int i, n;
+
+    m_dataLen += len;
+
+    // finish the block left open by the previous call
+    if (off > 0) {
+        n = std::min(block_size - off, len);
+        for (i = 0; i < n; ++i) {
+            unsigned char c = input[i];
+            out[i] = (unsigned char)(c ^ m_stream[off + i]);
+            m_block[off + i] = m_encrypt ? out[i] : c;
+        }
+        input += n;
+        out += n;
+        len -= n;
+        if (off + n < block_size) {
+            return true;
+        }
+        ghash(d, m_x, m_block, 1);
+    }
+
+    // whole blocks: key stream for a chunk, then hash that chunk's ciphertext
+    unsigned char stream[chunk_blocks * block_size];
+    int blocks = len / block_size;
+
+    while (blocks > 0) {
+        n = std::min(blocks, chunk_blocks);
+
+        for (i = 0; i < n; ++i) {
+            gcm_counter_block(m_j0, m_counter + 1 + i, stream + i * block_size);
+        }
+        sm4_crypt_ecb(d->ek, stream, stream, n);
+
+        // hash the ciphertext before output overwrites it when decrypting in place
+        if (!m_encrypt) {
+            ghash(d, m_x, input, n);
+        }
+        for (i = 0; i < n * block_size; ++i) {
+            out[i] = (unsigned char)(input[i] ^ stream[i]);
+        }
+        if (m_encrypt) {
+            ghash(d, m_x, out, n);
+        }
+
+        m_counter += n;
+        input += n * block_size;
+        out += n * block_size;
+        len -= n * block_size;
+        blocks -= n;
+    }
+
+    memset(stream, 0, sizeof(stream));
+
+    // start a new block and keep the rest of its key stream
+    if (len > 0) {
+        gcm_counter_block(m_j0, ++m_counter, m_stream);
+        sm4_crypt_ecb(d->ek, m_stream, m_stream, 1);
+        for (i = 0; i < len; ++i) {
+            unsigned char c = input[i];
+            out[i] = (unsigned char)(c ^ m_stream[i]);
+            m_block[i] = m_encrypt ? out[i] : c;
+        }
+    }
+
+    return true;
+}
+
+bool Sm4GcmStream::finish(unsigned char tag[16])
+{
+    if (m_done || !tag) {
+        return false;
+    }
+    if (!m_payload) {
+        flushAad();
+    }
+
+    auto d = m_gcm.m_ptr;
+    int off = (int)(m_dataLen % block_size);
+    int i;
+
+    if (off > 0) {
+        memset(m_block + off, 0, block_size - off);
+        ghash(d, m_x, m_block, 1);
+    }
+
+    gcm_length_block(m_aadLen, m_dataLen, m_block);
+    ghash(d, m_x, m_block, 1);
+
+    // T = E(K, J0) ^ S
+    sm4_crypt_ecb(d->ek, m_j0, m_stream, 1);
+    for (i = 0; i < block_size; ++i) {
+        tag[i] = (unsigned char)(m_x[i] ^ m_stream[i]);
+    }
+
+    m_done = true;
+    return true;
+}
+
+bool Sm4GcmStream::verify(const unsigned char tag[16])
+{
+    unsigned char expected[block_size];
+    unsigned char diff = 0;
+    int i;
+
+    if (!tag || !finish(expected)) {
+        return false;
+    }
+
+    // constant time compare
+    for (i = 0; i < block_size; ++i) {
+        diff |= (unsigned char)(expected[i] ^ tag[i]);
+    }
+
+    memset(expected, 0, sizeof(expected));
+    return diff == 0;
+}
@@ -0,0 +1,158 @@
+#include "sm4_p.h"
+
+#ifdef SM4_HAVE_X86
+
+#include <immintrin.h>
+
+SM4_AVX512_WARNINGS_OFF
+
+// GFNI evaluates the SM4 S-box directly: S(x) = M2 * inv(M1 * x + c1) + c2,
+// where inv is the inversion in the AES field that VGF2P8AFFINEINVQB applies
+// before its affine transform. M1 and M2 fold in the isomorphism between the
+// SM4 and AES representations of GF(2^8), so a layer of 64 S-boxes is one
+// VGF2P8AFFINEQB and one VGF2P8AFFINEINVQB, without the nibble lookups and
+// the ShiftRows correction of the AES-NI kernels.
+//
+// Blocks are transposed so that a register holds the same word of 16 blocks.
+
+namespace
+{
+
+#define SM4_GFNI_TARGET __attribute__((target("gfni,avx512f,avx512bw")))
+
+// bit matrices in the VGF2P8AFFINEQB layout: byte 7 - i is the row giving
+// output bit i
+constexpr long long sm4_gfni_pre = 0x4C287DB91A22505DLL;
+constexpr int sm4_gfni_pre_const = 0x3E;
+constexpr long long sm4_gfni_post = (long long)0xF3AB34A974A6B589ULL;
+constexpr int sm4_gfni_post_const = 0xD3;
+
+// big endian words to native order
+alignas(16) const unsigned char sm4_gfni_bswap32[16] = {
+    0x03, 0x02, 0x01, 0x00, 0x07, 0x06, 0x05, 0x04, 0x0B, 0x0A, 0x09, 0x08, 0x0F, 0x0E, 0x0D, 0x0C
+};
+
+struct sm4_gfni_consts
+{
+    __m512i pre, post, bswap;
+};
+
+// T = L(S(x)) on sixteen words
+SM4_GFNI_TARGET inline __m512i sm4_gfni_t(__m512i x, const sm4_gfni_consts& c)
+{
+    x = _mm512_gf2p8affine_epi64_epi8(x, c.pre, sm4_gfni_pre_const);
+    x = _mm512_gf2p8affineinv_epi64_epi8(x, c.post, sm4_gfni_post_const);
+
+    // x ^ (x <<< 2) ^ (x <<< 10) ^ (x <<< 18) ^ (x <<< 24)
+    auto y = _mm512_ternarylogic_epi32(x, _mm512_rol_epi32(x, 8), _mm512_rol_epi32(x, 16), 0x96);
+    return _mm512_ternarylogic_epi32(x, _mm512_rol_epi32(x, 24), _mm512_rol_epi32(y, 2), 0x96);
+}
+
+SM4_GFNI_TARGET inline __m512i sm4_gfni_round(__m512i x0, __m512i x1, __m512i x2, __m512i x3, uint32_t rk, const sm4_gfni_consts& c)
+{
+    auto t = _mm512_ternarylogic_epi32(x1, x2, x3, 0x96);
+    return _mm512_xor_si512(x0, sm4_gfni_t(_mm512_xor_si512(t, _mm512_set1_epi32((int)rk)), c));
+}
+
+SM4_GFNI_TARGET inline void sm4_gfni_transpose(__m512i& x0, __m512i& x1, __m512i& x2, __m512i& x3)
+{
+    auto t0 = _mm512_unpacklo_epi32(x0, x1);
+    auto t1 = _mm512_unpacklo_epi32(x2, x3);
+    auto t2 = _mm512_unpackhi_epi32(x0, x1);
+    auto t3 = _mm512_unpackhi_epi32(x2, x3);
+
+    x0 = _mm512_unpacklo_epi64(t0, t1);
+    x1 = _mm512_unpackhi_epi64(t0, t1);
+    x2 = _mm512_unpacklo_epi64(t2, t3);
+    x3 = _mm512_unpackhi_epi64(t2, t3);
+}
+
+// 64-bit byte masks of the four registers covering the first `blocks` blocks
+SM4_GFNI_TARGET inline __mmask64 sm4_gfni_mask(int blocks, int reg)
+{
+    int n = blocks - reg * 4;
+    if (n >= 4) {
+        return ~(__mmask64)0;
+    }
+    return n <= 0 ? 0 : (((__mmask64)1 << (n * 16)) - 1);
+}
+
+// up to 16 blocks, fewer are loaded and stored with byte masks
+SM4_GFNI_TARGET void sm4_gfni_x16(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks, const sm4_gfni_consts& c)
+{
+    __m512i x0, x1, x2, x3;
+    __mmask64 m0 = 0, m1 = 0, m2 = 0, m3 = 0;
+
+    if (blocks >= 16) {
+        x0 = _mm512_loadu_si512((const __m512i*)input + 0);
+        x1 = _mm512_loadu_si512((const __m512i*)input + 1);
+        x2 = _mm512_loadu_si512((const __m512i*)input + 2);
+        x3 = _mm512_loadu_si512((const __m512i*)input + 3);
+    }
+    else {
+        m0 = sm4_gfni_mask(blocks, 0);
+        m1 = sm4_gfni_mask(blocks, 1);
+        m2 = sm4_gfni_mask(blocks, 2);
+        m3 = sm4_gfni_mask(blocks, 3);
+        x0 = _mm512_maskz_loadu_epi8(m0, input);
+        x1 = _mm512_maskz_loadu_epi8(m1, input + 64);
+        x2 = _mm512_maskz_loadu_epi8(m2, input + 128);
+        x3 = _mm512_maskz_loadu_epi8(m3, input + 192);
+    }
+
+    x0 = _mm512_shuffle_epi8(x0, c.bswap);
+    x1 = _mm512_shuffle_epi8(x1, c.bswap);
+    x2 = _mm512_shuffle_epi8(x2, c.bswap);
+    x3 = _mm512_shuffle_epi8(x3, c.bswap);
+    sm4_gfni_transpose(x0, x1, x2, x3);
+
+    for (int i = 0; i < 32; i += 4) {
+        x0 = sm4_gfni_round(x0, x1, x2, x3, sk[i], c);
+        x1 = sm4_gfni_round(x1, x2, x3, x0, sk[i + 1], c);
+        x2 = sm4_gfni_round(x2, x3, x0, x1, sk[i + 2], c);
+        x3 = sm4_gfni_round(x3, x0, x1, x2, sk[i + 3], c);
+    }
+
+    sm4_gfni_transpose(x3, x2, x1, x0);
+    x3 = _mm512_shuffle_epi8(x3, c.bswap);
+    x2 = _mm512_shuffle_epi8(x2, c.bswap);
+    x1 = _mm512_shuffle_epi8(x1, c.bswap);
+    x0 = _mm512_shuffle_epi8(x0, c.bswap);
+
+    if (blocks >= 16) {
+        _mm512_storeu_si512((__m512i*)output + 0, x3);
+        _mm512_storeu_si512((__m512i*)output + 1, x2);
+        _mm512_storeu_si512((__m512i*)output + 2, x1);
+        _mm512_storeu_si512((__m512i*)output + 3, x0);
+    }
+    else {
+        _mm512_mask_storeu_epi8(output, m0, x3);
+        _mm512_mask_storeu_epi8(output + 64, m1, x2);
+        _mm512_mask_storeu_epi8(output + 128, m2, x1);
+        _mm512_mask_storeu_epi8(output + 192, m3, x0);
+    }
+}
+
+}
+
+SM4_GFNI_TARGET void sm4_crypt_blocks_gfni_avx512(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks)
+{
+    sm4_gfni_consts c;
+    c.pre = _mm512_set1_epi64(sm4_gfni_pre);
+    c.post = _mm512_set1_epi64(sm4_gfni_post);
+    c.bswap = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)sm4_gfni_bswap32));
+
+    for (; blocks >= 16; blocks -= 16) {
+        sm4_gfni_x16(sk, input, output, 16, c);
+        input += 256;
+        output += 256;
+    }
+
+    if (blocks > 0) {
+        sm4_gfni_x16(sk, input, output, blocks, c);
+    }
+}
+
+SM4_AVX512_WARNINGS_ON
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+// Multi-block SM4 kernels. Every block is processed independently (ECB) with
+// the given subkeys, so the same kernel serves encryption and decryption.
+typedef void (*sm4_blocks_func)(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// Bitsliced, constant time, 64 blocks per batch. Shorter inputs are padded
+// to a full batch. Note that the "bs64" and "bs-avx2" backends built on these
+// kernels hand calls of fewer than 32 blocks (sm4_bs_min_blocks) to the table
+// kernel, and that CBC encryption and the CTR head/tail blocks are table based
+// on every backend; see sm4_kernels[] in sm4.cpp.
+void sm4_crypt_blocks_bs64(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// Whole blocks through the kernel selected for this CPU (sm4.cpp), for the
+// modes implemented in other files.
+void sm4_crypt_ecb(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SM4_HAVE_X86 1
+
+// Bitsliced with AVX2, 256 blocks per batch
+void sm4_crypt_blocks_bs_avx2(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// S-box evaluated with AESENCLAST, 4 blocks per 128-bit register
+void sm4_crypt_blocks_aesni(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// VAES with AVX2, 8 blocks per iteration
+void sm4_crypt_blocks_vaes_avx2(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// VAES with AVX-512, 16 blocks per iteration
+void sm4_crypt_blocks_vaes_avx512(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// S-box evaluated with GFNI affine transforms, 16 blocks per iteration
+void sm4_crypt_blocks_gfni_avx512(const uint32_t sk[32], const unsigned char* input, unsigned char* output, int blocks);
+
+// GCC's AVX-512 headers (12 at least) pass a deliberately self-initialized
+// _mm512_undefined_*() as the merge source of unmasked intrinsics, and once
+// inlined into a kernel it trips -Wuninitialized/-Wmaybe-uninitialized. The
+// AVX-512 sections of the kernel files are wrapped in these two, and nothing
+// else.
+#if defined(__GNUC__) && !defined(__clang__)
+#define SM4_AVX512_WARNINGS_OFF                                   \
+    _Pragma("GCC diagnostic push")                                \
+    _Pragma("GCC diagnostic ignored \"-Wuninitialized\"")        \
+    _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define SM4_AVX512_WARNINGS_ON _Pragma("GCC diagnostic pop")
+#else
+#define SM4_AVX512_WARNINGS_OFF
+#define SM4_AVX512_WARNINGS_ON
+#endif
+#endif
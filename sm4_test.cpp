@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sm3.h"
+#include "sm4.h"
+#include "buffer.h"
+#include "cpu_p.h"
+
+// Checks every SM4 block kernel and GHASH kernel against the portable ones.
+// The kernel is picked once per process, so the test runs itself once per
+// backend with BUFFER_BACKEND_SM4 / BUFFER_BACKEND_GHASH set. Each run puts
+// the same pseudo-random keys, IVs and messages of assorted block counts
+// through CBC, CTR, XTS, GCM and the batch calls, hashes every output with
+// SM3 and prints the digest; all of them must match the scalar/table run.
+// Backends the CPU lacks are reported as skipped.
+
+namespace
+{
+
+const char* const sm4_backends[] = { "gfni-avx512", "vaes-avx512", "vaes-avx2", "aesni", "bs-avx2", "bs64" };
+const char* const ghash_backends[] = { "vpclmul", "clmul" };
+
+// random bytes; the generator is seeded, so every run sees the same data
+std::vector<char> randomData(std::mt19937& rng, int len)
+{
+    std::vector<char> data(len);
+    for (auto& ch : data) {
+        ch = static_cast<char>(rng());
+    }
+    return data;
+}
+
+Buffer randomBuffer(std::mt19937& rng, int len)
+{
+    auto data = randomData(rng, len);
+    return Buffer{ data.data(), len };
+}
+
+// mostly short messages, which hit the partial batches of the SIMD kernels,
+// and now and then one long enough for their full width and the threads
+int randomBlocks(std::mt19937& rng)
+{
+    switch (rng() % 8) {
+    case 0:
+        return 33000 + (int)(rng() % 1000);
+    case 1:
+        return 256 + (int)(rng() % 2048);
+    default:
+        return (int)(rng() % 70);
+    }
+}
+
+// GB/T 32907 example 1, one block through CTR over zeros
+bool knownAnswer()
+{
+    auto key = Buffer::fromHex("0123456789ABCDEFFEDCBA9876543210");
+    auto expected = Buffer::fromHex("681EDF34D206965E86B3E94F536E4246");
+
+    char zero[16] = { 0 };
+    char output[16];
+    Sm4Ctr ctr{ Sm4Key{ key }, key };
+    return ctr.crypt(zero, 16, output) && memcmp(output, expected.data(), 16) == 0;
+}
+
+// sm4::encrypt(buffer, key, buffer) and friends: the output grows, which can
+// move the input it is reading
+bool inPlace(std::mt19937& rng)
+{
+    auto key = randomBuffer(rng, 16);
+    Sm4Key expanded{ key };
+
+    for (int len = 1; len < 300; len += 7) {
+        auto data = randomBuffer(rng, len);
+        Buffer expected;
+        if (!expanded.encrypt(data, expected)) {
+            return false;
+        }
+
+        Buffer buffer = data;
+        if (!sm4::encrypt(buffer, key, buffer) || buffer != expected
+            || !sm4::decrypt(buffer, key, buffer) || buffer != data) {
+            fprintf(stderr, "sm4_test: in-place CBC failed, %d bytes\n", len);
+            return false;
+        }
+
+        // the input further into the output buffer
+        Buffer shifted{ 16 };
+        shifted.append(data);
+        if (!expanded.encrypt(shifted.data() + 16, len, shifted) || shifted != expected) {
+            fprintf(stderr, "sm4_test: CBC from inside the output failed, %d bytes\n", len);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run(Sm3Hash& hash)
+{
+    std::mt19937 rng{ 2024 };
+
+    for (int i = 0; i < 200; ++i) {
+        Sm4Key key{ randomBuffer(rng, 16) };
+        int blocks = randomBlocks(rng);
+        int len = blocks * 16 + (int)(rng() % 16);
+        auto data = randomData(rng, len);
+
+        // CBC: the decryption runs on the multi-block kernels
+        Buffer cipher, plain;
+        if (!key.encrypt(data.data(), len, cipher) || !key.decrypt(cipher, plain)
+            || plain.size() != len || memcmp(plain.data(), data.data(), len) != 0) {
+            fprintf(stderr, "sm4_test: CBC round trip failed, message %d\n", i);
+            return false;
+        }
+        hash.update(cipher);
+
+        // CTR from a random counter, which may carry into the upper half
+        std::vector<char> output(len);
+        Sm4Ctr ctr{ key, randomBuffer(rng, 16) };
+        if (!ctr.crypt(data.data(), len, output.data())) {
+            return false;
+        }
+        hash.update(output.data(), len);
+
+        // XTS with whole sectors, and one sector with ciphertext stealing
+        Sm4Xts xts{ randomBuffer(rng, 32), i % 2 ? Sm4Xts::GbT17964 : Sm4Xts::Ieee1619 };
+        int sectors = len / 512;
+        if (sectors > 0) {
+            if (!xts.encryptSectors(rng(), 512, sectors, data.data(), output.data())) {
+                return false;
+            }
+            hash.update(output.data(), sectors * 512);
+        }
+        if (len >= 16) {
+            int sector = std::min(len, 4096);
+            if (!xts.encrypt(rng(), data.data(), sector, output.data())) {
+                return false;
+            }
+            hash.update(output.data(), sector);
+        }
+
+        // GCM with some associated data and a 12-byte or odd IV
+        Sm4Gcm gcm{ key };
+        auto iv = randomBuffer(rng, i % 3 ? 12 : 1 + (int)(rng() % 40));
+        auto aad = randomBuffer(rng, (int)(rng() % 100));
+        unsigned char tag[16];
+        if (!gcm.encrypt(iv, aad, data.data(), len, output.data(), tag)) {
+            return false;
+        }
+        hash.update(output.data(), len);
+        hash.update(reinterpret_cast<const char*>(tag), 16);
+
+        std::vector<char> check(len);
+        if (!gcm.decrypt(iv, aad, output.data(), len, tag, check.data()) || check != data) {
+            fprintf(stderr, "sm4_test: GCM round trip failed, message %d\n", i);
+            return false;
+        }
+    }
+
+    // batches of short messages under one key
+    for (int i = 0; i < 20; ++i) {
+        Sm4Key key{ randomBuffer(rng, 16) };
+        std::vector<std::vector<char>> inputs, outputs;
+        std::vector<Sm4Message> messages;
+        int count = 1 + (int)(rng() % 40);
+        for (int m = 0; m < count; ++m) {
+            int len = (int)(rng() % 200);
+            inputs.push_back(randomData(rng, len));
+            outputs.emplace_back(sm4::encryptedSize(len));
+        }
+        for (int m = 0; m < count; ++m) {
+            messages.push_back({ inputs[m].data(), (int)inputs[m].size(), outputs[m].data(), (int)outputs[m].size(), 0 });
+        }
+        if (!key.encryptBatch(messages.data(), count)) {
+            return false;
+        }
+        for (auto& output : outputs) {
+            hash.update(output.data(), (int)output.size());
+        }
+    }
+    return true;
+}
+
+// the backend a kernel ended up with, from cpu_report()
+std::string selected(const std::string& report, const std::string& kernel)
+{
+    auto pos = report.find("; " + kernel + ": ");
+    if (pos == std::string::npos) {
+        return "?";
+    }
+    pos += kernel.size() + 4;
+    return report.substr(pos, report.find(';', pos) - pos);
+}
+
+// one pass with the backends forced by the environment
+int child()
+{
+    if (!knownAnswer()) {
+        fprintf(stderr, "sm4_test: known answer test failed\n");
+        return 1;
+    }
+
+    std::mt19937 rng{ 7 };
+    if (!inPlace(rng)) {
+        return 1;
+    }
+
+    Sm3Hash hash;
+    if (!run(hash)) {
+        return 1;
+    }
+
+    auto report = cpu_report();
+    printf("%s %s %s\n", selected(report, "sm4").c_str(), selected(report, "ghash").c_str(), hash.finish().toHex().c_str());
+    return 0;
+}
+
+// runs the child with the given backends; false if it failed
+bool spawn(const char* self, const char* sm4, const char* ghash, std::string& line)
+{
+    setenv("BUFFER_BACKEND_SM4", sm4, 1);
+    setenv("BUFFER_BACKEND_GHASH", ghash, 1);
+
+    std::string command{ "'" };
+    command.append(self).append("' --child");
+    auto pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        return false;
+    }
+
+    char buffer[256] = { 0 };
+    bool read = fgets(buffer, sizeof(buffer), pipe) != nullptr;
+    int status = pclose(pipe);
+
+    line = buffer;
+    if (!line.empty() && line.back() == '\n') {
+        line.pop_back();
+    }
+    return read && status == 0;
+}
+
+int check(const char* self, const char* kernel, const char* backend, const char* sm4, const char* ghash, const std::string& reference)
+{
+    std::string line;
+    if (!spawn(self, sm4, ghash, line)) {
+        printf("%-6s %-12s FAILED\n", kernel, backend);
+        return 1;
+    }
+
+    // the child prints the backends it got; a forced one the CPU cannot run
+    // falls back to the default
+    auto got = line.substr(0, line.find(' '));
+    if (strcmp(kernel, "ghash") == 0) {
+        got = line.substr(got.size() + 1, line.find(' ', got.size() + 1) - got.size() - 1);
+    }
+    if (got != backend) {
+        printf("%-6s %-12s skipped (not supported)\n", kernel, backend);
+        return 0;
+    }
+
+    auto digest = line.substr(line.rfind(' ') + 1);
+    if (digest != reference) {
+        printf("%-6s %-12s MISMATCH\n", kernel, backend);
+        return 1;
+    }
+    printf("%-6s %-12s ok\n", kernel, backend);
+    return 0;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--child") == 0) {
+        return child();
+    }
+    if (argc > 1) {
+        fprintf(stderr, "Usage: sm4_test\n");
+        return 1;
+    }
+
+    // large messages are split between threads even on a single core
+    setenv("BUFFER_SM4_THREADS", "3", 0);
+    unsetenv("BUFFER_CPU_DISABLE");
+
+    std::string reference;
+    if (!spawn(argv[0], "scalar", "table", reference)) {
+        printf("%-6s %-12s FAILED\n", "sm4", "scalar");
+        return 1;
+    }
+    reference = reference.substr(reference.rfind(' ') + 1);
+    printf("%-6s %-12s reference\n", "sm4", "scalar");
+
+    int failures = 0;
+    for (auto backend : sm4_backends) {
+        failures += check(argv[0], "sm4", backend, backend, "table", reference);
+    }
+    for (auto backend : ghash_backends) {
+        failures += check(argv[0], "ghash", backend, "scalar", backend, reference);
+    }
+
+    if (failures) {
+        printf("%d backend(s) failed\n", failures);
+    }
+    return failures ? 1 : 0;
+}
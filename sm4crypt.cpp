@@ -0,0 +1,549 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sm3.h"
+#include "sm4.h"
+#include "buffer.h"
+
+namespace fs = std::filesystem;
+
+// File layout, all integers big endian:
+//
+//   header   "SM4F" | version u8 | kdf u8 | reserved u16 | chunk size u32 |
+//            iterations u32 | salt[16] | nonce[8] | plaintext size u64
+//   chunk i  ciphertext (chunk size, the last one shorter) | GCM tag[16]
+//
+// Every chunk is sealed with SM4-GCM on its own: the IV is the file nonce
+// followed by the 32-bit chunk index (so a file has at most 2^32 chunks), and
+// the whole header is the associated data, so a chunk cannot be moved,
+// dropped or spliced from another file. Chunk i starts at
+// header + i * (chunk size + 16), which lets any chunk be read and verified
+// without touching the others. An empty file still has one (empty) chunk so
+// that its header is authenticated.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+constexpr char magic[4] = { 'S', 'M', '4', 'F' };
+constexpr uint8_t version = 1;
+constexpr int header_size = 48;
+constexpr int tag_size = 16;
+constexpr int salt_size = 16;
+constexpr int nonce_size = 8;
+// the IV carries the chunk index in 32 bits
+constexpr int64_t max_chunks = (int64_t)1 << 32;
+
+enum Kdf : uint8_t
+{
+    RawKey = 0,
+    Pbkdf2Sm3 = 1
+};
+
+struct Header
+{
+    uint8_t       kdf = RawKey;
+    uint32_t      chunkSize = 4 * 1024 * 1024;
+    uint32_t      iterations = 0;
+    unsigned char salt[salt_size] = { 0 };
+    unsigned char nonce[nonce_size] = { 0 };
+    uint64_t      size = 0;
+
+    int64_t chunks() const
+    {
+        return std::max<int64_t>(1, (int64_t)(size / chunkSize + (size % chunkSize != 0)));
+    }
+
+    int chunkLength(int64_t index) const
+    {
+        return (int)std::min<uint64_t>(chunkSize, size - (uint64_t)index * chunkSize);
+    }
+
+    Buffer encode() const
+    {
+        Buffer buffer;
+        BufferWriter writer{ buffer };
+        writer.write(magic, sizeof(magic));
+        writer << version << kdf << (uint16_t)0 << chunkSize << iterations;
+        writer.write((const char*)salt, salt_size);
+        writer.write((const char*)nonce, nonce_size);
+        writer << size;
+        return buffer;
+    }
+
+    bool decode(const Buffer& buffer)
+    {
+        char m[sizeof(magic)];
+        uint8_t v = 0;
+        uint16_t reserved = 0;
+
+        BufferReader reader{ buffer };
+        if (reader.read(m, sizeof(m)) != sizeof(m) || memcmp(m, magic, sizeof(m)) != 0) {
+            return false;
+        }
+        reader >> v >> kdf >> reserved >> chunkSize >> iterations;
+        reader.read((char*)salt, salt_size);
+        reader.read((char*)nonce, nonce_size);
+        reader >> size;
+
+        return reader.position() == header_size && v == version && reserved == 0 && chunkSize > 0 && chunkSize <= (1u << 30)
+            && chunks() <= max_chunks && (kdf == RawKey || (kdf == Pbkdf2Sm3 && iterations > 0));
+    }
+
+    Buffer iv(int64_t index) const
+    {
+        Buffer buffer{ (const char*)nonce, nonce_size };
+        BufferWriter writer{ buffer };
+        writer << (uint32_t)index;
+        return buffer;
+    }
+};
+
+// Chunks are processed by a pool of workers while the calling thread writes
+// the results in order. At most window chunks are in flight (being read,
+// processed or waiting for the writer), which bounds memory use to about
+// 2 * window chunks whatever the file size.
+class OrderedPool
+{
+public:
+    // input is a per-worker stream of the input file, scratch a per-worker buffer
+    using Process = std::function<bool(int64_t index, std::ifstream& input, Buffer& scratch, Buffer& output)>;
+    using Sink = std::function<bool(int64_t index, const Buffer& output)>;
+
+    OrderedPool(int threads, int window)
+        : m_threads{ std::max(threads, 1) }
+        , m_window{ std::max(window, 1) }
+    {
+    }
+
+    bool run(const fs::path& input, int64_t count, const Process& process, const Sink& sink)
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < m_threads; ++i) {
+            threads.emplace_back([&] { work(input, count, process); });
+        }
+
+        // ordered writer
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        while (m_written < count && !m_failed) {
+            auto it = m_done.find(m_written);
+            if (it == m_done.end()) {
+                m_cond.wait(lock);
+                continue;
+            }
+
+            Buffer output = std::move(it->second);
+            m_done.erase(it);
+
+            lock.unlock();
+            bool ok = sink(m_written, output);
+            lock.lock();
+
+            if (!ok) {
+                fail(m_written);
+                break;
+            }
+            ++m_written;
+            m_cond.notify_all();
+        }
+        lock.unlock();
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return !m_failed;
+    }
+
+    int64_t failedIndex() const
+    {
+        return m_failedIndex;
+    }
+
+private:
+    void work(const fs::path& path, int64_t count, const Process& process)
+    {
+        std::ifstream input{ path, std::ios::binary };
+        Buffer scratch;
+
+        for (;;) {
+            int64_t index;
+            {
+                std::unique_lock<std::mutex> lock{ m_mutex };
+                m_cond.wait(lock, [&] { return m_failed || m_next >= count || m_next - m_written < m_window; });
+                if (m_failed || m_next >= count) {
+                    return;
+                }
+                index = m_next++;
+            }
+
+            Buffer output;
+            bool ok = input && process(index, input, scratch, output);
+
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            if (!ok) {
+                fail(index);
+                return;
+            }
+            m_done.emplace(index, std::move(output));
+            m_cond.notify_all();
+        }
+    }
+
+    void fail(int64_t index)
+    {
+        if (!m_failed || index < m_failedIndex) {
+            m_failedIndex = index;
+        }
+        m_failed = true;
+        m_cond.notify_all();
+    }
+
+private:
+    int                      m_threads;
+    int                      m_window;
+    std::mutex               m_mutex;
+    std::condition_variable  m_cond;
+    std::map<int64_t, Buffer> m_done;
+    int64_t                  m_next = 0;
+    int64_t                  m_written = 0;
+    int64_t                  m_failedIndex = 0;
+    bool                     m_failed = false;
+};
+
+enum class Mode
+{
+    None,
+    Encrypt,
+    Decrypt,
+    Test
+};
+
+struct Options
+{
+    Mode        mode = Mode::None;
+    std::string key;        // hex
+    std::string password;
+    bool        hasPassword = false;
+    uint32_t    iterations = 100000;
+    uint32_t    chunkSize = 4 * 1024 * 1024;
+    int         jobs = static_cast<int>(std::thread::hardware_concurrency());
+    int         window = 0;
+    bool        stats = true;
+    fs::path    input;
+    fs::path    output;
+};
+
+bool readAt(std::ifstream& input, uint64_t offset, char* data, int len)
+{
+    input.seekg((std::streamoff)offset);
+    input.read(data, len);
+    return input.gcount() == len;
+}
+
+void randomBytes(unsigned char* data, int len)
+{
+    std::random_device rd;
+    for (int i = 0; i < len; ++i) {
+        data[i] = static_cast<unsigned char>(rd());
+    }
+}
+
+bool deriveKey(const Options& options, const Header& header, Buffer& key)
+{
+    if (header.kdf == Pbkdf2Sm3) {
+        if (!options.hasPassword) {
+            fprintf(stderr, "sm4crypt: the file is password protected, use --password\n");
+            return false;
+        }
+        key = sm3::pbkdf2(Buffer{ options.password }, Buffer{ (const char*)header.salt, salt_size }, (int)header.iterations, 16);
+        return true;
+    }
+
+    if (options.key.empty()) {
+        fprintf(stderr, "sm4crypt: the file uses a raw key, use --key\n");
+        return false;
+    }
+    // Buffer::fromHex only decodes upper case digits
+    std::string hex = options.key;
+    for (auto& ch : hex) {
+        ch = static_cast<char>(toupper((unsigned char)ch));
+    }
+    if (hex.size() != 32 || hex.find_first_not_of("0123456789ABCDEF") != std::string::npos) {
+        fprintf(stderr, "sm4crypt: --key needs 32 hex digits\n");
+        return false;
+    }
+
+    key = Buffer::fromHex(hex);
+    return true;
+}
+
+int encryptFile(const Options& options, OrderedPool& pool, uint64_t& bytes)
+{
+    // The size goes into the header, which every chunk authenticates, and
+    // the workers read chunks at their offsets, so the size must be known
+    // up front: pipes are refused, and so are procfs-like files that claim
+    // to be empty but are not.
+    std::error_code ec;
+    auto status = fs::status(options.input, ec);
+    if (!ec && !fs::is_regular_file(status)) {
+        fprintf(stderr, "sm4crypt: %s: not a regular file\n", options.input.string().c_str());
+        return 1;
+    }
+    auto size = ec ? 0 : fs::file_size(options.input, ec);
+    if (ec) {
+        fprintf(stderr, "sm4crypt: %s: %s\n", options.input.string().c_str(), ec.message().c_str());
+        return 1;
+    }
+    if (size == 0 && std::ifstream{ options.input, std::ios::binary }.peek() != std::ifstream::traits_type::eof()) {
+        fprintf(stderr, "sm4crypt: %s: file size unknown\n", options.input.string().c_str());
+        return 1;
+    }
+
+    Header header;
+    header.chunkSize = options.chunkSize;
+    header.size = size;
+    if (header.chunks() > max_chunks) {
+        fprintf(stderr, "sm4crypt: %s: too many chunks, use a larger --chunk-size\n", options.input.string().c_str());
+        return 1;
+    }
+    randomBytes(header.nonce, nonce_size);
+    if (options.hasPassword) {
+        header.kdf = Pbkdf2Sm3;
+        header.iterations = options.iterations;
+        randomBytes(header.salt, salt_size);
+    }
+
+    Buffer key;
+    if (!deriveKey(options, header, key)) {
+        return 1;
+    }
+
+    Sm4Gcm gcm{ Sm4Key{ key } };
+    Buffer aad = header.encode();
+
+    std::ofstream output{ options.output, std::ios::binary | std::ios::trunc };
+    if (!output.write(aad.data(), aad.size())) {
+        fprintf(stderr, "sm4crypt: %s: cannot write\n", options.output.string().c_str());
+        output.close();
+        fs::remove(options.output, ec);
+        return 1;
+    }
+
+    auto process = [&](int64_t index, std::ifstream& input, Buffer& scratch, Buffer& out) {
+        int len = header.chunkLength(index);
+        scratch.resizeForOverwrite(len);
+        if (len > 0 && !readAt(input, (uint64_t)index * header.chunkSize, scratch.data(), len)) {
+            return false;
+        }
+
+        out.resizeForOverwrite(len + tag_size);
+        return gcm.encrypt(header.iv(index), aad, scratch.data(), len, out.data(), (unsigned char*)out.data() + len);
+    };
+    auto sink = [&](int64_t, const Buffer& out) {
+        return (bool)output.write(out.data(), out.size());
+    };
+
+    if (!pool.run(options.input, header.chunks(), process, sink) || !output.flush()) {
+        fprintf(stderr, "sm4crypt: chunk %lld: read or write error\n", (long long)pool.failedIndex());
+        // no truncated file left behind, as in decryptFile
+        output.close();
+        fs::remove(options.output, ec);
+        return 1;
+    }
+
+    bytes = size;
+    return 0;
+}
+
+int decryptFile(const Options& options, OrderedPool& pool, uint64_t& bytes)
+{
+    std::ifstream input{ options.input, std::ios::binary };
+    Buffer aad{ header_size };
+    Header header;
+    if (!readAt(input, 0, aad.data(), header_size) || !header.decode(aad)) {
+        fprintf(stderr, "sm4crypt: %s: not an sm4crypt file\n", options.input.string().c_str());
+        return 1;
+    }
+
+    // the header fixes the exact file size, so truncation shows up here
+    std::error_code ec;
+    auto size = fs::file_size(options.input, ec);
+    if (ec || size != header_size + header.size + (uint64_t)header.chunks() * tag_size) {
+        fprintf(stderr, "sm4crypt: %s: truncated or extended file\n", options.input.string().c_str());
+        return 1;
+    }
+
+    Buffer key;
+    if (!deriveKey(options, header, key)) {
+        return 1;
+    }
+
+    Sm4Gcm gcm{ Sm4Key{ key } };
+    uint64_t stride = (uint64_t)header.chunkSize + tag_size;
+
+    std::ofstream output;
+    if (options.mode == Mode::Decrypt) {
+        output.open(options.output, std::ios::binary | std::ios::trunc);
+        if (!output) {
+            fprintf(stderr, "sm4crypt: %s: cannot write\n", options.output.string().c_str());
+            return 1;
+        }
+    }
+
+    auto process = [&](int64_t index, std::ifstream& in, Buffer& scratch, Buffer& out) {
+        int len = header.chunkLength(index);
+        scratch.resizeForOverwrite(len + tag_size);
+        if (!readAt(in, header_size + (uint64_t)index * stride, scratch.data(), len + tag_size)) {
+            return false;
+        }
+
+        out.resizeForOverwrite(len);
+        return gcm.decrypt(header.iv(index), aad, scratch.data(), len, (const unsigned char*)scratch.data() + len, out.data());
+    };
+    auto sink = [&](int64_t, const Buffer& out) {
+        return options.mode != Mode::Decrypt || (bool)output.write(out.data(), out.size());
+    };
+
+    bool ok = pool.run(options.input, header.chunks(), process, sink);
+    if (options.mode == Mode::Decrypt) {
+        ok = output.flush() && ok;
+        output.close();
+    }
+
+    if (!ok) {
+        fprintf(stderr, "sm4crypt: chunk %lld: authentication failed (wrong key or corrupted data)\n", (long long)pool.failedIndex());
+        if (options.mode == Mode::Decrypt) {
+            fs::remove(options.output, ec);
+        }
+        return 1;
+    }
+
+    bytes = header.size;
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr,
+            "Usage: sm4crypt (-e|-d|-t) [OPTION]... INPUT [OUTPUT]\n"
+            "Encrypt or decrypt a file with SM4-GCM in independently sealed chunks.\n"
+            "\n"
+            "  -e, --encrypt         encrypt INPUT to OUTPUT\n"
+            "  -d, --decrypt         decrypt INPUT to OUTPUT\n"
+            "  -t, --test            verify every chunk of INPUT without writing output\n"
+            "  -k, --key HEX         128-bit key as 32 hex digits\n"
+            "  -p, --password PASS   derive the key with PBKDF2-HMAC-SM3\n"
+            "                        (or set SM4CRYPT_PASSWORD)\n"
+            "      --iterations N    PBKDF2 iterations when encrypting (default 100000)\n"
+            "  -s, --chunk-size N    chunk size in KiB when encrypting (default 4096)\n"
+            "  -j, --jobs N          number of worker threads (default: hardware concurrency)\n"
+            "      --window N        chunks in flight at most (default: 2 * jobs)\n"
+            "      --no-stats        don't report throughput\n"
+            "  -h, --help            display this help and exit\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    std::vector<std::string> paths;
+
+    if (auto env = getenv("SM4CRYPT_PASSWORD")) {
+        options.password = env;
+        options.hasPassword = true;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string{ argv[i] };
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-e" || arg == "--encrypt") {
+            options.mode = Mode::Encrypt;
+        }
+        else if (arg == "-d" || arg == "--decrypt") {
+            options.mode = Mode::Decrypt;
+        }
+        else if (arg == "-t" || arg == "--test") {
+            options.mode = Mode::Test;
+        }
+        else if ((arg == "-k" || arg == "--key") && hasValue) {
+            options.key = argv[++i];
+        }
+        else if ((arg == "-p" || arg == "--password") && hasValue) {
+            options.password = argv[++i];
+            options.hasPassword = true;
+        }
+        else if (arg == "--iterations" && hasValue) {
+            options.iterations = (uint32_t)std::max(1, atoi(argv[++i]));
+        }
+        else if ((arg == "-s" || arg == "--chunk-size") && hasValue) {
+            options.chunkSize = (uint32_t)std::min(std::max(1, atoi(argv[++i])), 1024 * 1024) * 1024;
+        }
+        else if ((arg == "-j" || arg == "--jobs") && hasValue) {
+            options.jobs = atoi(argv[++i]);
+        }
+        else if (arg == "--window" && hasValue) {
+            options.window = atoi(argv[++i]);
+        }
+        else if (arg == "--no-stats") {
+            options.stats = false;
+        }
+        else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        }
+        else if (arg.size() > 1 && arg[0] == '-') {
+            usage();
+            return 1;
+        }
+        else {
+            paths.push_back(arg);
+        }
+    }
+
+    size_t expected = options.mode == Mode::Test ? 1 : 2;
+    if (options.mode == Mode::None || paths.size() != expected) {
+        usage();
+        return 1;
+    }
+
+    options.input = paths[0];
+    if (paths.size() > 1) {
+        options.output = paths[1];
+    }
+    if (options.mode == Mode::Encrypt && options.hasPassword && !options.key.empty()) {
+        fprintf(stderr, "sm4crypt: use either --key or --password\n");
+        return 1;
+    }
+
+    int jobs = std::max(options.jobs, 1);
+    OrderedPool pool{ jobs, options.window > 0 ? options.window : 2 * jobs };
+
+    auto start = Clock::now();
+    uint64_t bytes = 0;
+    int ret = options.mode == Mode::Encrypt ? encryptFile(options, pool, bytes) : decryptFile(options, pool, bytes);
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (ret == 0 && options.stats) {
+        fprintf(stderr, "sm4crypt: %.1f MiB in %.3f s, %.1f MiB/s\n",
+                bytes / 1048576.0, elapsed, elapsed > 0 ? bytes / 1048576.0 / elapsed : 0.0);
+    }
+    return ret;
+}